@@ -0,0 +1,207 @@
+// Array benchmarks. The first table times each kernel set this CPU can
+// run (array.h) on arrays of the given size (default 64K elements, which
+// stay in cache; at millions the kernels wait on memory) and checks that
+// every set gives the scalar loops' results bit for bit. The second runs scripts that
+// compute the same thing with a while loop and with array operations;
+// both forms must print the same. Exits 1 on any mismatch.
+//   ./array_bench [repetitions] [elements]
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "array.h"
+#include "compiler.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "vm.h"
+
+static size_t elements = 65536;
+
+template <typename F>
+static double bestMs(int reps, F f) {
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    return best;
+}
+
+// One kernel call on fixed inputs, writing into out (room for a double
+// per element); returns the number of bytes of result
+struct KernelCase {
+    const char* name;
+    size_t (*run)(const ArrayKernels& k, char* out);
+};
+
+struct Inputs {
+    std::vector<int32_t> ints, ints2;
+    std::vector<double> doubles, doubles2;
+    Inputs() : ints(elements), ints2(elements), doubles(elements), doubles2(elements) {
+        uint32_t x = 12345;
+        for (size_t i = 0; i < elements; ++i) {
+            x = x * 1103515245u + 12345u;
+            ints[i] = static_cast<int32_t>(x >> 8) - (1 << 23);
+            ints2[i] = static_cast<int32_t>(x % 1000) + 1;
+            doubles[i] = ints[i] * 0.001;
+            doubles2[i] = ints2[i] * 0.25;
+        }
+    }
+};
+
+static const Inputs& in() {
+    static const Inputs inputs;
+    return inputs;
+}
+
+static int32_t* ints(char* out) { return reinterpret_cast<int32_t*>(out); }
+static double* doubles(char* out) { return reinterpret_cast<double*>(out); }
+
+template <typename T>
+static size_t result(char* out, T value) {
+    std::memcpy(out, &value, sizeof value);
+    return sizeof value;
+}
+
+static const int32_t three = 3;
+static const double zero = 0;
+
+static const KernelCase kernelCases[] = {
+    {"int a+b", [](const ArrayKernels& k, char* out) {
+        k.arithInt(ArrayOp::Add, in().ints.data(), false, in().ints2.data(), false, ints(out), elements);
+        return elements * sizeof(int32_t);
+    }},
+    {"int a*3", [](const ArrayKernels& k, char* out) {
+        k.arithInt(ArrayOp::Mul, in().ints.data(), false, &three, true, ints(out), elements);
+        return elements * sizeof(int32_t);
+    }},
+    {"double a/b", [](const ArrayKernels& k, char* out) {
+        k.arithDouble(ArrayOp::Div, in().doubles.data(), false, in().doubles2.data(), false, doubles(out), elements);
+        return elements * sizeof(double);
+    }},
+    {"int a<b", [](const ArrayKernels& k, char* out) {
+        k.compareInt(ArrayOp::Lt, in().ints.data(), false, in().ints2.data(), false, ints(out), elements);
+        return elements * sizeof(int32_t);
+    }},
+    {"double a>=0", [](const ArrayKernels& k, char* out) {
+        k.compareDouble(ArrayOp::Gte, in().doubles.data(), false, &zero, true, ints(out), elements);
+        return elements * sizeof(int32_t);
+    }},
+    {"widen", [](const ArrayKernels& k, char* out) {
+        k.widen(in().ints.data(), doubles(out), elements);
+        return elements * sizeof(double);
+    }},
+    {"sum int", [](const ArrayKernels& k, char* out) { return result(out, k.sumInt(in().ints.data(), elements)); }},
+    {"sum double", [](const ArrayKernels& k, char* out) { return result(out, k.sumDouble(in().doubles.data(), elements)); }},
+    {"min double", [](const ArrayKernels& k, char* out) { return result(out, k.minDouble(in().doubles.data(), elements)); }},
+    {"max int", [](const ArrayKernels& k, char* out) { return result(out, k.maxInt(in().ints.data(), elements)); }},
+    {"count int", [](const ArrayKernels& k, char* out) { return result(out, k.countInt(in().ints2.data(), elements)); }},
+    {"count double", [](const ArrayKernels& k, char* out) { return result(out, k.countDouble(in().doubles.data(), elements)); }},
+};
+
+struct ScriptCase {
+    const char* name;
+    const char* loop;
+    const char* array;
+};
+
+static const ScriptCase scriptCases[] = {
+    {"sum",
+     "i = 0; s = 0; while (i < 1000000) { s = s + i * 3 + 1; i = i + 1; } print s;",
+     "print sum(range(1000000) * 3 + 1);"},
+    {"count",
+     "i = 0; c = 0; while (i < 1000000) { if (i % 7 < 3) c = c + 1; i = i + 1; } print c;",
+     "print count(range(1000000) % 7 < 3);"},
+    {"max",
+     "i = 0; m = 0 - 100000; while (i < 1000000) { v = i * 7919 % 10007; if (v > m) m = v; i = i + 1; } print m;",
+     "print max(range(1000000) * 7919 % 10007);"},
+    {"double",
+     "i = 0; s = 0.0; while (i < 1000000) { s = s + i * 0.5; i = i + 1; } print s;",
+     "print sum(range(1000000) * 0.5);"},
+};
+
+static Chunk compileSource(const std::string& source) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    Ast ast = parser.parse();
+    foldConstants(ast);
+    Compiler compiler;
+    Chunk chunk = compiler.compile(ast);
+    peephole(chunk);
+    return chunk;
+}
+
+// One VM for every repetition, so later runs reuse the array blocks of
+// the first like a long-running program would
+static double timeScript(const std::string& source, bool jit, int reps, std::string& output) {
+    Chunk chunk = compileSource(source);
+    VM vm;
+    vm.setJit(jit);
+    CaptureSink captured;
+    vm.setOutput(&captured);
+    return bestMs(reps, [&] {
+        vm.reset();
+        captured.clear();
+        vm.run(chunk);
+        output = captured.str();
+    });
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? std::stoi(argv[1]) : 3;
+    if (argc > 2) elements = std::stoul(argv[2]);
+    bool ok = true;
+    auto sets = availableArrayKernels();
+    const ArrayKernels& scalar = *sets.back();
+
+    // arrays of 'elements', enough of them to make a million elements
+    const size_t calls = std::max<size_t>(1, 1000000 / elements);
+    std::cout << "kernels on " << elements << "-element arrays, ms per million elements (speedup over "
+              << scalar.name << ")\n";
+    std::cout << std::left << std::setw(14) << "kernel";
+    for (auto* set : sets) std::cout << std::setw(18) << set->name;
+    std::cout << "\n" << std::fixed << std::setprecision(3);
+    std::vector<char> expected(elements * sizeof(double)), got(expected.size());
+    for (const auto& c : kernelCases) {
+        size_t bytes = c.run(scalar, expected.data());
+        auto time = [&](const ArrayKernels& set) {
+            return bestMs(reps, [&] { for (size_t k = 0; k < calls; ++k) c.run(set, got.data()); }) * 1e6 /
+                   static_cast<double>(calls * elements);
+        };
+        double base = time(scalar);
+        std::cout << std::setw(14) << c.name;
+        for (auto* set : sets) {
+            std::fill(got.begin(), got.end(), 0);
+            bool same = c.run(*set, got.data()) == bytes && std::memcmp(got.data(), expected.data(), bytes) == 0;
+            ok = ok && same;
+            double ms = set == &scalar ? base : time(*set);
+            std::string cell = std::to_string(ms).substr(0, 6) + " (" + std::to_string(base / ms).substr(0, 4) + "x)";
+            std::cout << std::setw(18) << (same ? cell : "MISMATCH");
+        }
+        std::cout << "\n";
+    }
+
+    std::cout << "\nscripts, ms (stack VM, quickened; the loop also with the JIT)\n";
+    std::cout << std::setw(10) << "script" << std::setw(10) << "loop" << std::setw(10) << "loop+JIT"
+              << std::setw(10) << "array" << std::setw(10) << "vs loop" << "vs JIT\n";
+    for (const auto& c : scriptCases) {
+        std::string loopOut, jitOut, arrayOut;
+        double loop = timeScript(c.loop, false, reps, loopOut);
+        double jit = timeScript(c.loop, true, reps, jitOut);
+        double array = timeScript(c.array, false, reps, arrayOut);
+        bool same = loopOut == arrayOut && jitOut == arrayOut;
+        ok = ok && same;
+        std::cout << std::setw(10) << c.name << std::setw(10) << loop << std::setw(10) << jit
+                  << std::setw(10) << array << std::setprecision(1)
+                  << std::setw(10) << (std::to_string(loop / array).substr(0, 4) + "x")
+                  << std::to_string(jit / array).substr(0, 4) << "x" << std::setprecision(3)
+                  << (same ? "" : "  OUTPUT DIFFERS") << "\n";
+    }
+    return ok ? 0 : 1;
+}
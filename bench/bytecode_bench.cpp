@@ -0,0 +1,399 @@
+// End-to-end benchmark suite with regression tracking. Each workload is
+// lexed, parsed, compiled and run several times and the best time of
+// every phase is kept, so a change can be judged phase by phase:
+//   ./bytecode_bench                         print the table
+//   ./bytecode_bench --json=base.json        also save the results
+//   ./bytecode_bench --baseline=base.json    compare against saved results
+// In compare mode a phase that got slower than the baseline by more than
+// --threshold percent (default 10) is flagged and the exit status is 1.
+// Phases faster than --min-ms in the baseline (default 5) are shown with
+// a '?' but not judged, they are too short to time reliably. Workloads whose
+// output changed are flagged as well. Other options: -O,
+// --engine=register (skips the double workload), --reps=N (default 5)
+// and workload names to run a subset.
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "regcompiler.h"
+#include "regvm.h"
+#include "vm.h"
+
+// ---- workloads ----
+
+static std::string tightArith() {
+    return "i = 0; s = 0;\n"
+           "while (i < 12000000) { s = (s + i * 7 - i / 3) % 100003; i = i + 1; }\n"
+           "print s;\n";
+}
+
+// Many live variables, read and written on every iteration
+static std::string variableHeavy() {
+    const int vars = 200;
+    std::string s;
+    for (int v = 0; v < vars; ++v) s += "v" + std::to_string(v) + " = " + std::to_string(v) + ";\n";
+    s += "i = 0;\nwhile (i < 100000) {\n";
+    for (int v = 0; v < vars; ++v) {
+        int a = (v * 7 + 3) % vars, b = (v * 13 + 5) % vars;
+        s += "    v" + std::to_string(v) + " = (v" + std::to_string(a) + " + v" + std::to_string(b) + ") % 1000;\n";
+    }
+    s += "    i = i + 1;\n}\nprint v0; print v199;\n";
+    return s;
+}
+
+// One expression nested 400 deep, evaluated in a loop. Every level adds
+// or subtracts a small value, so nothing overflows.
+static std::string deepExpression() {
+    std::string e = "a";
+    for (int k = 0; k < 400; ++k)
+        e = "(" + e + (k % 2 ? " - " : " + ") + "(a % " + std::to_string(k % 5 + 2) + "))";
+    return "a = 0; s = 0;\n"
+           "while (a < 80000) { s = (s + " + e + ") % 100003; a = a + 1; }\n"
+           "print s;\n";
+}
+
+static std::string branchy() {
+    return "i = 0; n = 0;\n"
+           "while (i < 8000000) {\n"
+           "    if (i % 3 == 0 || i % 5 == 0 && !(i % 7 == 0)) n = n + 1;\n"
+           "    else if (i % 11 < 4) n = n + 2; else n = n - 1;\n"
+           "    if (n > 1000) n = n - 1000;\n"
+           "    i = i + 1;\n"
+           "}\n"
+           "print n;\n";
+}
+
+static std::string printHeavy() {
+    return "i = 0; while (i < 3000000) { print i * 3 - 1000; i = i + 1; }\n";
+}
+
+// Double arithmetic: a midpoint sum for the integral of x*x over [0, 3].
+// The JIT leaves it alone, so this times the interpreter's double path.
+static std::string floatArith() {
+    return "i = 0; s = 0.0;\n"
+           "while (i < 6000000) { x = (i + 0.5) * 0.0000005; s = s + x * x * 0.0000005; i = i + 1; }\n"
+           "print s;\n";
+}
+
+// Straight-line code of the shapes gen_script writes, so the front end
+// dominates
+static std::string largeSource() {
+    const int vars = 64;
+    uint32_t seed = 12345;
+    auto pick = [&] {
+        seed = seed * 1103515245u + 12345u;
+        return "v" + std::to_string((seed >> 16) % vars);
+    };
+    std::string s;
+    for (int v = 0; v < vars; ++v) s += "v" + std::to_string(v) + " = " + std::to_string(v * 7) + ";\n";
+    for (long i = 0; i < 200000; ++i) {
+        std::string a = pick(), b = pick(), c = pick();
+        switch (i % 4) {
+            case 0:
+                s += "if (" + a + " > " + b + ") { " + c + " = " + c + " + 1; } else { " + c + " = " + c + " - 1; }\n";
+                break;
+            case 1:
+                s += a + " = !(" + b + " == " + c + ") && " + b + " <= 500 || " + c + " > 900;\n";
+                break;
+            case 2:
+                s += a + " = " + b + " % 997 - " + c + " / 13;\n";
+                break;
+            default:
+                if (i % 1000 == 3) s += "print " + a + ";\n";
+                else s += a + " = (" + b + " * 3 + " + c + ") % 1000;\n";
+                break;
+        }
+    }
+    return s;
+}
+
+struct Workload {
+    const char* name;
+    std::string (*source)();
+    bool doubles = false;     // the register engine cannot run it
+};
+
+static const Workload workloads[] = {
+    {"arith",     tightArith},
+    {"variables", variableHeavy},
+    {"deep-expr", deepExpression},
+    {"branchy",   branchy},
+    {"print",     printHeavy},
+    {"large-src", largeSource},
+    {"float",     floatArith, true},
+};
+
+// ---- measuring ----
+
+static const int phaseCount = 5;
+static const char* const phaseNames[phaseCount] = {"lex", "parse", "compile", "run", "total"};
+
+struct Result {
+    std::string name;
+    size_t bytes = 0;
+    std::string output;       // FNV-1a of everything printed, to spot behaviour changes
+    double ms[phaseCount];
+};
+
+// Hashes output instead of keeping it; the print workload writes megabytes
+class HashSink : public OutputSink {
+public:
+    HashSink() : OutputSink(Flush::Threshold) {}
+
+    std::string digest() {
+        flush();
+        std::ostringstream s;
+        s << std::hex << hash;
+        return s.str();
+    }
+
+protected:
+    void write(const char* data, size_t size) override {
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+
+private:
+    uint64_t hash = 14695981039346656037ull;
+};
+
+struct Config {
+    bool optimize = false;
+    bool registerEngine = false;
+    int reps = 5;
+};
+
+static Result measure(const Workload& w, const Config& cfg) {
+    using Clock = std::chrono::steady_clock;
+    auto ms = [](Clock::time_point a, Clock::time_point b) {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    };
+
+    Result res;
+    res.name = w.name;
+    for (double& t : res.ms) t = 1e30;
+    const std::string source = w.source();
+    res.bytes = source.size();
+
+    for (int r = 0; r < cfg.reps; ++r) {
+        HashSink sink;
+        Clock::time_point start = Clock::now(), lexed, parsed, compiled, finished;
+
+        Lexer lexer(source);
+        auto tokens = lexer.tokenize();
+        lexed = Clock::now();
+
+        Parser parser(std::move(tokens));
+        auto program = parser.parse();
+        if (cfg.optimize) foldConstants(program);
+        parsed = Clock::now();
+
+        if (cfg.registerEngine) {
+            RegisterCompiler compiler;
+            auto code = compiler.compile(program);
+            if (cfg.optimize) threadJumps(code);
+            compiled = Clock::now();
+            RegisterVM vm;
+            vm.setOutput(&sink);
+            vm.run(code);
+        } else {
+            Compiler compiler;
+            auto code = compiler.compile(program);
+            if (cfg.optimize) peephole(code);
+            compiled = Clock::now();
+            VM vm;
+            vm.setOutput(&sink);
+            vm.run(code);
+        }
+        finished = Clock::now();
+
+        const double times[phaseCount] = {ms(start, lexed), ms(lexed, parsed), ms(parsed, compiled),
+                                          ms(compiled, finished), ms(start, finished)};
+        for (int p = 0; p < phaseCount; ++p)
+            if (times[p] < res.ms[p]) res.ms[p] = times[p];
+        res.output = sink.digest();
+    }
+    return res;
+}
+
+// ---- JSON ----
+
+static void writeJson(const std::string& path, const Config& cfg, const std::vector<Result>& results) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) throw std::runtime_error("cannot write " + path);
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\n"
+        << "  \"bench\": \"bytecode_bench\",\n"
+        << "  \"engine\": \"" << (cfg.registerEngine ? "register" : "stack") << "\",\n"
+        << "  \"optimize\": " << (cfg.optimize ? "true" : "false") << ",\n"
+        << "  \"reps\": " << cfg.reps << ",\n"
+        << "  \"workloads\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"bytes\": " << r.bytes
+            << ", \"output\": \"" << r.output << "\"";
+        for (int p = 0; p < phaseCount; ++p) out << ", \"" << phaseNames[p] << "_ms\": " << r.ms[p];
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    if (!out) throw std::runtime_error("cannot write " + path);
+}
+
+// Reads back what writeJson wrote: the workload objects are the only
+// objects without nested braces, and every value in them is a string or
+// a number, which is all this has to understand
+static std::map<std::string, Result> readJson(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot read " + path);
+    std::stringstream text;
+    text << in.rdbuf();
+    const std::string json = text.str();
+
+    static const std::regex object(R"(\{[^{}]*\})");
+    static const std::regex field(R"re("(\w+)"\s*:\s*(?:"([^"]*)"|([-+0-9.eE]+)))re");
+    std::map<std::string, Result> results;
+    for (std::sregex_iterator o(json.begin(), json.end(), object), end; o != end; ++o) {
+        const std::string body = o->str();
+        Result r;
+        for (double& t : r.ms) t = -1;
+        for (std::sregex_iterator f(body.begin(), body.end(), field); f != end; ++f) {
+            const std::string key = (*f)[1];
+            if (key == "name") r.name = (*f)[2];
+            else if (key == "output") r.output = (*f)[2];
+            for (int p = 0; p < phaseCount; ++p)
+                if (key == std::string(phaseNames[p]) + "_ms" && (*f)[3].matched) r.ms[p] = std::stod((*f)[3]);
+        }
+        if (!r.name.empty()) results[r.name] = r;
+    }
+    if (results.empty()) throw std::runtime_error(path + ": no workloads found");
+    return results;
+}
+
+// ---- main ----
+
+static std::string pad(const std::string& s, size_t width) {
+    return s.size() >= width ? s + " " : s + std::string(width - s.size(), ' ');
+}
+
+static std::string fixed(double v, int precision) {
+    std::ostringstream s;
+    s.setf(std::ios::fixed);
+    s.precision(precision);
+    s << v;
+    return s.str();
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+    std::string jsonPath, baselinePath;
+    double threshold = 10, minMs = 5;
+    std::vector<const Workload*> selected;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&](const char* prefix) { return arg.substr(std::string(prefix).size()); };
+            if (arg == "-O") cfg.optimize = true;
+            else if (arg == "--engine=register") cfg.registerEngine = true;
+            else if (arg == "--engine=stack") cfg.registerEngine = false;
+            else if (arg.rfind("--reps=", 0) == 0) cfg.reps = std::stoi(value("--reps="));
+            else if (arg.rfind("--json=", 0) == 0) jsonPath = value("--json=");
+            else if (arg.rfind("--baseline=", 0) == 0) baselinePath = value("--baseline=");
+            else if (arg.rfind("--threshold=", 0) == 0) threshold = std::stod(value("--threshold="));
+            else if (arg.rfind("--min-ms=", 0) == 0) minMs = std::stod(value("--min-ms="));
+            else {
+                const Workload* found = nullptr;
+                for (const auto& w : workloads)
+                    if (arg == w.name) found = &w;
+                if (!found) throw std::invalid_argument("unknown option or workload '" + arg + "'");
+                selected.push_back(found);
+            }
+        }
+        if (cfg.reps < 1) throw std::invalid_argument("--reps must be at least 1");
+    } catch (std::logic_error& e) {
+        std::cerr << "bytecode_bench: " << e.what() << "\n"
+                  << "usage: bytecode_bench [-O] [--engine=stack|register] [--reps=N] [--json=file]\n"
+                  << "                      [--baseline=file] [--threshold=percent] [--min-ms=ms] [workload...]\n"
+                  << "workloads:";
+        for (const auto& w : workloads) std::cerr << " " << w.name;
+        std::cerr << "\n";
+        return 2;
+    }
+    if (selected.empty())
+        for (const auto& w : workloads)
+            if (!cfg.registerEngine || !w.doubles) selected.push_back(&w);
+
+    std::map<std::string, Result> baseline;
+    try {
+        if (!baselinePath.empty()) baseline = readJson(baselinePath);
+    } catch (std::runtime_error& e) {
+        std::cerr << "bytecode_bench: " << e.what() << "\n";
+        return 2;
+    }
+
+    std::cout << "engine " << (cfg.registerEngine ? "register" : "stack") << (cfg.optimize ? " -O" : "")
+              << ", best of " << cfg.reps << ", times in ms"
+              << (baseline.empty() ? "" : ", change against " + baselinePath + " in brackets") << "\n"
+              << pad("workload", 11) << pad("bytes", 10);
+    for (auto phase : phaseNames) std::cout << pad(phase, baseline.empty() ? 10 : 20);
+    std::cout << "\n";
+
+    std::vector<Result> results;
+    int regressions = 0;
+    for (const Workload* w : selected) {
+        Result r;
+        try {
+            r = measure(*w, cfg);
+        } catch (std::runtime_error& e) {
+            std::cerr << w->name << ": error: " << e.what() << "\n";
+            return 2;
+        }
+        results.push_back(r);
+
+        auto base = baseline.find(r.name);
+        std::vector<std::string> notes;
+        std::cout << pad(r.name, 11) << pad(std::to_string(r.bytes), 10);
+        for (int p = 0; p < phaseCount; ++p) {
+            std::string cell = fixed(r.ms[p], 2);
+            if (base != baseline.end() && base->second.ms[p] > 0) {
+                double was = base->second.ms[p];
+                double change = (r.ms[p] - was) / was * 100;
+                bool judged = was >= minMs;
+                cell += " (" + std::string(change >= 0 ? "+" : "") + fixed(change, 1) + "%" + (judged ? "" : "?") + ")";
+                if (judged && change > threshold) notes.push_back(std::string(phaseNames[p]) + " slower");
+            }
+            std::cout << pad(cell, baseline.empty() ? 10 : 20);
+        }
+        if (base != baseline.end() && base->second.output != r.output) notes.push_back("output changed");
+        if (!notes.empty()) {
+            ++regressions;
+            std::cout << " REGRESSION:";
+            for (size_t i = 0; i < notes.size(); ++i) std::cout << (i ? ", " : " ") << notes[i];
+        }
+        std::cout << "\n";
+    }
+
+    if (!jsonPath.empty()) {
+        try {
+            writeJson(jsonPath, cfg, results);
+        } catch (std::runtime_error& e) {
+            std::cerr << "bytecode_bench: " << e.what() << "\n";
+            return 2;
+        }
+        std::cout << "results written to " << jsonPath << "\n";
+    }
+    if (!baseline.empty())
+        std::cout << (regressions ? std::to_string(regressions) + " workload(s) regressed beyond " + fixed(threshold, 1) + "%\n"
+                                  : "no regressions beyond " + fixed(threshold, 1) + "%\n");
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+// Function call benchmarks. Each script is timed under switch and
+// threaded dispatch, with the cost per call, and must print what its
+// while loop version (or the known answer) prints. Then recursion that
+// is not a tail call is run past the default call depth limit, where it
+// must stop with the limit's error, and again with a raised limit, where
+// it must finish. Exits 1 on any mismatch.
+//   ./call_bench [repetitions]
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include "compiler.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "vm.h"
+
+template <typename F>
+static double bestMs(int reps, F f) {
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    return best;
+}
+
+struct CallCase {
+    const char* name;
+    const char* source;
+    double calls;           // made by one run
+    const char* expected;   // a script printing the same, or the output itself
+};
+
+static const CallCase callCases[] = {
+    {"fib",
+     "func fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } print fib(27);",
+     635621, "196418\n"},
+    // tail calls both ways, far deeper than the call depth limit
+    {"even/odd",
+     "func even(n) { if (n == 0) return 1; return odd(n - 1); }"
+     "func odd(n) { if (n == 0) return 0; return even(n - 1); } print even(1000000);",
+     1000001, "1\n"},
+    {"tail sum",
+     "func add(n, acc) { if (n == 0) return acc; return add(n - 1, acc + n % 7); } print add(1000000, 0);",
+     1000001, "i = 1000000; acc = 0; while (i > 0) { acc = acc + i % 7; i = i - 1; } print acc;"},
+    {"locals",
+     "func mix(a, b) { t = a * 31 + b; u = t % 1000; return u + 1; }"
+     "i = 0; s = 0; while (i < 1000000) { s = s + mix(i, s % 13); i = i + 1; } print s;",
+     1000000, "i = 0; s = 0; while (i < 1000000) { t = i * 31 + s % 13; s = s + t % 1000 + 1; i = i + 1; } print s;"},
+};
+
+// Non-tail recursion as deep as its argument
+static const char* const deepSource = "func depth(n) { if (n == 0) return 0; return 1 + depth(n - 1); } print depth(100000);";
+
+static Chunk compileSource(const std::string& source) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    Ast ast = parser.parse();
+    foldConstants(ast);
+    Compiler compiler;
+    Chunk chunk = compiler.compile(ast);
+    peephole(chunk);
+    return chunk;
+}
+
+static std::string runOnce(const Chunk& chunk, VM& vm) {
+    CaptureSink captured;
+    vm.setOutput(&captured);
+    vm.run(chunk);
+    vm.setOutput(nullptr);
+    return captured.str();
+}
+
+static double timeScript(const Chunk& chunk, VM::Dispatch dispatch, int reps, std::string& output) {
+    VM vm;
+    vm.setJit(false);
+    vm.setDispatch(dispatch);
+    return bestMs(reps, [&] {
+        vm.reset();
+        output = runOnce(chunk, vm);
+    });
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? std::stoi(argv[1]) : 3;
+    bool ok = true;
+
+    std::cout << "ms (best of " << reps << "), and ns per call under threaded dispatch\n";
+    std::cout << std::left << std::setw(12) << "script" << std::setw(10) << "calls" << std::setw(10) << "switch"
+              << std::setw(10) << "threaded" << "ns/call\n" << std::fixed << std::setprecision(2);
+    for (const auto& c : callCases) {
+        Chunk chunk = compileSource(c.source);
+        std::string switchOut, threadedOut;
+        double sw = timeScript(chunk, VM::Dispatch::Switch, reps, switchOut);
+        double th = timeScript(chunk, VM::Dispatch::Threaded, reps, threadedOut);
+
+        std::string expected = c.expected;
+        if (expected.find(';') != std::string::npos) {
+            VM vm;
+            expected = runOnce(compileSource(expected), vm);
+        }
+        bool same = switchOut == expected && threadedOut == expected;
+        ok = ok && same;
+        std::cout << std::setw(12) << c.name << std::setw(10) << static_cast<size_t>(c.calls) << std::setw(10) << sw
+                  << std::setw(10) << th << th * 1e6 / c.calls << (same ? "" : "  OUTPUT DIFFERS") << "\n";
+    }
+
+    // the default limit must stop the deep recursion cleanly, a raised one let it finish
+    Chunk deep = compileSource(deepSource);
+    std::string error;
+    try {
+        VM vm;
+        runOnce(deep, vm);
+    } catch (std::runtime_error& e) {
+        error = e.what();
+    }
+    bool stopped = error.find("Call depth limit exceeded") != std::string::npos;
+    std::cout << "\ndepth(100000), default limit: " << (stopped ? error : "no error  MISMATCH") << "\n";
+
+    VM vm;
+    vm.setCallDepthLimit(200000);
+    std::string output;
+    double ms = bestMs(reps, [&] {
+        vm.reset();
+        output = runOnce(deep, vm);
+    });
+    bool finished = output == "100000\n";
+    std::cout << "depth(100000), limit 200000: " << ms << " ms" << (finished ? "" : "  OUTPUT DIFFERS") << "\n";
+    ok = ok && stopped && finished;
+    return ok ? 0 : 1;
+}
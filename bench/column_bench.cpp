@@ -0,0 +1,160 @@
+// Batch evaluation against a VM run per row. Each expression is
+// evaluated over generated columns (default a million rows) twice: row
+// at a time, binding the inputs and running "r = expression;" on one VM
+// for every row, and with bytecode::Expression::evaluate, which runs the
+// expression a chunk of rows at a time (columnar.h). The batch columns
+// time each kernel set this CPU can run. Every row must get the same
+// value both ways, and an expression that fails must fail at the same
+// row; exits 1 otherwise.
+//   ./column_bench [repetitions] [rows]
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "columnar.h"
+#include "compiler.h"
+#include "lexer.h"
+#include "libbytecode.h"
+#include "parser.h"
+#include "vm.h"
+
+template <typename F>
+static double bestMs(int reps, F f) {
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    return best;
+}
+
+struct Table {
+    std::vector<double> price;
+    std::vector<int32_t> qty, region;
+
+    explicit Table(size_t rows) : price(rows), qty(rows), region(rows) {
+        uint32_t x = 12345;
+        for (size_t i = 0; i < rows; ++i) {
+            x = x * 1103515245u + 12345u;
+            price[i] = (x >> 8) % 10000 * 0.01;
+            qty[i] = static_cast<int32_t>(x >> 4) % 50;
+            region[i] = static_cast<int32_t>(x >> 20) % 5;
+        }
+    }
+
+    bytecode::Columns columns() const {
+        return {{"price", price.data()}, {"qty", qty.data()}, {"region", region.data()}};
+    }
+};
+
+static const char* const expressions[] = {
+    "price * qty > 100.0 && region == 3",
+    "price * 0.9 + qty * 2",
+    "(qty * 7 + region) % 10 < 3 || qty > 45",
+    "qty != 0 && 1000 / qty > 20",
+    "!(region == 1 || region == 2) && price >= 10.0 && price < 50.0",
+};
+
+// Fails at the first row with qty == 7
+static const char* const failing = "price + 1000 / (qty - 7)";
+
+// The row-at-a-time way. Returns false, with the row, if a run fails.
+static bool runRows(const std::string& expression, const Table& table, size_t rows, std::vector<Value>& out,
+                    size_t& failedRow) {
+    const std::string source = "r = " + expression + ";";
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    Ast ast = parser.parse();
+    std::vector<Compiler::Import> imports;
+    Compiler compiler;
+    Chunk chunk = compiler.compileOpen(ast, imports);
+    const size_t result = static_cast<size_t>(compiler.symbols().lookup("r"));
+    std::vector<std::pair<size_t, int>> bind;   // slot, column
+    for (const auto& i : imports) {
+        size_t slot = static_cast<size_t>(compiler.symbols().lookup(i.name));
+        bind.push_back({slot, i.name == "price" ? 0 : i.name == "qty" ? 1 : 2});
+    }
+
+    VM vm;
+    vm.setJit(false);
+    out.resize(rows);
+    for (size_t r = 0; r < rows; ++r) {
+        for (const auto& b : bind) {
+            if (b.second == 0) vm.setVariable(b.first, table.price[r]);
+            else vm.setVariable(b.first, b.second == 1 ? table.qty[r] : table.region[r]);
+        }
+        try {
+            vm.run(chunk);
+        } catch (std::runtime_error&) {
+            failedRow = r;
+            return false;
+        }
+        vm.getVariable(result, out[r]);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? std::stoi(argv[1]) : 3;
+    size_t rows = argc > 2 ? std::stoul(argv[2]) : 1000000;
+    const Table table(rows);
+    const auto columns = table.columns();
+    auto sets = availableArrayKernels();
+    bool ok = true;
+
+    std::cout << rows << " rows, ms (best of " << reps << "); speedup is per row / " << sets.front()->name << "\n";
+    std::cout << std::left << std::setw(64) << "expression" << std::setw(10) << "per row";
+    for (auto* set : sets) std::cout << std::setw(10) << set->name;
+    std::cout << "speedup\n" << std::fixed << std::setprecision(2);
+
+    for (const char* source : expressions) {
+        auto expression = bytecode::compileExpression(source);
+        bytecode::BatchResult batch = expression.evaluate(columns, rows);
+        std::vector<Value> expected;
+        size_t failedRow = 0;
+        bool same = batch.ok && runRows(source, table, rows, expected, failedRow);
+        for (size_t r = 0; same && r < rows; ++r) same = batch.value(r).raw() == expected[r].raw();
+
+        double perRow = bestMs(reps, [&] { runRows(source, table, rows, expected, failedRow); });
+        std::cout << std::setw(64) << source << std::setw(10) << perRow;
+
+        // every kernel set through the engine itself, checked against the API's result
+        Lexer lexer(source);
+        Parser parser(lexer.tokenize());
+        Ast ast = parser.parseExpression();
+        ColumnProgram program = compileColumns(ast.statements.front());
+        std::vector<ColumnRef> inputs;
+        for (const auto& name : program.inputs) {
+            const auto& c = columns.at(name);
+            inputs.push_back(c.ints ? ColumnRef{ColumnType::Int, c.ints} : ColumnRef{ColumnType::Double, c.doubles});
+        }
+        double best = 0;
+        for (auto* set : sets) {
+            ColumnResult out;
+            double ms = bestMs(reps, [&] { evaluateColumns(program, inputs.data(), rows, out, *set); });
+            if (set == sets.front()) best = ms;
+            same = same && out.ints == batch.ints && out.selection == batch.selection &&
+                   std::equal(out.doubles.begin(), out.doubles.end(), batch.doubles.begin(), batch.doubles.end(),
+                              [](double x, double y) { return Value(x).raw() == Value(y).raw(); });
+            std::cout << std::setw(10) << ms;
+        }
+        std::cout << std::setprecision(1) << (best > 0 ? perRow / best : 0.0);
+        std::cout << "x" << std::setprecision(2) << (same ? "" : "  MISMATCH") << "\n";
+        ok = ok && same;
+    }
+
+    // errors: the batch must stop at the row a run per row stops at
+    auto batch = bytecode::compileExpression(failing).evaluate(columns, rows);
+    std::vector<Value> expected;
+    size_t failedRow = rows;
+    bool rowsOk = runRows(failing, table, rows, expected, failedRow);
+    bool same = !batch.ok && !rowsOk && batch.row == failedRow;
+    std::cout << "\n" << failing << ": " << (batch.ok ? "no error" : batch.error.message + " at row " + std::to_string(batch.row))
+              << (same ? "" : "  MISMATCH, a run per row fails at row " + std::to_string(failedRow)) << "\n";
+    ok = ok && same;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+// Compares the switch and direct-threaded dispatch loops of VM::run on
+// loop-heavy scripts. Both modes must print the same output; the speedup
+// column is switch time / threaded time. The last column runs the
+// threaded loop on the same code marked unverified, i.e. with the
+// checked push and pop verified code avoids, and the one after it runs
+// the threaded loop without quickening (see VM::setQuickening). With -O
+// the peephole optimizer runs first, so the two invocations show its
+// effect as well.
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "vm.h"
+
+struct Workload {
+    const char* name;
+    const char* source;
+};
+
+static const Workload workloads[] = {
+    {"count",   "i = 0; while (i < 20000000) i = i + 1; print i;"},
+    {"arith",   "i = 0; while (i < 5000000) i = i + (i * 7 + 3) % 5 / 2 + 1; print i;"},
+    {"branchy", "i = 0; while (i < 10000000) if (i % 3 == 0) i = i + 1; else i = i + 2; print i;"},
+    {"logic",   "i = 0; while (i < 5000000 && !(i == 0 - 1)) i = i + (i >= 10 || i <= 2) + 1; print i;"},
+    // the same loop shape as count, with a double alongside the int counter
+    {"double",  "i = 0; x = 0.0; while (i < 10000000) { x = x + 0.25; i = i + 1; } print x;"},
+};
+
+static Chunk compileSource(const std::string& source) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    Compiler compiler;
+    return compiler.compile(parser.parse());
+}
+
+// Runs chunk on a fresh VM, returning seconds taken and captured output
+static double timeRun(const Chunk& chunk, VM::Dispatch mode, bool quicken, std::string& output) {
+    VM vm;
+    vm.setDispatch(mode);
+    vm.setJit(false);
+    vm.setQuickening(quicken);
+    CaptureSink captured;
+    vm.setOutput(&captured);
+    auto start = std::chrono::steady_clock::now();
+    vm.run(chunk);
+    auto stop = std::chrono::steady_clock::now();
+    output = captured.str();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, char** argv) {
+    int reps = 3;
+    bool optimize = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-O") optimize = true;
+        else reps = std::stoi(arg);
+    }
+    bool ok = true;
+
+    if (!BYTECODE_COMPUTED_GOTO)
+        std::cout << "note: built without computed goto, both columns use the switch loop\n";
+
+    std::cout << "workload   switch(ms)  threaded(ms)  speedup  threaded checked(ms)  unquickened(ms)\n";
+    for (const auto& w : workloads) {
+        Chunk chunk = compileSource(w.source);
+        if (optimize) peephole(chunk);
+        Chunk unverified = chunk;
+        unverified.maxStack = unverifiedStack;
+        double best[4] = {1e30, 1e30, 1e30, 1e30};
+        std::string out[4];
+        const VM::Dispatch modes[4] = {VM::Dispatch::Switch, VM::Dispatch::Threaded, VM::Dispatch::Threaded,
+                                       VM::Dispatch::Threaded};
+
+        for (int r = 0; r < reps; ++r) {
+            for (int m = 0; m < 4; ++m) {
+                double t = timeRun(m == 2 ? unverified : chunk, modes[m], m != 3, out[m]);
+                if (t < best[m]) best[m] = t;
+            }
+        }
+
+        if (out[0] != out[1] || out[0] != out[2] || out[0] != out[3]) {
+            std::cerr << w.name << ": output mismatch between dispatch modes\n";
+            ok = false;
+        }
+
+        std::cout.setf(std::ios::fixed);
+        std::cout.precision(1);
+        std::cout << w.name << std::string(11 - std::string(w.name).size(), ' ')
+                  << best[0] * 1e3 << "\t" << best[1] * 1e3 << "\t\t";
+        std::cout.precision(2);
+        std::cout << best[0] / best[1] << "x    ";
+        std::cout.precision(1);
+        std::cout << best[2] * 1e3 << "\t\t      " << best[3] * 1e3 << "\n";
+    }
+    return ok ? 0 : 1;
+}
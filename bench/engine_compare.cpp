@@ -0,0 +1,205 @@
+// Differential check and comparison of the stack and register engines.
+// Every program is compiled for both engines, with and without -O, and
+// run on the stack VM (interpreted and with the loop JIT at a low
+// threshold) and on the register VM. All engines must print exactly the
+// same output under the same optimization setting, including compile and
+// runtime error messages. For each program the executed instruction count and the best
+// wall-clock time are reported. Exits non-zero on any mismatch.
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "regcompiler.h"
+#include "vm.h"
+
+struct Program {
+    const char* name;
+    const char* source;
+};
+
+static const Program programs[] = {
+    // semantics
+    {"arith",      "x = 3 * (2 + 4); print x; print x / 4; print x % 5; print x - 20; print 7 - 2 - 1;"},
+    {"compare",    "a = 5; b = 7; print a < b; print a <= 5; print a > b; print b >= 8; print a == 5; print a != 5;"},
+    {"logic",      "print 7 >= 7 && 6 <= 6; print 1 || 0; print !(0); print !5; print 0 && 1; print 2 || 0;"},
+    {"if-else",    "x = 4; if (x > 3) print 1; else print 0; if (x < 3) print 2; else print 3; if (0) print 9;"},
+    {"nested",     "i = 0; s = 0; while (i < 10) if (i % 2 == 0) i = i + 1; else i = i + 3; print i;"},
+    {"selfref",    "x = 5; x = x * x - x; print x; y = x; x = y - x + 1; print x; print y;"},
+    {"deep-expr",  "a = 2; print ((((a + 1) * (a + 2)) - ((a * 3) % 4)) / (a + (a * a)) + a) * ((a - 1) + (a - 2));"},
+    {"exprstmt",   "x = 1; 1 + x; 5; (x); print x;"},
+    {"div-zero",   "x = 0; print 1; print 10 / x; print 2;"},
+    {"mod-zero",   "x = 0; print 10 % x;"},
+    {"undefined",  "if (0) y = 1; print 5; print y;"},
+    {"late-def",   "i = 0; while (i < 3) i = i + 1; if (i == 3) z = i; print z; if (i == 4) w = 1; print w;"},
+    {"folding",    "print 3 * (2 + 4); print 1 - 1 + 0; if (2 > 1) print 7; else print 8; while (0) print 1;"},
+    {"short-circ", "d = 0; print d != 0 && 10 / d > 2; print d == 0 || 10 / d; print 3 && 4; print 0 || 0; x = 5; x = x > 2 && x; print x;"},
+    {"sc-undef",   "x = 1; if (x == 0) y = 5; print x && 0 && y; print x || y; if (x == 0 && y == 1) print 1; print 2; print y;"},
+    {"sc-cond",    "i = 0; n = 0; while (i < 30 && !(i > 20 || i % 7 == 6)) { if (i % 2 == 0 || i % 3 == 0 && i > 4) n = n + 1; i = i + 1; } print i; print n;"},
+    {"block",      "x = 1; { x = x + 1; print x; } if (x == 2) { print 20; x = 5; } else { print 30; } { } print x;"},
+    // int results wrap at 32 bits and INT_MIN / -1 does not trap, on every engine
+    {"int-min",    "x = 0 - 2147483647 - 1; y = 0 - 1; print x / y; print x % y; print x * y; print 0 - x; print x - 1;"},
+    {"overflow",   "x = 2147483647; print x + 1; print x * x; print x * 3 + x; y = 65536; print y * y; print 0 - x - x;"},
+    {"fold-wrap",  "print (0 - 2147483647 - 1) / (0 - 1); print (0 - 2147483647 - 1) % (0 - 1); print 2147483647 + 1;"},
+    {"loop-wrap",  "i = 0; h = 7; while (i < 3000) { h = h * 31 + i; q = h / (0 - 1) % 1000; i = i + 1; } print h; print q;"},
+    {"loop-print", "i = 0; while (i < 200) { if (i % 40 == 0) print i; i = i + 1; }"},
+    {"loop-div",   "i = 50; s = 0; while (i > 0 - 5) { s = s + 100 / i; i = i - 1; } print s;"},
+    {"loop-mod",   "i = 50; s = 0; while (i > 0 - 5) { s = s + 100 % i; i = i - 1; } print s;"},
+    {"loop-logic", "i = 0; n = 0; while (i < 300) { if (i % 3 == 0 || i % 5 == 0 && !(i > 250)) n = n + 1; i = i + 1; } print n;"},
+    {"nested-loop","i = 0; t = 0; while (i < 60) { j = 0; while (j < i) { t = t + j * i - (j / 3); j = j + 1; } i = i + 1; } print t;"},
+    {"late-store", "i = 0; while (i < 100) { if (i == 50) k = i; i = i + 1; } print k;"},
+    // loop-heavy workloads
+    {"count",      "i = 0; while (i < 5000000) i = i + 1; print i;"},
+    {"arith-loop", "i = 0; while (i < 2000000) i = i + (i * 7 + 3) % 5 / 2 + 1; print i;"},
+    {"branchy",    "i = 0; while (i < 3000000) if (i % 3 == 0) i = i + 1; else i = i + 2; print i;"},
+};
+
+// Runs body with a capture sink for its output; a runtime error becomes
+// part of the output so error behaviour is compared too
+template <typename F>
+static std::string capture(F body) {
+    CaptureSink sink;
+    std::string error;
+    try {
+        body(sink);
+    } catch (std::runtime_error& e) {
+        error = std::string("error: ") + e.what() + "\n";
+    }
+    return sink.str() + error;
+}
+
+static Ast parse(const std::string& source, bool fold) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    auto program = parser.parse();
+    if (fold) foldConstants(program);
+    return program;
+}
+
+struct Result {
+    std::string output;
+    uint64_t instructions = 0;
+    double seconds = 1e30;
+};
+
+// Loops are JIT-compiled after this many iterations when jit is on, low
+// enough that the small semantic programs exercise native code too
+static const uint32_t jitThreshold = 10;
+
+static Result runStack(const std::string& source, bool optimize, bool jit, int reps) {
+    Result res;
+    Chunk chunk;
+    res.output = capture([&](OutputSink&) {
+        Compiler compiler;
+        chunk = compiler.compile(parse(source, optimize));
+        if (optimize) peephole(chunk);
+    });
+    if (!res.output.empty()) return res;
+
+    VM counter;
+    counter.setDispatch(VM::Dispatch::Counting);
+    counter.setJit(jit, jitThreshold);
+    res.output = capture([&](OutputSink& out) {
+        counter.setOutput(&out);
+        counter.run(chunk);
+    });
+    res.instructions = counter.instructionsExecuted();
+
+    for (int r = 0; r < reps; ++r) {
+        VM vm;
+        vm.setJit(jit, jitThreshold);
+        auto start = std::chrono::steady_clock::now();
+        capture([&](OutputSink& out) {
+            vm.setOutput(&out);
+            vm.run(chunk);
+        });
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (t < res.seconds) res.seconds = t;
+    }
+    return res;
+}
+
+static Result runRegister(const std::string& source, bool optimize, int reps) {
+    Result res;
+    RegChunk chunk;
+    res.output = capture([&](OutputSink&) {
+        RegisterCompiler compiler;
+        chunk = compiler.compile(parse(source, optimize));
+        if (optimize) threadJumps(chunk);
+    });
+    if (!res.output.empty()) return res;
+
+    RegisterVM counter;
+    counter.setDispatch(VM::Dispatch::Counting);
+    res.output = capture([&](OutputSink& out) {
+        counter.setOutput(&out);
+        counter.run(chunk);
+    });
+    res.instructions = counter.instructionsExecuted();
+
+    for (int r = 0; r < reps; ++r) {
+        RegisterVM vm;
+        auto start = std::chrono::steady_clock::now();
+        capture([&](OutputSink& out) {
+            vm.setOutput(&out);
+            vm.run(chunk);
+        });
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (t < res.seconds) res.seconds = t;
+    }
+    return res;
+}
+
+static std::string pad(const std::string& s, size_t width) {
+    return s.size() >= width ? s + " " : s + std::string(width - s.size(), ' ');
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? std::stoi(argv[1]) : 3;
+    int failures = 0;
+
+    // instruction counts for the JIT columns only cover interpreted code
+    const int configs = 6;
+    const char* labels[configs] = {"stack", "stack+jit", "register",
+                                   "stack -O", "stack+jit -O", "register -O"};
+    std::cout << "columns:";
+    for (auto label : labels) std::cout << " " << label;
+    std::cout << "\n" << pad("program", 12) << pad("instructions executed", 66) << "time (ms)\n";
+    for (const auto& p : programs) {
+        Result results[configs] = {runStack(p.source, false, false, reps),
+                                   runStack(p.source, false, true, reps),
+                                   runRegister(p.source, false, reps),
+                                   runStack(p.source, true, false, reps),
+                                   runStack(p.source, true, true, reps),
+                                   runRegister(p.source, true, reps)};
+
+        bool same = true;
+        for (int i : {1, 2}) same = same && results[i].output == results[0].output;
+        for (int i : {4, 5}) same = same && results[i].output == results[3].output;
+        if (!same) {
+            ++failures;
+            std::cout << p.name << ": OUTPUT MISMATCH\n";
+            for (int i = 0; i < configs; ++i)
+                std::cout << "  [" << labels[i] << "]\n" << results[i].output;
+            continue;
+        }
+
+        std::ostringstream counts, times;
+        times.setf(std::ios::fixed);
+        times.precision(2);
+        for (int i = 0; i < configs; ++i) {
+            const char* sep = i ? " / " : "";
+            counts << sep << results[i].instructions;
+            times << sep << (results[i].instructions ? results[i].seconds * 1e3 : 0.0);
+        }
+        std::cout << pad(p.name, 12) << pad(counts.str(), 66) << times.str() << "\n";
+    }
+
+    std::cout << (failures ? std::to_string(failures) + " program(s) differ\n"
+                           : "all engines agree\n");
+    return failures ? 1 : 0;
+}
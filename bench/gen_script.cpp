@@ -0,0 +1,46 @@
+// Writes a large, deterministic script to stdout for timing the batch
+// mode, e.g.
+//   ./gen_script 1000000 > big.bvm && ./Bytecode run --time big.bvm
+// Each line is one statement mixing arithmetic, comparisons, branches and
+// short loops over a fixed set of variables; every value stays small so
+// the script runs without overflow and prints every 1000th line.
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+    long statements = argc > 1 ? std::stol(argv[1]) : 100000;
+    const int vars = 64;
+    uint32_t seed = 12345;
+    auto pick = [&] {
+        seed = seed * 1103515245u + 12345u;
+        return "v" + std::to_string((seed >> 16) % vars);
+    };
+
+    std::ios::sync_with_stdio(false);
+    for (int v = 0; v < vars; ++v) std::cout << "v" << v << " = " << v * 7 << ";\n";
+
+    for (long i = 0; i < statements; ++i) {
+        std::string a = pick(), b = pick(), c = pick();
+        switch (i % 8) {
+            case 4:
+                std::cout << "if (" << a << " > " << b << ") { " << c << " = " << c << " + 1; } else { "
+                          << c << " = " << c << " - 1; }\n";
+                break;
+            case 5:
+                std::cout << "k = 0; while (k < 4) { " << a << " = " << a << " + k; k = k + 1; }\n";
+                break;
+            case 6:
+                std::cout << a << " = !(" << b << " == " << c << ") && " << b << " <= 500 || " << c << " > 900;\n";
+                break;
+            case 7:
+                if (i % 1000 == 7) std::cout << "print " << a << ";\n";
+                else std::cout << a << " = " << b << " % 997 - " << c << " / 13;\n";
+                break;
+            default:
+                std::cout << a << " = (" << b << " * 3 + " << c << ") % 1000 - " << pick() << " / 7;\n";
+                break;
+        }
+    }
+    return 0;
+}
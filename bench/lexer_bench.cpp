@@ -0,0 +1,72 @@
+// Lexing throughput on multi-megabyte inputs. Builds a script of roughly
+// the requested size in memory (statements of the same shapes gen_script
+// writes) and reports the best of several Lexer::tokenize runs in MB/s
+// and millions of tokens per second, e.g.
+//   ./lexer_bench            4, 16 and 64 MB, 5 runs each
+//   ./lexer_bench 10 256     256 MB, 10 runs
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "lexer.h"
+
+static std::string makeSource(size_t bytes) {
+    std::string source;
+    source.reserve(bytes + 128);
+    uint32_t seed = 12345;
+    auto pick = [&] {
+        seed = seed * 1103515245u + 12345u;
+        return "value" + std::to_string((seed >> 16) % 64);
+    };
+    for (long i = 0; source.size() < bytes; ++i) {
+        std::string a = pick(), b = pick(), c = pick();
+        switch (i % 4) {
+            case 0:
+                source += "if (" + a + " > " + b + ") { " + c + " = " + c + " + 1; } else { " + c + " = " + c + " - 1; }\n";
+                break;
+            case 1:
+                source += "k = 0; while (k < 4) { " + a + " = " + a + " + k; k = k + 1; }\n";
+                break;
+            case 2:
+                source += a + " = !(" + b + " == " + c + ") && " + b + " <= 500 || " + c + " > 900;\n";
+                break;
+            default:
+                source += a + " = (" + b + " * 3 + " + c + ") % 1000 - " + std::to_string(i % 997) + " / 7;\n";
+                break;
+        }
+    }
+    return source;
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? std::stoi(argv[1]) : 5;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; ++i) sizes.push_back(std::stoul(argv[i]));
+    if (sizes.empty()) sizes = {4, 16, 64};
+
+    std::cout << "size(MB)  tokens      best(ms)   MB/s     Mtok/s\n";
+    for (size_t mb : sizes) {
+        std::string source = makeSource(mb << 20);
+        double best = 1e30;
+        size_t count = 0;
+        for (int r = 0; r < reps; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            Lexer lexer(source);
+            auto tokens = lexer.tokenize();
+            auto stop = std::chrono::steady_clock::now();
+            count = tokens.size();
+            double t = std::chrono::duration<double>(stop - start).count();
+            if (t < best) best = t;
+        }
+
+        std::cout.setf(std::ios::fixed);
+        std::cout.precision(1);
+        std::cout << mb << std::string(10 - std::to_string(mb).size(), ' ')
+                  << count << std::string(12 - std::to_string(count).size(), ' ')
+                  << best * 1e3 << "\t"
+                  << source.size() / best / (1 << 20) << "\t"
+                  << count / best / 1e6 << "\n";
+    }
+    return 0;
+}
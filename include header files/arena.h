@@ -0,0 +1,69 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump-pointer allocator. Objects are carved out of large blocks and are
+// never destroyed one by one: the blocks are released together when the
+// arena goes away, so only trivially destructible types may live here.
+class Arena {
+public:
+    Arena() = default;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    void* allocate(size_t size, size_t align) {
+        size_t at = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || at + size > capacity) {
+            grow(size + align);
+            at = (used + align - 1) & ~(align - 1);
+        }
+        used = at + size;
+        return blocks.back().get() + at;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Uninitialised array of n T
+    template <typename T>
+    T* array(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    // Copy of text that lives as long as the arena
+    std::string_view copy(std::string_view text) {
+        char* p = array<char>(text.size());
+        if (!text.empty()) std::memcpy(p, text.data(), text.size());
+        return {p, text.size()};
+    }
+
+    // Number of blocks obtained from the system allocator so far
+    size_t blockCount() const { return blocks.size(); }
+
+private:
+    static const size_t blockSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t used = 0;
+    size_t capacity = 0;
+
+    void grow(size_t atLeast) {
+        // blocks double up to 1 MB, so big programs need few of them
+        size_t size = blocks.empty() ? blockSize : std::min(capacity * 2, size_t(1) << 20);
+        if (size < atLeast) size = atLeast;
+        blocks.emplace_back(new char[size]);
+        capacity = size;
+        used = 0;
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+#include "value.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Element-wise operators, in the order of the binary Ops they implement
+enum class ArrayOp : uint8_t {
+    Add, Sub, Mul, Div, Mod,
+    Eq, Neq, Lt, Lte, Gt, Gte,
+};
+
+// The loops behind array operations, one set per instruction set. A
+// scalar operand is passed as a one-element array with its flag set and
+// stands for that value at every index. Comparisons store 1 or 0.
+struct ArrayKernels {
+    const char* name;
+    // Add, Sub and Mul; ints wrap like ADD does
+    void (*arithInt)(ArrayOp op, const int32_t* a, bool aOne, const int32_t* b, bool bOne, int32_t* out, size_t n);
+    // Add, Sub, Mul and Div
+    void (*arithDouble)(ArrayOp op, const double* a, bool aOne, const double* b, bool bOne, double* out, size_t n);
+    void (*compareInt)(ArrayOp op, const int32_t* a, bool aOne, const int32_t* b, bool bOne, int32_t* out, size_t n);
+    void (*compareDouble)(ArrayOp op, const double* a, bool aOne, const double* b, bool bOne, int32_t* out, size_t n);
+    void (*widen)(const int32_t* in, double* out, size_t n);
+    // Comparisons into a selection bitmap: element i is bit i % 64 of
+    // out[i / 64], and the bits past n in the last word are 0
+    void (*selectInt)(ArrayOp op, const int32_t* a, bool aOne, const int32_t* b, bool bOne, uint64_t* out, size_t n);
+    void (*selectDouble)(ArrayOp op, const double* a, bool aOne, const double* b, bool bOne, uint64_t* out, size_t n);
+
+    // Reductions. Double sums add in sixteen interleaved lanes combined in
+    // a fixed order, so every set returns the same bits; a NaN element
+    // makes min and max NaN. count is the number of nonzero elements.
+    int32_t (*sumInt)(const int32_t* in, size_t n);
+    double (*sumDouble)(const double* in, size_t n);
+    int32_t (*minInt)(const int32_t* in, size_t n);
+    int32_t (*maxInt)(const int32_t* in, size_t n);
+    double (*minDouble)(const double* in, size_t n);
+    double (*maxDouble)(const double* in, size_t n);
+    size_t (*countInt)(const int32_t* in, size_t n);
+    size_t (*countDouble)(const double* in, size_t n);
+};
+
+// Kernels for this CPU, chosen on first use: AVX2 when the CPU and the
+// build have it, else SSE2 on x86-64, else portable loops
+const ArrayKernels& arrayKernels();
+// Every set this build can run on this CPU, best first
+std::vector<const ArrayKernels*> availableArrayKernels();
+
+// Arrays of one VM. An array is immutable, holds ints or doubles, and is
+// referred to by a handle in a Value. Element buffers are 64-byte aligned
+// blocks in power-of-two size classes, carved from large slabs (or, past
+// a quarter of a slab, allocated singly) and recycled through per-class
+// free lists, so making an array does not normally touch the heap.
+//
+// Nothing is freed until the owner collects: it calls mark() on every
+// Value it can still reach, then sweep(). collectionDue() says when
+// enough has been allocated since the last sweep to make that worthwhile.
+class ArrayPool {
+public:
+    ArrayPool() = default;
+    ~ArrayPool();
+    ArrayPool(const ArrayPool&) = delete;
+    ArrayPool& operator=(const ArrayPool&) = delete;
+
+    // An array of n numbers: ints if every element is one, else doubles
+    Value make(const Value* elements, size_t n);
+    // [0, 1, ..., n - 1]
+    Value range(Value n);
+
+    // a op b element by element; at least one of them is an array, and
+    // two arrays must have the same length
+    Value binary(ArrayOp op, Value a, Value b);
+
+    Value index(Value array, Value i) const;
+    Value length(Value array) const;
+    Value sum(Value array) const;
+    Value min(Value array) const;
+    Value max(Value array) const;
+    Value count(Value array) const;
+
+    // "[1, 2, 3]", as print shows it
+    void format(Value array, std::string& out) const;
+
+    void mark(Value v) {
+        if (v.isArray() && v.asArray() < arrays.size()) arrays[v.asArray()].marked = true;
+    }
+    void sweep();
+    bool collectionDue() const { return sinceSweep > std::max(minCollect, keptBytes); }
+
+    // Forget every array, keeping the memory for reuse
+    void clear();
+
+    void setKernels(const ArrayKernels& k) { kernels = &k; }
+    size_t live() const { return arrays.size() - freeHandles.size(); }
+
+private:
+    enum class Kind : uint8_t { Int, Double };
+    struct Array {
+        void* data = nullptr;          // nullptr: handle is free
+        uint32_t length = 0;
+        Kind kind = Kind::Int;
+        uint8_t sizeClass = 0;
+        bool marked = false;
+    };
+
+    static constexpr size_t minCollect = 4u << 20;
+    static const size_t slabBytes = 1u << 20;
+
+    const ArrayKernels* kernels = &arrayKernels();
+    std::vector<Array> arrays;                   // by handle
+    std::vector<uint32_t> freeHandles;
+    std::vector<std::vector<void*>> freeBlocks;  // by size class
+    std::vector<void*> owned;                    // slabs and single blocks, freed by the destructor
+    char* slab = nullptr;                        // unused rest of the newest slab
+    size_t slabLeft = 0;
+    size_t liveBytes = 0;
+    size_t keptBytes = 0;                        // live after the last sweep
+    size_t sinceSweep = 0;                       // allocated since then
+
+    const Array& get(Value v, const char* what) const;
+    Value allocate(Kind kind, size_t n, void*& data);
+    void* block(uint8_t sizeClass);
+    void release(uint8_t sizeClass, void* data);
+};
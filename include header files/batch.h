@@ -0,0 +1,89 @@
+#pragma once
+#include "bytecode.h"
+#include "output.h"
+#include "vm.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A script compiled once and then only read, so any number of workers can
+// run it at the same time. error is set instead of chunk when it did not
+// compile.
+struct BatchProgram {
+    std::string name;
+    Chunk chunk;
+    std::string error;
+};
+
+// What one job printed, and how it ended. latency is from the start of
+// BatchRunner::run to the end of the job, so it includes waiting in a
+// queue; seconds is the execution alone.
+struct BatchResult {
+    std::string output;
+    std::string error;          // "name:line:column: error: message", empty on success
+    double latency = 0;
+    double seconds = 0;
+};
+
+// Fixed pool of worker threads, each owning a VM that is reset and reused
+// for every job it takes. Jobs are dealt out to per-worker deques up
+// front; a worker takes from the back of its own deque and, when that is
+// empty, steals from the front of the others', so uneven jobs still
+// spread over all threads. Each job prints into its worker's capture
+// sink and its output is handed back separately, never interleaved.
+class BatchRunner {
+public:
+    // 0 threads means one per hardware thread. More than
+    // maxThreadsPerCore per hardware thread only adds switching, and each
+    // owns a VM, so the pool is capped there. Throws std::runtime_error
+    // when the threads cannot be started.
+    static constexpr unsigned maxThreadsPerCore = 4;
+    explicit BatchRunner(unsigned threads = 0, bool optimize = false);
+    ~BatchRunner();
+    BatchRunner(const BatchRunner&) = delete;
+    BatchRunner& operator=(const BatchRunner&) = delete;
+
+    // Compiles every source on the pool; sources[i] is named names[i]
+    std::vector<BatchProgram> compile(const std::vector<std::string>& names,
+                                      const std::vector<std::string>& sources);
+
+    // Runs jobs (a program may appear many times) and returns one result
+    // per job, in job order
+    std::vector<BatchResult> run(const std::vector<const BatchProgram*>& jobs);
+
+    unsigned threads() const { return static_cast<unsigned>(workers.size()); }
+    uint64_t steals() const { return stolen; }   // jobs taken from another worker, all runs
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+        VM vm;
+        CaptureSink sink;
+        std::thread thread;
+    };
+
+    bool optimize;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // the current round of work; workers sleep between rounds
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    std::function<void(size_t job, Worker& w)> task;
+    uint64_t round = 0;
+    size_t active = 0;                  // workers still busy with this round
+    bool stopping = false;
+    std::atomic<uint64_t> stolen{0};
+
+    // Runs task(i, worker) for i in [0, count) on the pool and waits
+    void forEach(size_t count, std::function<void(size_t, Worker&)> body);
+    void work(size_t self);
+    bool next(size_t self, size_t& job);
+};
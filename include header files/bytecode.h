@@ -1,67 +1,301 @@
 #pragma once
+#include "source.h"
+#include "value.h"
+#include <cstdint>
+#include <ostream>
 #include <string>
 #include <vector>
 
-enum class OpCode {
-    LOAD_CONST,
-    LOAD_VAR,
-    STORE_VAR,
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    MOD,
-    PRINT,
-    HALT,
-
-    CMP_EQ,
-    CMP_NEQ,
-    CMP_LT,
-    CMP_LTE,
-    CMP_GT,
-    CMP_GTE,
-
-    LOGICAL_AND,
-    LOGICAL_OR,
-    LOGICAL_NOT,
-
-    JMP,
-    JMP_IF_TRUE,
-    JMP_IF_FALSE
+// Every opcode, in encoding order. Used to generate the enum, the name
+// table and the VM's threaded-dispatch label table so they cannot drift.
+#define BYTECODE_OPCODES(X) \
+    X(LOAD_CONST)   \
+    X(LOAD_DOUBLE)  /* push constants[arg] */ \
+    X(LOAD_VAR)     \
+    X(STORE_VAR)    \
+    X(ADD)          \
+    X(SUB)          \
+    X(MUL)          \
+    X(DIV)          \
+    X(MOD)          \
+    X(PRINT)        \
+    X(HALT)         \
+    X(POP)          \
+                    \
+    X(CMP_EQ)       \
+    X(CMP_NEQ)      \
+    X(CMP_LT)       \
+    X(CMP_LTE)      \
+    X(CMP_GT)       \
+    X(CMP_GTE)      \
+                    \
+    X(LOGICAL_AND)  \
+    X(LOGICAL_OR)   \
+    X(LOGICAL_NOT)  \
+                    \
+    X(JMP)          \
+    X(JMP_IF_TRUE)  \
+    X(JMP_IF_FALSE) \
+                    \
+    /* superinstructions, produced only by peephole() */ \
+    X(INC_VAR)          /* slot += arg */                       \
+    X(LOAD_VAR_CONST)   /* push slot, push arg */               \
+    X(ADD_VAR_CONST)    /* push slot + arg */                   \
+    X(SUB_VAR_CONST)    /* push slot - arg */                   \
+    X(MUL_VAR_CONST)    /* push slot * arg */                   \
+    X(JMP_IF_NOT_EQ)    /* pop b, a; jump to arg unless a == b */ \
+    X(JMP_IF_NOT_NEQ)   \
+    X(JMP_IF_NOT_LT)    \
+    X(JMP_IF_NOT_LTE)   \
+    X(JMP_IF_NOT_GT)    \
+    X(JMP_IF_NOT_GTE)   \
+                        \
+    /* arrays (array.h) */ \
+    X(NEW_ARRAY)        /* pop arg values, push an array of them */ \
+    X(INDEX)            /* pop i, a; push a[i] */ \
+    X(LEN)              /* builtins: pop an array, push the result */ \
+    X(SUM)              \
+    X(MIN)              \
+    X(MAX)              \
+    X(COUNT)            \
+    X(RANGE)            /* pop n, push [0, 1, ..., n - 1] */ \
+                        \
+    /* functions (see Function) */ \
+    X(CALL)             /* call functions[arg] on the top 'slot' values */ \
+    X(TAIL_CALL)        /* the same in place of the current call */ \
+    X(RETURN)           /* pop the result, end the call, push it for the caller */ \
+    X(LOAD_LOCAL)       /* push local arg of the current call */ \
+    X(STORE_LOCAL)      /* pop into local arg */ \
+                        \
+    /* quickened forms, written only into a VM's private copy of the */ \
+    /* code while it runs (see vm_ops.inc); never compiled or saved  */ \
+    X(LOAD_VAR_SLOT)        /* LOAD_VAR of a slot already assigned */ \
+    X(STORE_VAR_SLOT)       /* STORE_VAR of a slot already assigned */ \
+    X(LOAD_VAR_CONST_SLOT)  /* LOAD_VAR_CONST, slot already assigned */ \
+    X(INC_VAR_INT)          /* INC_VAR of an assigned int slot */ \
+    X(ADD_INT_INT)          /* ADD that has seen two ints */ \
+    X(SUB_INT_INT)      \
+    X(MUL_INT_INT)      \
+    X(ADD_DBL_DBL)          /* ADD that has seen two doubles */ \
+    X(SUB_DBL_DBL)      \
+    X(MUL_DBL_DBL)
+
+enum class OpCode : uint8_t {
+#define BYTECODE_ENUM_ENTRY(name) name,
+    BYTECODE_OPCODES(BYTECODE_ENUM_ENTRY)
+#undef BYTECODE_ENUM_ENTRY
 };
 
+#define BYTECODE_COUNT_ENTRY(name) +1
+constexpr size_t OPCODE_COUNT = 0 BYTECODE_OPCODES(BYTECODE_COUNT_ENTRY);
+#undef BYTECODE_COUNT_ENTRY
+
+// Fixed-size, pre-decoded instruction (8 bytes).
+// arg holds the integer immediate (LOAD_CONST), the constant index
+// (LOAD_DOUBLE), the variable slot (LOAD_VAR/STORE_VAR), the local
+// (LOAD_LOCAL/STORE_LOCAL), the function (calls) or the target index
+// (jumps). Superinstructions that need a variable and an immediate keep
+// the slot in 'slot', and calls keep their argument count there.
+// 'reserved' is zero in compiled code; the VM marks instructions of its
+// quickened copy there (see vm_ops.inc).
 struct Instruction {
     OpCode op;
-    std::string arg; // value, variable name, or target index (for jumps)
+    uint8_t reserved = 0;
+    uint16_t slot = 0;
+    int32_t arg = 0;
+
+    Instruction() = default;
+    Instruction(OpCode o, int32_t a = 0, uint16_t s = 0) : op(o), slot(s), arg(a) {}
+};
+
+static_assert(sizeof(Instruction) == 8, "Instruction should stay 8 bytes");
+
+// One position-table entry: instructions from pc up to the next entry
+// come from pos
+struct PositionEntry {
+    uint32_t pc;
+    SourcePos pos;
+};
+
+// Read-only position table, sorted by pc
+struct PositionView {
+    const PositionEntry* entries = nullptr;
+    size_t count = 0;
+
+    // Position of instruction pc, or {} if the table does not cover it
+    SourcePos at(size_t pc) const;
+};
+
+// Source position of each instruction, stored once per run of
+// instructions that share it.
+struct PositionTable {
+    std::vector<PositionEntry> entries;
+
+    void add(size_t pc, SourcePos pos);
+    SourcePos at(size_t pc) const { return view().at(pc); }
+    PositionView view() const { return {entries.data(), entries.size()}; }
+};
+
+// A user function: instructions [entry, end) of its chunk, which come
+// after the main code and the functions before it. A call's frame is a
+// window of the VM's operand stack holding its locals, the arguments
+// first, and above them its own operands.
+struct Function {
+    uint32_t entry;
+    uint32_t end;
+    uint16_t params;
+    uint16_t locals;    // params included
+};
+
+static_assert(sizeof(Function) == 12, "Function is stored in images as is");
+
+// maxStack of code that verify() has not passed; the VM runs it with
+// bounds checks on every push and pop
+const uint32_t unverifiedStack = UINT32_MAX;
+
+// What the VM and JIT execute: a read-only view of a chunk, so the
+// instructions can live in a Chunk or directly in a mapped image file.
+struct ChunkView {
+    const Instruction* code = nullptr;
+    size_t size = 0;
+    const std::string* names = nullptr;   // one per variable slot
+    size_t slots = 0;
+    PositionView positions;
+    uint32_t maxStack = unverifiedStack;
+    const double* constants = nullptr;    // LOAD_DOUBLE operands
+    size_t numConstants = 0;
+    const Function* functions = nullptr;
+    size_t numFunctions = 0;
+};
+
+// Output of the compiler: the instruction stream, the double constants
+// it loads and the name of every variable slot (names.size() is the
+// number of slots the VM must hold).
+// maxStack is the operand stack depth verify() proved for exactly this
+// code, for the main code and for any one call's frame; anything that
+// edits the code must verify it again or reset it.
+struct Chunk {
+    std::vector<Instruction> code;
+    std::vector<std::string> names;
+    PositionTable positions;
+    uint32_t maxStack = unverifiedStack;
+    std::vector<double> constants;
+    std::vector<Function> functions;
+
+    ChunkView view() const {
+        return {code.data(), code.size(), names.data(), names.size(), positions.view(), maxStack,
+                constants.data(), constants.size(), functions.data(), functions.size()};
+    }
 };
 
+inline bool isJump(OpCode op) {
+    switch (op) {
+        case OpCode::JMP:
+        case OpCode::JMP_IF_TRUE:
+        case OpCode::JMP_IF_FALSE:
+        case OpCode::JMP_IF_NOT_EQ:
+        case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT:
+        case OpCode::JMP_IF_NOT_LTE:
+        case OpCode::JMP_IF_NOT_GT:
+        case OpCode::JMP_IF_NOT_GTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Operand-stack effect of in; false for a byte that is no opcode, for
+// the quickened forms, which only ever exist inside a running VM, and for
+// a NEW_ARRAY of negative size. A call's arguments count as popped; the
+// callee's locals and operands are in its own frame.
+inline bool stackEffect(const Instruction& in, int& pops, int& pushes) {
+    pops = 0;
+    pushes = 0;
+    switch (in.op) {
+        case OpCode::LOAD_CONST:
+        case OpCode::LOAD_DOUBLE:
+        case OpCode::LOAD_VAR:
+        case OpCode::LOAD_LOCAL:
+        case OpCode::ADD_VAR_CONST:
+        case OpCode::SUB_VAR_CONST:
+        case OpCode::MUL_VAR_CONST:
+            pushes = 1; return true;
+        case OpCode::LOAD_VAR_CONST:
+            pushes = 2; return true;
+        case OpCode::STORE_VAR:
+        case OpCode::STORE_LOCAL:
+        case OpCode::RETURN:
+        case OpCode::PRINT:
+        case OpCode::POP:
+        case OpCode::JMP_IF_TRUE:
+        case OpCode::JMP_IF_FALSE:
+            pops = 1; return true;
+        case OpCode::LOGICAL_NOT:
+        case OpCode::LEN: case OpCode::SUM: case OpCode::MIN:
+        case OpCode::MAX: case OpCode::COUNT: case OpCode::RANGE:
+            pops = 1; pushes = 1; return true;
+        case OpCode::ADD: case OpCode::SUB: case OpCode::MUL:
+        case OpCode::DIV: case OpCode::MOD:
+        case OpCode::CMP_EQ: case OpCode::CMP_NEQ:
+        case OpCode::CMP_LT: case OpCode::CMP_LTE:
+        case OpCode::CMP_GT: case OpCode::CMP_GTE:
+        case OpCode::LOGICAL_AND: case OpCode::LOGICAL_OR:
+        case OpCode::INDEX:
+            pops = 2; pushes = 1; return true;
+        case OpCode::NEW_ARRAY:
+            pops = in.arg; pushes = 1; return in.arg >= 0;
+        case OpCode::CALL:
+            pops = in.slot; pushes = 1; return true;
+        case OpCode::TAIL_CALL:
+            pops = in.slot; return true;
+        case OpCode::JMP_IF_NOT_EQ: case OpCode::JMP_IF_NOT_NEQ:
+        case OpCode::JMP_IF_NOT_LT: case OpCode::JMP_IF_NOT_LTE:
+        case OpCode::JMP_IF_NOT_GT: case OpCode::JMP_IF_NOT_GTE:
+            pops = 2; return true;
+        case OpCode::JMP:
+        case OpCode::HALT:
+        case OpCode::INC_VAR:
+            return true;
+        case OpCode::LOAD_VAR_SLOT: case OpCode::STORE_VAR_SLOT:
+        case OpCode::LOAD_VAR_CONST_SLOT: case OpCode::INC_VAR_INT:
+        case OpCode::ADD_INT_INT: case OpCode::SUB_INT_INT: case OpCode::MUL_INT_INT:
+        case OpCode::ADD_DBL_DBL: case OpCode::SUB_DBL_DBL: case OpCode::MUL_DBL_DBL:
+            return false;
+    }
+    return false;
+}
+
+// Variable slot an instruction reads or writes, or -1
+inline int32_t slotOf(const Instruction& in) {
+    switch (in.op) {
+        case OpCode::LOAD_VAR:
+        case OpCode::STORE_VAR:
+            return in.arg;
+        case OpCode::INC_VAR:
+        case OpCode::LOAD_VAR_CONST:
+        case OpCode::ADD_VAR_CONST:
+        case OpCode::SUB_VAR_CONST:
+        case OpCode::MUL_VAR_CONST:
+            return in.slot;
+        default:
+            return -1;
+    }
+}
+
 inline std::string opcodeToString(OpCode op) {
     switch (op) {
-        case OpCode::LOAD_CONST:  return "LOAD_CONST";
-        case OpCode::LOAD_VAR:    return "LOAD_VAR";
-        case OpCode::STORE_VAR:   return "STORE_VAR";
-        case OpCode::ADD:         return "ADD";
-        case OpCode::SUB:         return "SUB";
-        case OpCode::MUL:         return "MUL";
-        case OpCode::DIV:         return "DIV";
-        case OpCode::MOD:         return "MOD";
-        case OpCode::PRINT:       return "PRINT";
-        case OpCode::HALT:        return "HALT";
-
-        case OpCode::CMP_EQ:      return "CMP_EQ";
-        case OpCode::CMP_NEQ:     return "CMP_NEQ";
-        case OpCode::CMP_LT:      return "CMP_LT";
-        case OpCode::CMP_LTE:     return "CMP_LTE";
-        case OpCode::CMP_GT:      return "CMP_GT";
-        case OpCode::CMP_GTE:     return "CMP_GTE";
-
-        case OpCode::LOGICAL_AND: return "LOGICAL_AND";
-        case OpCode::LOGICAL_OR:  return "LOGICAL_OR";
-        case OpCode::LOGICAL_NOT: return "LOGICAL_NOT";
-
-        case OpCode::JMP:         return "JMP";
-        case OpCode::JMP_IF_TRUE: return "JMP_IF_TRUE";
-        case OpCode::JMP_IF_FALSE:return "JMP_IF_FALSE";
+#define BYTECODE_NAME_ENTRY(name) case OpCode::name: return #name;
+        BYTECODE_OPCODES(BYTECODE_NAME_ENTRY)
+#undef BYTECODE_NAME_ENTRY
     }
     return "UNKNOWN";
 }
+
+// For use in a catch block: rethrows the error being handled as a
+// SourceError at instruction pc. Errors that carry a position already
+// are rethrown unchanged.
+[[noreturn]] void rethrowAt(PositionView positions, size_t pc);
+
+// Textual debug view of a chunk, one instruction per line
+void disassemble(const Chunk& chunk, std::ostream& os);
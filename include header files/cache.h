@@ -0,0 +1,71 @@
+#pragma once
+#include "bytecode.h"
+#include "compiler.h"
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Bounded LRU cache of compiled stack bytecode, keyed by a hash of the
+// normalized source text, so a snippet that comes back skips lexing,
+// parsing and compiling. Entries are compiled with their own variable
+// slots (Compiler::compileOpen) and relinked by name into the caller's
+// compiler on every hit, so the same code serves any set of earlier
+// variables. Reading a name that is neither in the table nor assigned
+// earlier in the snippet still fails with "Undefined variable", as in a
+// direct compile. A snippet that declares or calls a function depends on
+// the functions the caller's compiler knows, so it is compiled there
+// every time and never cached.
+class ProgramCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;        // estimated memory held by the entries
+    };
+
+    explicit ProgramCache(size_t budgetBytes = 64 << 20) : budget(budgetBytes) {}
+
+    // Code for source linked against compiler's symbol table, which gains
+    // any variable the snippet introduces, just as compiler.compile()
+    // would. Compiles and caches it on a miss, calling parsed with the
+    // AST if given; compile errors are thrown and not cached.
+    Chunk get(std::string_view source, Compiler& compiler, bool optimize,
+              const std::function<void(const Ast&)>& parsed = nullptr);
+
+    // Shrinking the budget evicts least recently used entries at once
+    void setBudget(size_t budgetBytes);
+
+    // Persist every entry, most recently used first. load() adds the
+    // entries of a saved file (older than anything already cached) and
+    // returns false, changing nothing, if the file is missing, from
+    // another version or damaged.
+    void save(const std::string& path) const;
+    bool load(const std::string& path);
+
+    const Stats& stats() const { return counters; }
+    void clear();
+
+private:
+    struct Entry {
+        uint64_t hash;
+        bool optimize;
+        std::string source;                    // normalized
+        Chunk chunk;                           // slots numbered as in chunk.names
+        std::vector<Compiler::Import> imports;
+        size_t bytes;
+    };
+
+    size_t budget;
+    Stats counters;
+    std::list<Entry> entries;                  // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+
+    void insert(Entry entry, bool recent);
+    void evict();
+};
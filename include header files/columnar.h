@@ -0,0 +1,86 @@
+#pragma once
+#include "array.h"
+#include "parser.h"
+#include "source.h"
+#include "value.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Vector-at-a-time evaluation of one expression over columns of input,
+// the way a query engine runs a filter or a projection. Instead of one
+// VM run per row, each instruction of a ColumnProgram runs over a chunk
+// of rows at once with the kernels of array.h: an input is read in place
+// from its column, arithmetic fills a vector of ints or doubles, and
+// comparisons, && || and ! fill selection bitmaps. Every row gets the
+// value the stack VM would give it, and an error is reported at the row
+// the VM would have stopped on.
+#define COLUMN_OPCODES(X) \
+    X(COLUMN)       /* push input column arg */                          \
+    X(CONSTANT)     /* push constants[arg], the same for every row */    \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD)  /* pop b, a; push a op b */      \
+    X(CMP_EQ) X(CMP_NEQ) X(CMP_LT) X(CMP_LTE) X(CMP_GT) X(CMP_GTE)       \
+    X(NOT)          /* replace the top with the rows where it is 0 */    \
+    X(NARROW_AND)   /* left of &&: what follows only counts on the rows where the top is true; */ \
+                    /* if there are none, jump to arg with the top as the result */               \
+    X(NARROW_OR)    /* left of ||: the same for the rows where the top is false */                \
+    X(AND)          /* pop b, a; push a && b and end the narrowing */    \
+    X(OR)
+
+enum class ColumnOp : uint8_t {
+#define COLUMN_ENUM_ENTRY(name) name,
+    COLUMN_OPCODES(COLUMN_ENUM_ENTRY)
+#undef COLUMN_ENUM_ENTRY
+};
+
+struct ColumnInstr {
+    ColumnOp op;
+    int32_t arg = 0;
+};
+
+struct ColumnProgram {
+    std::vector<ColumnInstr> code;
+    std::vector<SourcePos> positions;   // of each instruction
+    std::vector<Value> constants;
+    std::vector<std::string> inputs;    // variable of each COLUMN arg, in order of first use
+    size_t maxDepth = 0;                // operand stack
+    size_t maxNesting = 0;              // && and || inside each other
+};
+
+// Compiles an expression from Parser::parseExpression. Every name is an
+// input; arrays and calls are errors.
+ColumnProgram compileColumns(const ASTNode* expr);
+
+enum class ColumnType : uint8_t { Int, Double, Bool };
+
+// Rows per chunk; a multiple of 64, so a chunk's selection is whole words
+const size_t columnChunkRows = 1024;
+
+// An input column, Int or Double: one int32_t or double per row, owned
+// by the caller
+struct ColumnRef {
+    ColumnType type;
+    const void* data;
+};
+
+// The value of every row. A Bool result (comparisons, && || !) is a
+// selection bitmap: row r is bit r % 64 of selection[r / 64], and the
+// bits past the last row are 0.
+struct ColumnResult {
+    ColumnType type = ColumnType::Int;
+    std::vector<int32_t> ints;
+    std::vector<double> doubles;
+    std::vector<uint64_t> selection;
+};
+
+// A runtime error (division by zero) and the first row that raised it
+struct RowError : SourceError {
+    size_t row;
+    RowError(const std::string& message, SourcePos p, size_t r) : SourceError(message, p), row(r) {}
+};
+
+// Evaluates rows [0, rows) of inputs, one per program input in order.
+// Throws RowError, leaving out unspecified.
+void evaluateColumns(const ColumnProgram& program, const ColumnRef* inputs, size_t rows, ColumnResult& out,
+                     const ArrayKernels& kernels = arrayKernels());
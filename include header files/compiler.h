@@ -1,28 +1,101 @@
 #pragma once
 #include "parser.h"
 #include "bytecode.h"
+#include "symbols.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
-#include <memory>
 
 // The Compiler turns AST into Bytecode instructions
 class Compiler {
 public:
     // Compile a whole program (list of AST nodes/statements)
-    std::vector<Instruction> compile(const std::vector<std::unique_ptr<ASTNode>>& program);
+    Chunk compile(const Ast& program);
+
+    // A name the program reads before assigning it, and where
+    struct Import {
+        std::string name;
+        SourcePos pos;
+    };
+
+    // Like compile(), but reading a name nothing has assigned yet is not
+    // an error: the name gets a slot and is listed in imports, in slot
+    // order, for the caller to resolve. Used on a fresh Compiler to get
+    // code that does not depend on earlier variables (ProgramCache).
+    Chunk compileOpen(const Ast& program, std::vector<Import>& imports);
+
+    // Variable slots; persists across compile() calls
+    const SymbolTable& symbols() const { return symbolTable; }
+    SymbolTable& symbols() { return symbolTable; }
+
+    // len, sum, ...: compiled to their own instruction, not called
+    static bool isBuiltin(std::string_view name);
+    // True if program declares a function or calls one that is not a
+    // builtin; its code then depends on the functions this Compiler knows
+    static bool usesFunctions(const Ast& program);
 
 private:
+    SymbolTable symbolTable;
+    std::vector<Import>* imports = nullptr;   // set during compileOpen
+    std::unordered_map<uint64_t, int32_t> constantIndex;   // double bits -> LOAD_DOUBLE arg, per chunk
+
+    // User functions, by index. Like the symbol table they persist across
+    // compile() calls, so a REPL line can call what an earlier one
+    // declared: each body is compiled once into its own chunk, jumps
+    // counted from its start, and appended to every chunk compiled after.
+    struct FunctionCode {
+        std::string name;
+        uint16_t params = 0;
+        uint16_t locals = 0;
+        Chunk body;
+    };
+    std::vector<FunctionCode> functions;
+    std::unordered_map<std::string, size_t> functionIndex;
+
+    // The function being compiled: each local's slot in the frame, and
+    // which locals are assigned on every path to the current instruction
+    struct Scope {
+        std::unordered_map<std::string_view, uint16_t> slots;
+        std::vector<uint8_t> assigned;
+    };
+    Scope* scope = nullptr;   // null in the main code
+
+    Chunk compileProgram(const Ast& program, const std::vector<const FunctionNode*>& declared);
+    void declareFunction(const FunctionNode* fn);
+    void compileFunction(const FunctionNode* fn);
+    // Append every function after out's main code and fill out.functions
+    void linkFunctions(Chunk& out);
+
+    // Record node's source position for the next instruction
+    void mark(const ASTNode* node, Chunk& out);
+
     // Dispatch based on node type
-    void compileNode(const ASTNode* node, std::vector<Instruction>& out);
+    void compileNode(const ASTNode* node, Chunk& out);
+    // A statement; expression statements get their value popped
+    void compileStatement(const ASTNode* node, Chunk& out);
 
     // Helpers for each AST node type
-    void compileNumber(const NumberNode* num, std::vector<Instruction>& out);
-    void compileIdentifier(const IdentifierNode* id, std::vector<Instruction>& out);
-    void compileBinary(const BinaryOpNode* bin, std::vector<Instruction>& out);
-    void compileUnary(const UnaryOpNode* un, std::vector<Instruction>& out);
-    void compileAssignment(const AssignmentNode* assign, std::vector<Instruction>& out);
-    void compilePrint(const PrintNode* print, std::vector<Instruction>& out);
+    void compileNumber(const NumberNode* num, Chunk& out);
+    void compileIdentifier(const IdentifierNode* id, Chunk& out);
+    void compileBinary(const BinaryOpNode* bin, Chunk& out);
+    void compileUnary(const UnaryOpNode* un, Chunk& out);
+    void compileLogical(const BinaryOpNode* bin, Chunk& out);   // short-circuit && and ||
+    void compileArray(const ArrayNode* array, Chunk& out);
+    void compileIndex(const IndexNode* index, Chunk& out);
+    // op is TAIL_CALL for a call in tail position (return f(...))
+    void compileCall(const CallNode* call, Chunk& out, OpCode op = OpCode::CALL);
+    void compileAssignment(const AssignmentNode* assign, Chunk& out);
+    void compilePrint(const PrintNode* print, Chunk& out);
+    void compileReturn(const ReturnNode* ret, Chunk& out);
+
+    // Code that jumps when cond's truth is jumpIf and falls through
+    // otherwise; && || ! become jumps instead of values. The new jumps are
+    // chained onto list (see compiler.cpp) and the new head is returned.
+    int32_t compileJump(const ASTNode* cond, bool jumpIf, int32_t list, Chunk& out);
 
     // NEW: control-flow helpers (declarations only)
-    void compileIf(const IfNode* iff, std::vector<Instruction>& out);
-    void compileWhile(const WhileNode* wh, std::vector<Instruction>& out);
+    void compileIf(const IfNode* iff, Chunk& out);
+    void compileWhile(const WhileNode* wh, Chunk& out);
+    void compileBlock(const BlockNode* block, Chunk& out);
 };
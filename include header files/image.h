@@ -0,0 +1,82 @@
+#pragma once
+#include "bytecode.h"
+#include "regvm.h"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Compiled bytecode image (.bvc), in the byte order of the machine that
+// wrote it (byteOrder lets a reader reject a foreign one). Layout:
+//
+//   ImageHeader
+//   code        instructions (Instruction or RegInstr, 8 bytes each)
+//   constants   constant pool: doubles (stack engine) or int32 (register)
+//   nameLengths uint32 length of each variable name
+//   nameBytes   the names, back to back
+//   positions   PositionEntry table, sorted by pc
+//   functions   Function table (stack engine; empty without functions)
+//
+// Every section starts on an 8-byte boundary so a mapped file can be
+// used in place.
+
+enum class ImageEngine : uint8_t { Stack = 0, Register = 1 };
+
+const uint16_t imageVersion = 3;
+
+struct ImageSection {
+    uint32_t offset;    // from the start of the file
+    uint32_t count;     // elements (bytes for nameBytes)
+};
+
+struct ImageHeader {
+    char magic[4];          // "BVMI"
+    uint16_t version;       // imageVersion
+    uint8_t engine;         // ImageEngine
+    uint8_t reserved;
+    uint32_t byteOrder;     // 0x01020304 as written by the producer
+    uint32_t numRegisters;  // register engine only
+    uint64_t fileSize;
+    ImageSection code, constants, nameLengths, nameBytes, positions, functions;
+};
+
+// Write a compiled chunk as an image. Throws std::runtime_error if the
+// stream fails.
+void writeImage(const Chunk& chunk, std::ostream& out);
+void writeImage(const RegChunk& chunk, std::ostream& out);
+
+// A loaded image. The file is mapped read-only and the views returned by
+// chunk()/regChunk() point straight into it; only the variable names are
+// copied out. The constructor validates the header, section bounds and
+// every instruction (stack code goes through verify()), and throws
+// std::runtime_error for anything malformed.
+class Image {
+public:
+    explicit Image(const std::string& path);
+    ~Image();
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    // True if the file starts with the image magic
+    static bool isImage(const std::string& path);
+
+    ImageEngine engine() const { return static_cast<ImageEngine>(header->engine); }
+    ChunkView chunk() const;           // engine() == Stack
+    RegChunkView regChunk() const;     // engine() == Register
+
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<uint64_t> buffer;      // file contents when mmap is unavailable
+    const ImageHeader* header = nullptr;
+    std::vector<std::string> names;
+    uint32_t maxStack = unverifiedStack;   // stack images, from verify()
+
+    template <typename T>
+    const T* section(const ImageSection& s) const {
+        return reinterpret_cast<const T*>(data + s.offset);
+    }
+    void validate();
+    void unmap();
+};
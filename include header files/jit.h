@@ -0,0 +1,49 @@
+#pragma once
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Baseline JIT for hot while loops (Linux x86-64 only). The build can
+// turn it off with BYTECODE_JIT=0; elsewhere it is always off.
+#ifndef BYTECODE_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define BYTECODE_JIT 1
+#else
+#define BYTECODE_JIT 0
+#endif
+#endif
+
+// Native code for one loop. Called with the VM's variable slots and an
+// opaque context passed back to the print callback. Returns the
+// instruction index where the interpreter should continue, or
+// -(pc + 1) if the instruction at pc raised "Division by zero". It
+// computes in int only: if a variable the loop touches holds a double on
+// entry, it returns the loop head at once; the VM then interprets the
+// loop for the rest of the run.
+using JitLoopFn = int64_t (*)(Value* variables, void* context);
+using JitPrintFn = void (*)(void* context, int value);
+
+class Jit {
+public:
+    Jit() = default;
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit() { release(); }
+
+    // Translate instructions [head, backEdge] of chunk, where backEdge is
+    // the JMP back to head. Returns nullptr when the loop uses something
+    // the JIT does not handle (such as a double constant), so the caller
+    // keeps interpreting it.
+    // 'defined' is the VM's per-slot assigned flag: every variable the
+    // loop touches must already be assigned, which stays true for good.
+    JitLoopFn compileLoop(const ChunkView& chunk, size_t head, size_t backEdge,
+                          const uint8_t* defined, JitPrintFn print);
+
+    // Free all generated code
+    void release();
+
+private:
+    std::vector<std::pair<void*, size_t>> regions;   // mmap'd code
+};
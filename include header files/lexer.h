@@ -1,8 +1,11 @@
 #pragma once
-#include <string>
+#include "source.h"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
 #include <vector>
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     Identifier,
     Number,
     Keyword,
@@ -11,30 +14,59 @@ enum class TokenType {
     Semicolon,
     LParen,     // (
     RParen,     // )
+    LBrace,     // {
+    RBrace,     // }
+    LBracket,   // [
+    RBracket,   // ]
+    Comma,
     EndOfFile,
     Unknown
 };
 
+// Operators, resolved once by the lexer. Binary operators come first, in
+// the order the compilers' opcode tables follow.
+enum class Op : uint8_t {
+    Add, Sub, Mul, Div, Mod,
+    Eq, Neq, Lt, Lte, Gt, Gte,
+    And, Or,
+    Not,
+    Neg,        // unary minus; the lexer itself only produces Sub
+    None,       // not an operator token
+};
+
+const size_t binaryOpCount = static_cast<size_t>(Op::Or) + 1;
+
+inline bool isBinary(Op op) { return op <= Op::Or; }
+
+// Source spelling of op, for messages and dumps
+const char* opName(Op op);
+
+// value is a slice of the source the Lexer was given, so tokens are only
+// valid while that buffer is
 struct Token {
     TokenType type;
-    std::string value;
+    Op op = Op::None;   // set for Operator tokens
+    uint32_t offset;    // index of the first character in the source
+    std::string_view value;
+    SourcePos pos;      // where the token starts, as line:column
 
-    Token(TokenType t, std::string v) : type(t), value(std::move(v)) {}
+    Token(TokenType t, std::string_view v, SourcePos p = {}, uint32_t o = 0, Op kind = Op::None)
+        : type(t), op(kind), offset(o), value(v), pos(p) {}
 };
 
 
 class Lexer {
 public:
-    explicit Lexer(const std::string& src);
+    // src is not copied and must outlive the tokens
+    explicit Lexer(std::string_view src);
     std::vector<Token> tokenize();
 
 private:
-    std::string source;
+    std::string_view source;
     size_t pos;
+    uint32_t line = 1;
+    size_t lineStart = 0;   // index of the first character of the line
 
-    char peek();
-    char get();
     void skipWhitespace();
-    Token identifier();
-    Token number();
+    bool match(char c);
 };
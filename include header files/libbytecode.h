@@ -0,0 +1,145 @@
+#pragma once
+#include "value.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Embedding API of libbytecode: compile once, run many times. A Program
+// never changes after compile() and every run() builds its own VM, so
+// any number of threads can run the same Program at once; the library
+// keeps no global state. Output and errors are returned, never printed.
+//
+//   auto program = bytecode::compile("print price * qty;");
+//   auto result = program.run({{"price", 12.5}, {"qty", 3}});
+//   if (result.ok) std::cout << result.output;      // "37.5\n"
+namespace bytecode {
+
+struct Error {
+    std::string message;
+    uint32_t line = 0;        // 1-based; 0 when unknown
+    uint32_t column = 0;
+};
+
+// Input values by variable name, ints or doubles (see value.h). Names
+// the program does not use are ignored, so one set of bindings can be
+// passed to many programs.
+using Bindings = std::unordered_map<std::string, Value>;
+
+struct Result {
+    bool ok = true;
+    Error error;              // when !ok
+    std::string output;       // everything printed, up to the error if any
+
+    // Every variable assigned by the end of the run (bound or by the
+    // program), in slot order. Variables holding arrays are left out: an
+    // array lives in the run's VM and goes with it.
+    std::vector<std::pair<std::string, Value>> variables;
+
+    // Value of a variable after the run, or nullptr if it was never assigned
+    const Value* find(std::string_view name) const;
+};
+
+struct CompileOptions {
+    bool optimize = false;    // fold constants and run the peephole optimizer (-O)
+};
+
+// Only compile() makes one; copies are cheap and share the code
+class Program {
+public:
+    // Compile errors are kept rather than thrown; run() then fails with
+    // the same error
+    bool ok() const;
+    const Error& error() const;
+
+    // Variables the program reads before assigning them: the ones a run
+    // must bind, or it fails with "Undefined variable" when it gets there
+    const std::vector<std::string>& inputs() const;
+
+    Result run(const Bindings& bindings = {}) const;
+
+private:
+    struct Code;
+    std::shared_ptr<const Code> code;
+
+    explicit Program(std::shared_ptr<const Code> c) : code(std::move(c)) {}
+    friend Program compile(std::string_view source, const CompileOptions& options);
+};
+
+Program compile(std::string_view source, const CompileOptions& options = {});
+
+// Batch evaluation: one expression over many rows at once. Each input
+// variable is a column, one contiguous array with a value per row, and
+// instead of a run per row every operation of the expression is applied
+// to a chunk of rows at a time (see columnar.h).
+//
+//   auto filter = bytecode::compileExpression("price * qty > 100.0 && region == 3");
+//   auto result = filter.evaluate({{"price", price.data()}, {"qty", qty.data()},
+//                                  {"region", region.data()}}, rows);
+//   for (size_t r = 0; r < rows; ++r)
+//       if (result.selected(r)) ...
+
+// Values of one variable, one per row, in memory the caller keeps
+// alive during evaluate()
+struct Column {
+    const int32_t* ints = nullptr;      // exactly one of these is set
+    const double* doubles = nullptr;
+
+    Column(const int32_t* values) : ints(values) {}
+    Column(const double* values) : doubles(values) {}
+};
+
+using Columns = std::unordered_map<std::string, Column>;
+
+struct BatchResult {
+    bool ok = true;
+    Error error;              // when !ok
+    size_t row = 0;           // when !ok, the row a run per row would have failed on
+
+    // Comparisons, && || and ! give Bool: one bit per row in selection,
+    // row r being bit r % 64 of selection[r / 64]
+    enum class Type { Int, Double, Bool };
+    Type type = Type::Int;
+    size_t rows = 0;
+    std::vector<int32_t> ints;          // Int
+    std::vector<double> doubles;        // Double
+    std::vector<uint64_t> selection;    // Bool
+
+    bool selected(size_t r) const { return selection[r / 64] >> (r % 64) & 1; }
+    // Rows selected, for Bool
+    size_t count() const;
+    // Row r's value as a run of the expression would give it: a Bool is
+    // int 1 or 0
+    Value value(size_t r) const;
+};
+
+// Only compileExpression() makes one; like a Program, it never changes
+// and can be evaluated on many threads at once
+class Expression {
+public:
+    bool ok() const;
+    const Error& error() const;
+
+    // Every variable the expression reads: the columns evaluate() needs
+    const std::vector<std::string>& inputs() const;
+
+    // Evaluates rows [0, rows) of the columns. A missing input column
+    // fails before any row is evaluated.
+    BatchResult evaluate(const Columns& columns, size_t rows) const;
+
+private:
+    struct Code;
+    std::shared_ptr<const Code> code;
+
+    explicit Expression(std::shared_ptr<const Code> c) : code(std::move(c)) {}
+    friend Expression compileExpression(std::string_view source, const CompileOptions& options);
+};
+
+// source is a single expression such as "price * qty > 100.0", with no
+// semicolon. Arrays and calls are not allowed.
+Expression compileExpression(std::string_view source, const CompileOptions& options = {});
+
+}  // namespace bytecode
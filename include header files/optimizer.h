@@ -0,0 +1,22 @@
+#pragma once
+#include "bytecode.h"
+#include "parser.h"
+#include "regvm.h"
+
+// Peephole pass over compiled bytecode: merges common instruction
+// sequences into superinstructions (see the end of BYTECODE_OPCODES)
+// and remaps jump targets to the shortened stream.
+// Also threads jumps first (see threadJumps).
+void peephole(Chunk& chunk);
+
+// Retargets jumps that land on a forward JMP to where that JMP goes, so
+// nested ifs and short-circuit conditions do not bounce through several
+// jumps. Back edges stay where they are.
+void threadJumps(Chunk& chunk);
+void threadJumps(RegChunk& chunk);
+
+// AST pass run before compilation: folds constant subexpressions,
+// simplifies identities such as x-0 and x*1, and drops if/while branches
+// whose condition is a constant. Operations that would fail at runtime
+// (division by zero) are left in place so the error still happens there.
+void foldConstants(Ast& program);
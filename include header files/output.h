@@ -0,0 +1,119 @@
+#pragma once
+#include "value.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Destination of PRINT. Values are formatted into an internal buffer and
+// handed to write() when the flush policy says so, and always when the
+// VM's run() returns or fails.
+class OutputSink {
+public:
+    enum class Flush {
+        OnExit,      // only when run() ends
+        Threshold,   // also whenever the buffer reaches the threshold
+        Line,        // after every value (interactive use)
+    };
+
+    explicit OutputSink(Flush p = Flush::Threshold, size_t bytes = 64 * 1024)
+        : policy(p), threshold(bytes) {}
+    virtual ~OutputSink() = default;
+
+    void setFlush(Flush p, size_t bytes = 64 * 1024) {
+        policy = p;
+        threshold = bytes;
+    }
+
+    // Append value and a newline
+    void print(int value) {
+        static const char pairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        char text[12];
+        char* end = text + sizeof text;
+        char* p = end;
+        *--p = '\n';
+        uint32_t u = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+        while (u >= 100) {
+            p -= 2;
+            std::memcpy(p, pairs + 2 * (u % 100), 2);
+            u /= 100;
+        }
+        if (u >= 10) {
+            p -= 2;
+            std::memcpy(p, pairs + 2 * u, 2);
+        } else {
+            *--p = static_cast<char>('0' + u);
+        }
+        if (value < 0) *--p = '-';
+        append(p, end);
+    }
+
+    void print(double value) {
+        char text[33];
+        char* end = formatDouble(value, text);
+        *end++ = '\n';
+        append(text, end);
+    }
+
+    // A number; arrays are formatted by the VM, which owns them
+    void print(Value value) {
+        if (value.isInt()) print(value.asInt());
+        else print(value.asDouble());
+    }
+
+    // Append preformatted text and a newline
+    void print(std::string_view text) {
+        buffer.append(text);
+        const char newline = '\n';
+        append(&newline, &newline + 1);
+    }
+
+    void flush() {
+        if (buffer.empty()) return;
+        write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+protected:
+    virtual void write(const char* data, size_t size) = 0;
+
+private:
+    Flush policy;
+    size_t threshold;
+    std::string buffer;
+
+    void append(const char* begin, const char* end) {
+        buffer.append(begin, end);
+        if (policy == Flush::Line || (policy == Flush::Threshold && buffer.size() >= threshold)) flush();
+    }
+};
+
+// Buffered standard output. Goes through C stdio, so it stays ordered
+// with std::cout.
+class StdoutSink : public OutputSink {
+public:
+    using OutputSink::OutputSink;
+    ~StdoutSink() override { flush(); }
+
+protected:
+    void write(const char* data, size_t size) override;
+};
+
+// Collects everything printed in memory, for tests and embedding
+class CaptureSink : public OutputSink {
+public:
+    CaptureSink() : OutputSink(Flush::OnExit) {}
+
+    const std::string& str() const { return captured; }
+    void clear() { captured.clear(); }
+
+protected:
+    void write(const char* data, size_t size) override { captured.append(data, size); }
+
+private:
+    std::string captured;
+};
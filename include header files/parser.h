@@ -1,108 +1,220 @@
 #pragma once
+#include "arena.h"
 #include "lexer.h"
-#include <memory>
+#include "value.h"
+#include <cstdint>
+#include <string_view>
 #include <vector>
-#include <string>
 
-// Base AST Node
+// Every AST node starts with its kind, so passes dispatch with a switch
+// instead of dynamic_cast. Nodes live in the Ast's arena and are
+// trivially destructible: the whole tree is freed in one go.
+enum class NodeKind : uint8_t {
+    Number, Identifier, Binary, Unary,          // expressions
+    Array, Index, Call,
+    Assignment, Print, If, While, Block,        // statements
+    Function, Return,
+};
+
+inline bool isExpression(NodeKind k) { return k <= NodeKind::Call; }
+
 struct ASTNode {
-    virtual ~ASTNode() = default;
+    NodeKind kind;
+    SourcePos pos;      // operator for binary/unary nodes, else first token
+
+    explicit ASTNode(NodeKind k) : kind(k) {}
+
+    // Checked downcast: the node as T, or nullptr if it is another kind
+    template <typename T>
+    T* as() { return kind == T::Kind ? static_cast<T*>(this) : nullptr; }
+    template <typename T>
+    const T* as() const { return kind == T::Kind ? static_cast<const T*>(this) : nullptr; }
+};
+
+// Statements of a block, or expressions of a list, stored in the arena
+struct NodeList {
+    ASTNode** items = nullptr;
+    size_t count = 0;
+
+    ASTNode** begin() const { return items; }
+    ASTNode** end() const { return items + count; }
+    bool empty() const { return count == 0; }
 };
 
 // Expressions
 struct NumberNode : ASTNode {
-    int value;
-    explicit NumberNode(int v) : value(v) {}
+    static const NodeKind Kind = NodeKind::Number;
+    Value value;
+    explicit NumberNode(Value v) : ASTNode(Kind), value(v) {}
 };
 
 struct IdentifierNode : ASTNode {
-    std::string name;
-    explicit IdentifierNode(std::string n) : name(std::move(n)) {}
+    static const NodeKind Kind = NodeKind::Identifier;
+    std::string_view name;
+    explicit IdentifierNode(std::string_view n) : ASTNode(Kind), name(n) {}
 };
 
 struct BinaryOpNode : ASTNode {
-    std::string op;  
-    std::unique_ptr<ASTNode> left;
-    std::unique_ptr<ASTNode> right;
+    static const NodeKind Kind = NodeKind::Binary;
+    Op op;              // isBinary(op)
+    ASTNode* left;
+    ASTNode* right;
 
-    BinaryOpNode(std::string o, std::unique_ptr<ASTNode> l, std::unique_ptr<ASTNode> r)
-        : op(std::move(o)), left(std::move(l)), right(std::move(r)) {}
+    BinaryOpNode(Op o, ASTNode* l, ASTNode* r)
+        : ASTNode(Kind), op(o), left(l), right(r) {}
 };
 
-// NEW: Unary operator node (for !, - etc.)
+// Unary operator node (Op::Not or Op::Neg)
 struct UnaryOpNode : ASTNode {
-    std::string op;
-    std::unique_ptr<ASTNode> expr;
+    static const NodeKind Kind = NodeKind::Unary;
+    Op op;
+    ASTNode* expr;
 
-    UnaryOpNode(std::string o, std::unique_ptr<ASTNode> e)
-        : op(std::move(o)), expr(std::move(e)) {}
+    UnaryOpNode(Op o, ASTNode* e) : ASTNode(Kind), op(o), expr(e) {}
+};
+
+// Array literal: [e1, e2, ...]
+struct ArrayNode : ASTNode {
+    static const NodeKind Kind = NodeKind::Array;
+    NodeList elements;
+    explicit ArrayNode(NodeList e) : ASTNode(Kind), elements(e) {}
+};
+
+// array[index]
+struct IndexNode : ASTNode {
+    static const NodeKind Kind = NodeKind::Index;
+    ASTNode* array;
+    ASTNode* index;
+    IndexNode(ASTNode* a, ASTNode* i) : ASTNode(Kind), array(a), index(i) {}
+};
+
+// name(args...); the compiler knows which names exist
+struct CallNode : ASTNode {
+    static const NodeKind Kind = NodeKind::Call;
+    std::string_view name;
+    NodeList args;
+    CallNode(std::string_view n, NodeList a) : ASTNode(Kind), name(n), args(a) {}
 };
 
 // Statements
 struct AssignmentNode : ASTNode {
-    std::string varName;
-    std::unique_ptr<ASTNode> expr;
-    AssignmentNode(std::string v, std::unique_ptr<ASTNode> e)
-        : varName(std::move(v)), expr(std::move(e)) {}
+    static const NodeKind Kind = NodeKind::Assignment;
+    std::string_view varName;
+    ASTNode* expr;
+    AssignmentNode(std::string_view v, ASTNode* e) : ASTNode(Kind), varName(v), expr(e) {}
 };
 
 struct PrintNode : ASTNode {
-    std::unique_ptr<ASTNode> expr;
-    explicit PrintNode(std::unique_ptr<ASTNode> e) : expr(std::move(e)) {}
+    static const NodeKind Kind = NodeKind::Print;
+    ASTNode* expr;
+    explicit PrintNode(ASTNode* e) : ASTNode(Kind), expr(e) {}
 };
 
-// New statement nodes
 struct IfNode : ASTNode {
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> thenBranch;
-    std::unique_ptr<ASTNode> elseBranch; // may be null
-    IfNode(std::unique_ptr<ASTNode> c,
-           std::unique_ptr<ASTNode> t,
-           std::unique_ptr<ASTNode> e = nullptr)
-        : condition(std::move(c)), thenBranch(std::move(t)), elseBranch(std::move(e)) {}
+    static const NodeKind Kind = NodeKind::If;
+    ASTNode* condition;
+    ASTNode* thenBranch;
+    ASTNode* elseBranch; // may be null
+    IfNode(ASTNode* c, ASTNode* t, ASTNode* e = nullptr)
+        : ASTNode(Kind), condition(c), thenBranch(t), elseBranch(e) {}
 };
 
 struct WhileNode : ASTNode {
-    std::unique_ptr<ASTNode> condition;
-    std::unique_ptr<ASTNode> body;
-    WhileNode(std::unique_ptr<ASTNode> c, std::unique_ptr<ASTNode> b)
-        : condition(std::move(c)), body(std::move(b)) {}
+    static const NodeKind Kind = NodeKind::While;
+    ASTNode* condition;
+    ASTNode* body;
+    WhileNode(ASTNode* c, ASTNode* b) : ASTNode(Kind), condition(c), body(b) {}
 };
 
-// Optional: block of statements (used as body for if/while)
+// Block of statements (used as body for if/while)
 struct BlockNode : ASTNode {
-    std::vector<std::unique_ptr<ASTNode>> statements;
-    explicit BlockNode(std::vector<std::unique_ptr<ASTNode>> s)
-        : statements(std::move(s)) {}
+    static const NodeKind Kind = NodeKind::Block;
+    NodeList statements;
+    explicit BlockNode(NodeList s) : ASTNode(Kind), statements(s) {}
+};
+
+// func name(params) { body }, at the top level only
+struct FunctionNode : ASTNode {
+    static const NodeKind Kind = NodeKind::Function;
+    std::string_view name;
+    NodeList params;    // IdentifierNodes
+    ASTNode* body;      // a BlockNode
+    // Every AssignmentNode in the body as parsed; the names they assign
+    // are the locals. Kept apart so that folding away a dead branch
+    // cannot turn a local into a global.
+    NodeList assignments;
+    FunctionNode(std::string_view n, NodeList p, ASTNode* b, NodeList a)
+        : ASTNode(Kind), name(n), params(p), body(b), assignments(a) {}
 };
 
-// In Parser class public section, add:
-std::unique_ptr<ASTNode> ifStmt();
-std::unique_ptr<ASTNode> whileStmt();
-std::unique_ptr<ASTNode> block(); // parses { ... }
+// return expr; a bare return has no expr and returns 0
+struct ReturnNode : ASTNode {
+    static const NodeKind Kind = NodeKind::Return;
+    ASTNode* expr;      // may be null
+    explicit ReturnNode(ASTNode* e) : ASTNode(Kind), expr(e) {}
+};
+
+// A parsed program: the top-level statements plus the arena that owns
+// every node. Dropping it frees the whole tree at once.
+struct Ast {
+    Arena arena;
+    std::vector<ASTNode*> statements;
 
+    Ast() = default;
+    Ast(Ast&&) = default;
+    Ast& operator=(Ast&&) = default;
+};
+
+// Deepest expression the parser accepts: the limit applies both to the
+// height of the tree, which the compilers walk recursively, and to the
+// nesting of parentheses and unary operators, which the parser itself
+// recurses on. Absurd inputs get an error instead of a stack overflow.
+const uint32_t maxExpressionDepth = 10000;
 
 class Parser {
     std::vector<Token> tokens;
     size_t pos;
+    Ast ast;                          // filled by parse()
+    std::vector<ASTNode*> pending;    // statements and list elements being parsed
+    uint32_t height = 0;              // tree height of the expression parsed last
+    uint32_t nesting = 0;             // open brackets and unary operators
+
+    void enter(SourcePos at);         // ++nesting, failing past the limit
+    NodeList take(size_t first);      // pending[first...] into the arena
+    // Comma-separated expressions up to the closing token, which is
+    // consumed; height becomes the tallest of them
+    NodeList list(TokenType close, const char* message);
+
+    // Arena-allocate a node and record where it came from
+    template <typename T, typename... Args>
+    T* node(SourcePos at, Args&&... args) {
+        T* n = ast.arena.make<T>(std::forward<Args>(args)...);
+        n->pos = at;
+        return n;
+    }
 
 public:
-    Parser(const std::vector<Token>& toks);
+    explicit Parser(std::vector<Token> toks);
 
     const Token& peek();
     const Token& get();
-
-    std::vector<std::unique_ptr<ASTNode>> parse();
-    std::unique_ptr<ASTNode> statement();
-    std::unique_ptr<ASTNode> assignment();
-    std::unique_ptr<ASTNode> printStmt();
-    std::unique_ptr<ASTNode> expression();
-    std::unique_ptr<ASTNode> factor();
-
-    // Logical + comparison precedence chain
-    std::unique_ptr<ASTNode> logicalOr();
-    std::unique_ptr<ASTNode> logicalAnd();
-    std::unique_ptr<ASTNode> comparison();
-    std::unique_ptr<ASTNode> additive();
-    std::unique_ptr<ASTNode> term();
+    // Consume a token of the given type or fail at the current token
+    const Token& expect(TokenType type, const char* message);
+    [[noreturn]] void error(const std::string& message);
+
+    Ast parse();
+    // One expression and nothing after it, as the Ast's only statement
+    // (the input of a batch evaluation, see columnar.h)
+    Ast parseExpression();
+    ASTNode* statement();
+    ASTNode* assignment();
+    ASTNode* printStmt();
+    ASTNode* functionDecl();
+    ASTNode* returnStmt();
+    ASTNode* block(); // parses { ... }
+    // Precedence climbing: parses operators that bind at least as
+    // tightly as minPrecedence (see binaryPrecedence in parser.cpp)
+    ASTNode* expression(int minPrecedence = 1);
+    ASTNode* prefix();  // operand, possibly under unary operators
+    ASTNode* primary(); // literal, name, call or bracketed expression, then any [index]
 };
@@ -0,0 +1,74 @@
+#pragma once
+#include "bytecode.h"
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The time stamp counter is far cheaper to read than steady_clock
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BYTECODE_PROFILE_TSC 1
+#else
+#define BYTECODE_PROFILE_TSC 0
+#endif
+
+// Instruction-level profile of one VM::run. The VM's profiling loop calls
+// step() before every instruction, which counts it and charges the time
+// since the previous step to the previous instruction, so each pc ends up
+// with its execution count and the time spent in its handler (dispatch
+// included). Reports map pcs back to source through the chunk's position
+// table. Only used when a profiler is attached (VM::setProfiler); the
+// normal dispatch loops contain no profiling code.
+class Profiler {
+public:
+    void begin(const ChunkView& chunk);
+    void end();
+
+    void step(size_t pc) {
+        uint64_t t = now();
+        if (last != noPc) ticks[last] += t - lastTick;
+        ++counts[pc];
+        last = pc;
+        lastTick = t;
+    }
+
+    // Top source lines and loops by time, and per-opcode totals.
+    // name prefixes the line:column locations (usually the script path).
+    void report(std::ostream& out, const std::string& name, size_t top = 10) const;
+
+    // Collapsed stacks for flamegraph.pl / speedscope: one line per
+    // distinct stack, "main;loop L:C;...;line L;OPCODE nanoseconds"
+    void writeCollapsed(std::ostream& out) const;
+
+    uint64_t instructions() const;
+
+private:
+    static const size_t noPc = SIZE_MAX;
+
+    struct Loop { size_t head, backEdge; };  // pcs [head, backEdge]
+
+    std::vector<OpCode> ops;                 // copied, the chunk may be gone by report time
+    std::vector<PositionEntry> positions;
+    std::vector<Loop> loops;                 // outer loops before the ones they contain
+    std::vector<uint64_t> counts, ticks;     // per pc
+    size_t last = noPc;
+    uint64_t lastTick = 0;
+
+    // clock calibration, so ticks can be reported in nanoseconds
+    uint64_t startTick = 0;
+    std::chrono::steady_clock::time_point startTime;
+    double nsPerTick = 1.0;
+
+    SourcePos at(size_t pc) const;
+    double ns(uint64_t t) const { return t * nsPerTick; }
+
+    static uint64_t now() {
+#if BYTECODE_PROFILE_TSC
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include "parser.h"
+#include "regvm.h"
+#include "symbols.h"
+#include <unordered_map>
+#include <vector>
+
+// Compiles the AST to three-address register bytecode (RegChunk).
+// Variables live in fixed registers (their symbol-table slot), so reading
+// one costs no instruction; temporaries are allocated stack-wise above
+// them and reused as soon as an expression no longer needs them.
+// Registers are plain ints, so a double literal is a compile error.
+class RegisterCompiler {
+public:
+    RegChunk compile(const Ast& program);
+
+    // Variable slots; persists across compile() calls
+    const SymbolTable& symbols() const { return symbolTable; }
+
+private:
+    SymbolTable symbolTable;
+
+    // per-compile state
+    RegChunk* out = nullptr;
+    size_t firstTemp = 0, nextTemp = 0;
+    std::unordered_map<int, uint16_t> constantIndex;
+    std::vector<uint8_t> declared;   // assigned by a statement compiled so far
+    std::vector<uint8_t> known;      // definitely assigned at this point
+
+    void declareTargets(const ASTNode* node);
+
+    void compileStmt(const ASTNode* node);
+    // Evaluate node; the result ends up in dst if given, else in the
+    // returned register (a variable's own register or a temporary)
+    uint16_t compileExpr(const ASTNode* node, int dst = -1);
+    // Code that jumps when cond's truth is jumpIf and falls through
+    // otherwise, with && || ! as jumps. New jumps are chained onto list
+    // (see regcompiler.cpp); returns the new head.
+    uint32_t compileJump(const ASTNode* cond, bool jumpIf, uint32_t list);
+
+    uint16_t allocTemp();
+    uint16_t constant(int value);
+    uint16_t constant(const NumberNode* num);
+    size_t emit(RegOp op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0);
+    void mark(const ASTNode* node);   // position of the next instruction
+    void patch(size_t at, size_t target);
+    uint32_t chain(RegOp op, uint16_t a, uint32_t list);
+    void patchList(uint32_t list, size_t target);
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include "bytecode.h"
+#include "vm.h"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Three-address register bytecode. Registers 0..names.size()-1 are the
+// variable slots, the rest are temporaries. 'K' forms take their last
+// operand from the constant pool instead of a register.
+#define REGISTER_OPCODES(X) \
+    X(MOVE)    /* a = b */              \
+    X(LOADK)   /* a = K[b] */           \
+    X(ADD)  X(ADDK)   /* a = b + c */   \
+    X(SUB)  X(SUBK)                     \
+    X(MUL)  X(MULK)                     \
+    X(DIV)  X(DIVK)                     \
+    X(MOD)  X(MODK)                     \
+    X(EQ)   X(EQK)                      \
+    X(NEQ)  X(NEQK)                     \
+    X(LT)   X(LTK)                      \
+    X(LTE)  X(LTEK)                     \
+    X(GT)   X(GTK)                      \
+    X(GTE)  X(GTEK)                     \
+    X(AND)  X(OR)                       \
+    X(NOT)     /* a = !b */             \
+    X(JMP)     /* goto target */        \
+    X(JMPT)    /* if (a) goto target */ \
+    X(JMPF)    /* if (!a) goto target */\
+    X(CHECK)   /* error unless variable a was assigned */ \
+    X(DEFINE)  /* mark variable a as assigned */          \
+    X(PRINT)   /* print a */
+
+enum class RegOp : uint8_t {
+#define REGISTER_ENUM_ENTRY(name) name,
+    REGISTER_OPCODES(REGISTER_ENUM_ENTRY)
+#undef REGISTER_ENUM_ENTRY
+};
+
+#define REGISTER_COUNT_ENTRY(name) +1
+constexpr size_t REGOP_COUNT = 0 REGISTER_OPCODES(REGISTER_COUNT_ENTRY);
+#undef REGISTER_COUNT_ENTRY
+
+// 8-byte instruction. Jumps keep their 32-bit target in b (low half)
+// and c (high half).
+struct RegInstr {
+    RegOp op;
+    uint8_t reserved = 0;
+    uint16_t a = 0, b = 0, c = 0;
+
+    uint32_t target() const { return b | (static_cast<uint32_t>(c) << 16); }
+    void setTarget(uint32_t t) {
+        b = static_cast<uint16_t>(t);
+        c = static_cast<uint16_t>(t >> 16);
+    }
+};
+
+static_assert(sizeof(RegInstr) == 8, "RegInstr should stay 8 bytes");
+
+// Read-only view of a RegChunk, like ChunkView for the stack VM
+struct RegChunkView {
+    const RegInstr* code = nullptr;
+    size_t size = 0;
+    const int* constants = nullptr;
+    size_t constantCount = 0;
+    const std::string* names = nullptr;
+    size_t slots = 0;
+    size_t numRegisters = 0;
+    PositionView positions;
+};
+
+struct RegChunk {
+    std::vector<RegInstr> code;
+    std::vector<int> constants;
+    std::vector<std::string> names;   // variable registers
+    size_t numRegisters = 0;          // variables + temporaries
+    PositionTable positions;
+
+    RegChunkView view() const {
+        return {code.data(), code.size(), constants.data(), constants.size(),
+                names.data(), names.size(), numRegisters, positions.view()};
+    }
+};
+
+std::string regOpToString(RegOp op);
+
+// Textual debug view, e.g. "ADDK r0, r0, #1"
+void disassemble(const RegChunk& chunk, std::ostream& os);
+
+// Interpreter for RegChunk. Like VM, it keeps variables between run()
+// calls so the REPL can use it line by line.
+class RegisterVM {
+public:
+    void run(const RegChunk& chunk) { run(chunk.view()); }
+    void run(const RegChunkView& chunk);
+
+    // Same meaning as VM::setDispatch: Counting runs the switch loop
+    // and tallies executed instructions.
+    void setDispatch(VM::Dispatch d) { dispatch = d; }
+    // Same as VM::setOutput
+    void setOutput(OutputSink* sink) { output = sink ? sink : &stdoutSink; }
+    uint64_t instructionsExecuted() const { return executed; }
+
+private:
+    VM::Dispatch dispatch = BYTECODE_COMPUTED_GOTO ? VM::Dispatch::Threaded : VM::Dispatch::Switch;
+    uint64_t executed = 0;
+    StdoutSink stdoutSink;
+    OutputSink* output = &stdoutSink;
+
+    std::vector<int> registers;
+    std::vector<uint8_t> defined;      // per variable register
+
+    template <bool Counting>
+    void runSwitch(const RegChunkView& chunk);
+#if BYTECODE_COMPUTED_GOTO
+    void runThreaded(const RegChunkView& chunk);
+#endif
+};
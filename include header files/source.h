@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// 1-based position in the source text; line 0 means unknown
+struct SourcePos {
+    uint32_t line = 0;
+    uint32_t column = 0;
+};
+
+inline bool operator==(SourcePos a, SourcePos b) { return a.line == b.line && a.column == b.column; }
+inline bool operator!=(SourcePos a, SourcePos b) { return !(a == b); }
+
+// An error that can be traced back to a place in the source. what() is
+// the bare message; the caller decides how to show the position.
+struct SourceError : std::runtime_error {
+    SourcePos pos;
+    SourceError(const std::string& message, SourcePos p) : std::runtime_error(message), pos(p) {}
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Maps variable names to dense slot indices. Slots are never reused or
+// renumbered, so a table kept across compile() calls lets later REPL
+// lines see the variables defined by earlier ones.
+class SymbolTable {
+public:
+    // Slot for name, allocating a new one on first use
+    int32_t declare(std::string_view name) {
+        std::string key(name);
+        auto it = slots.find(key);
+        if (it != slots.end()) return it->second;
+        int32_t slot = static_cast<int32_t>(slotNames.size());
+        slots.emplace(key, slot);
+        slotNames.push_back(std::move(key));
+        return slot;
+    }
+
+    // Slot for name, or -1 if it was never declared
+    int32_t lookup(std::string_view name) const {
+        auto it = slots.find(std::string(name));
+        return it == slots.end() ? -1 : it->second;
+    }
+
+    size_t size() const { return slotNames.size(); }
+    const std::vector<std::string>& names() const { return slotNames; }
+
+private:
+    std::unordered_map<std::string, int32_t> slots;
+    std::vector<std::string> slotNames;
+};
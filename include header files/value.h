@@ -0,0 +1,161 @@
+#pragma once
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+// A value as the VM holds it: a 32-bit int, a double or an array,
+// NaN-boxed into 64 bits. A double is stored as its own bits; an int sits
+// in the low half under a tag that no double uses (a NaN payload, with
+// every real NaN stored as the one canonical NaN), and an array is a
+// handle into the VM's ArrayPool (array.h) under another such tag. Ints
+// stay ints until an operation meets a double, so integer-only programs
+// compute exactly as before and only pay for the tag test.
+class Value {
+public:
+    Value() = default;                 // int 0
+    Value(int i) : bits(intTag | static_cast<uint32_t>(i)) {}
+    Value(double d) {
+        if (d != d) d = canonicalNaN();
+        std::memcpy(&bits, &d, sizeof d);
+    }
+
+    bool isInt() const { return (bits >> 32) == intTagHigh; }
+    bool isArray() const { return (bits >> 32) == arrayTagHigh; }
+    bool isDouble() const { return !isInt() && !isArray(); }
+    int asInt() const { return static_cast<int32_t>(static_cast<uint32_t>(bits)); }
+    double asDouble() const {
+        double d;
+        std::memcpy(&d, &bits, sizeof d);
+        return d;
+    }
+    double toDouble() const { return isInt() ? asInt() : asDouble(); }
+
+    // Arrays are only made and read by an ArrayPool
+    static Value array(uint32_t handle) {
+        Value v;
+        v.bits = uint64_t(arrayTagHigh) << 32 | handle;
+        return v;
+    }
+    uint32_t asArray() const { return static_cast<uint32_t>(bits); }
+
+    // Nonzero: every pattern but int 0, 0.0 and -0.0. The VM never asks
+    // this of an array.
+    bool truthy() const { return bits != intTag && (bits << 1) != 0; }
+
+    // Encoding, for images and caches written by this build
+    uint64_t raw() const { return bits; }
+    static Value fromRaw(uint64_t b) {
+        Value v;
+        v.bits = b;
+        return v;
+    }
+
+    // Upper half of every int, for native code that tests it directly
+    static const uint32_t intTagHigh = 0xFFF90000u;
+    static const uint32_t arrayTagHigh = 0xFFFA0000u;
+
+    // The int fast path's test, one branch for both operands
+    friend bool bothInt(Value a, Value b) { return ((a.bits ^ intTag) | (b.bits ^ intTag)) >> 32 == 0; }
+    friend bool bothDouble(Value a, Value b) { return a.isDouble() && b.isDouble(); }
+    // Either operand is an array, so the operation is element-wise. Two
+    // ints pay for one test.
+    friend bool eitherArray(Value a, Value b) { return !bothInt(a, b) && (a.isArray() || b.isArray()); }
+
+private:
+    static const uint64_t intTag = uint64_t(intTagHigh) << 32;
+    static double canonicalNaN() {
+        const uint64_t quiet = 0x7FF8000000000000ull;
+        double d;
+        std::memcpy(&d, &quiet, sizeof d);
+        return d;
+    }
+
+    uint64_t bits = intTag;
+};
+
+static_assert(sizeof(Value) == 8, "Value should stay 8 bytes");
+
+// Arithmetic as the VM does it on numbers (arrays go to ArrayPool). Int
+// results wrap at 32 bits like the JIT's native code; a double operand
+// makes the other one a double.
+inline Value add(Value a, Value b) {
+    if (bothInt(a, b)) return static_cast<int>(static_cast<uint32_t>(a.asInt()) + static_cast<uint32_t>(b.asInt()));
+    return a.toDouble() + b.toDouble();
+}
+
+inline Value sub(Value a, Value b) {
+    if (bothInt(a, b)) return static_cast<int>(static_cast<uint32_t>(a.asInt()) - static_cast<uint32_t>(b.asInt()));
+    return a.toDouble() - b.toDouble();
+}
+
+inline Value mul(Value a, Value b) {
+    if (bothInt(a, b)) return static_cast<int>(static_cast<uint32_t>(a.asInt()) * static_cast<uint32_t>(b.asInt()));
+    return a.toDouble() * b.toDouble();
+}
+
+// -v: ints wrap (-INT_MIN is INT_MIN), doubles keep the sign of zero.
+// The same as mul(v, -1), which is how the VM negates.
+inline Value negate(Value v) {
+    if (v.isInt()) return static_cast<int>(0u - static_cast<uint32_t>(v.asInt()));
+    return -v.asDouble();
+}
+
+inline bool isZero(Value v) { return !v.truthy(); }
+
+// Int division truncates; INT_MIN / -1 wraps to INT_MIN (remainder 0)
+// instead of trapping. A zero divisor of either kind is an error.
+inline Value divide(Value a, Value b) {
+    if (isZero(b)) throw std::runtime_error("Division by zero");
+    if (bothInt(a, b)) {
+        if (b.asInt() == -1) return static_cast<int>(0u - static_cast<uint32_t>(a.asInt()));
+        return a.asInt() / b.asInt();
+    }
+    return a.toDouble() / b.toDouble();
+}
+
+// Remainder with the sign of a; fmod when either operand is a double
+inline Value modulo(Value a, Value b) {
+    if (isZero(b)) throw std::runtime_error("Division by zero");
+    if (bothInt(a, b)) {
+        if (b.asInt() == -1) return 0;
+        return a.asInt() % b.asInt();
+    }
+    return std::fmod(a.toDouble(), b.toDouble());
+}
+
+// Comparisons; an int and a double compare by value, and NaN is unequal
+// to everything
+inline bool equal(Value a, Value b) {
+    if (bothInt(a, b)) return a.raw() == b.raw();
+    return a.toDouble() == b.toDouble();
+}
+
+inline bool less(Value a, Value b) {
+    if (bothInt(a, b)) return a.asInt() < b.asInt();
+    return a.toDouble() < b.toDouble();
+}
+
+inline bool lessEqual(Value a, Value b) {
+    if (bothInt(a, b)) return a.asInt() <= b.asInt();
+    return a.toDouble() <= b.toDouble();
+}
+
+// Shortest text that reads back as d, with ".0" on whole numbers so a
+// double never prints like an int. out needs 32 bytes; returns the end.
+inline char* formatDouble(double d, char* out) {
+    char* end = std::to_chars(out, out + 32, d).ptr;
+    for (char* p = out; p != end; ++p)
+        if (*p == '.' || *p == 'e' || *p == 'n') return end;   // fraction, exponent, inf/nan
+    *end++ = '.';
+    *end++ = '0';
+    return end;
+}
+
+inline std::ostream& operator<<(std::ostream& os, Value v) {
+    if (v.isInt()) return os << v.asInt();
+    char text[32];
+    return os.write(text, formatDouble(v.asDouble(), text) - text);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "bytecode.h"
+#include <cstdint>
+
+// Checks stack bytecode before it runs: every opcode is known, variable
+// operands are valid slots, constant operands exist, jump targets lie
+// inside the code, no path pops an empty stack, and every instruction is
+// reached with the same stack depth on all paths. Functions are checked
+// the same way each on its own: jumps stay inside it, locals and calls
+// are in range, and no path runs past its end. Returns the deepest the
+// operand stack can get, in the main code or in one call's frame, which
+// lets the VM run the code on a preallocated stack without checks.
+// Throws std::runtime_error naming the first problem and its
+// instruction. Unreachable instructions are checked for valid operands
+// only.
+uint32_t verify(const ChunkView& chunk);
+
+// verify() the chunk and record the result in chunk.maxStack
+inline void verify(Chunk& chunk) {
+    chunk.maxStack = unverifiedStack;
+    chunk.maxStack = verify(chunk.view());
+}
@@ -1,18 +1,161 @@
 #pragma once
+#include "array.h"
 #include "bytecode.h"
+#include "jit.h"
+#include "output.h"
+#include "profiler.h"
+#include <cstdint>
+#include <memory>
 #include <vector>
-#include <unordered_map>
 #include <string>
-#include <iostream>
+
+// Threaded dispatch needs GCC/Clang computed goto; the build can turn it
+// off (BYTECODE_COMPUTED_GOTO=0) to use only the portable switch loop.
+#ifndef BYTECODE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define BYTECODE_COMPUTED_GOTO 1
+#else
+#define BYTECODE_COMPUTED_GOTO 0
+#endif
+#endif
 
 class VM {
 public:
-    void run(const std::vector<Instruction>& bytecode);
+    // Counting is the switch loop plus a tally of executed instructions
+    enum class Dispatch { Switch, Threaded, Counting };
+
+    void run(const Chunk& chunk) { run(chunk.view()); }
+    void run(const ChunkView& chunk);
+
+    // Forget every variable so the next run() starts like a fresh VM,
+    // keeping the storage for reuse
+    void reset();
+
+    // Choose the dispatch loop; Threaded falls back to Switch when the
+    // build has no computed-goto support.
+    void setDispatch(Dispatch d) { dispatch = d; }
+
+    // Where PRINT goes; nullptr restores the built-in buffered stdout.
+    // The sink is flushed whenever run() returns or throws.
+    void setOutput(OutputSink* sink) { output = sink ? sink : &stdoutSink; }
+    uint64_t instructionsExecuted() const { return executed; }
+
+    // Host access to variable slots: a value set before run() counts as
+    // assigned, and getVariable() returns false for a slot never assigned
+    void setVariable(size_t slot, Value value);
+    bool getVariable(size_t slot, Value& value) const;
+
+    // While a profiler is attached, run() uses an instrumented switch loop
+    // and ignores the dispatch setting; nullptr detaches it. The JIT is
+    // skipped too, so every iteration is seen by the profiler.
+    void setProfiler(Profiler* p) { profiler = p; }
+
+    // Quickening: run() executes a private copy of the code in which each
+    // instruction rewrites itself, on first execution, into a form
+    // specialized for what it saw (LOAD_VAR of an assigned slot, ADD of
+    // two ints, ...), guarded so it reverts if that stops holding. The
+    // chunk itself is never written, so one chunk can be shared by many
+    // VMs and threads or mapped read-only. Off, or while profiling, the
+    // chunk's own code runs as compiled.
+    void setQuickening(bool enabled) { quickening = enabled; }
+
+    // Calls nested deeper than this fail with "Call depth limit exceeded"
+    // rather than taking all memory; tail calls (return f(...)) do not
+    // nest. The frame stack is allocated at this size by the first run()
+    // of a chunk with functions, so calls themselves never allocate.
+    void setCallDepthLimit(size_t depth) { callDepthLimit = depth; }
+
+    // Loops whose back edge is taken 'threshold' times are compiled to
+    // native code and entered mid-run. No-op when the JIT is not built.
+    void setJit(bool enabled, uint32_t threshold = 1000) {
+        jitEnabled = enabled && BYTECODE_JIT;
+        jitThreshold = threshold;
+    }
 
 private:
-    std::vector<int> stack;
-    std::unordered_map<std::string, int> variables;
+    Dispatch dispatch = BYTECODE_COMPUTED_GOTO ? Dispatch::Threaded : Dispatch::Switch;
+    uint64_t executed = 0;
+    StdoutSink stdoutSink;
+    OutputSink* output = &stdoutSink;
+    Profiler* profiler = nullptr;
+
+    std::vector<Value> stack;
+    size_t stackFloor = 0;             // checked loops: the current call's first operand
+    std::vector<Value> variables;      // indexed by slot
+    std::vector<uint8_t> defined;      // slot has been assigned
+    // Arrays the program makes (array.h). A collection keeps those the
+    // stack and the variables can reach; reset() drops them all.
+    ArrayPool arrays;
+    std::string text;                  // PRINT of an array formats here
+
+    // Quickened copy of the running chunk's code, rebuilt by every run()
+    bool quickening = true;
+    bool quickActive = false;          // for this run(): enabled and not profiling
+    std::vector<Instruction> quick;
+    const Instruction* compiled = nullptr;   // the chunk's own code, for the JIT
+
+    // JIT state, reset for every run()
+    struct LoopState {
+        uint32_t count = 0;
+        bool failed = false;          // JIT declined this loop, or its guard failed
+        JitLoopFn code = nullptr;
+    };
+    bool jitEnabled = BYTECODE_JIT;
+    bool jitActive = false;           // for this run(): enabled and not profiling
+    uint32_t jitThreshold = 1000;
+    std::vector<LoopState> loops;     // indexed by back-edge pc
+    Jit jit;
+
+    // Called on a backward JMP at pc; returns where to continue
+    size_t backEdge(const ChunkView& chunk, size_t pc);
+
+    // Calls in progress, innermost last; each holds what RETURN gives
+    // back to the caller. A call's locals and operands are on 'stack'
+    // (see vm_ops.inc).
+    struct Frame {
+        uint32_t ret;                  // where the caller goes on
+        size_t base;                   // the caller's first local
+        size_t floor;                  // checked loops: the caller's stackFloor
+    };
+    std::unique_ptr<Frame[]> frames;
+    size_t frameCapacity = 0;
+    size_t callDepthLimit = 10000;
+    [[noreturn]] void callDepthExceeded() const;
+    // Unchecked loops: make 'stack' at least size long, moving it
+    void growStack(size_t size);
+
+    void push(Value value) { stack.push_back(value); }
+    Value pop() {
+        if (stack.size() <= stackFloor) stackUnderflow();
+        Value value = stack.back();
+        stack.pop_back();
+        return value;
+    }
+    [[noreturn]] static void stackUnderflow();   // out of line, off the hot path
+
+    // Array operations, out of line. Those that allocate collect first
+    // when the pool says so, keeping their operands alive; an operand
+    // still on the operand stack is found there.
+    Value arrayBinary(ArrayOp op, Value a, Value b);
+    Value newArray(const Value* elements, size_t n);
+    Value arrayRange(Value n);
+    void collectArrays(Value a, Value b);
+    void printArray(Value array);
+    // Conditions take numbers only; an array's truth would be ambiguous.
+    // A fused compare-and-branch first reports what the comparison would.
+    [[noreturn]] static void arrayCondition();
+    [[noreturn]] void arrayCondition(ArrayOp op, Value a, Value b);
+
+    // What the switch loop does besides dispatching
+    enum class Hook { None, Count, Profile };
 
-    void push(int value) { stack.push_back(value); }
-    int pop();
+    // Checked loops keep the operand stack in 'stack' and check every
+    // push and pop; unchecked ones, used for verified chunks, work on a
+    // plain pointer into 'stack' sized to the chunk's maxStack
+    template <Hook H, bool Checked>
+    void runSwitch(const ChunkView& chunk);
+#if BYTECODE_COMPUTED_GOTO
+    template <bool Checked>
+    void runThreaded(const ChunkView& chunk);
+#endif
 };
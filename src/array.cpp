@@ -0,0 +1,275 @@
+#include "array.h"
+#include <charconv>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+
+static const std::align_val_t blockAlign{64};
+
+// Bytes in a block of size class c
+static size_t classBytes(uint8_t c) { return size_t(64) << c; }
+
+static uint8_t sizeClassFor(size_t bytes) {
+    uint8_t c = 0;
+    while (classBytes(c) < bytes) ++c;
+    return c;
+}
+
+ArrayPool::~ArrayPool() {
+    for (void* p : owned) ::operator delete(p, blockAlign);
+}
+
+void* ArrayPool::block(uint8_t sizeClass) {
+    if (sizeClass < freeBlocks.size() && !freeBlocks[sizeClass].empty()) {
+        void* p = freeBlocks[sizeClass].back();
+        freeBlocks[sizeClass].pop_back();
+        return p;
+    }
+    const size_t bytes = classBytes(sizeClass);
+    if (bytes > slabBytes / 4) {
+        void* p = ::operator new(bytes, blockAlign);
+        owned.push_back(p);
+        return p;
+    }
+    // sizes are powers of two from 64 up, so carving keeps every block aligned
+    if (slabLeft < bytes) {
+        slab = static_cast<char*>(::operator new(slabBytes, blockAlign));
+        owned.push_back(slab);
+        slabLeft = slabBytes;
+    }
+    void* p = slab;
+    slab += bytes;
+    slabLeft -= bytes;
+    return p;
+}
+
+void ArrayPool::release(uint8_t sizeClass, void* data) {
+    if (freeBlocks.size() <= sizeClass) freeBlocks.resize(sizeClass + size_t(1));
+    freeBlocks[sizeClass].push_back(data);
+}
+
+Value ArrayPool::allocate(Kind kind, size_t n, void*& data) {
+    if (n > INT32_MAX) throw std::runtime_error("Array too long");
+    const size_t bytes = n * (kind == Kind::Int ? sizeof(int32_t) : sizeof(double));
+    const uint8_t c = sizeClassFor(bytes);
+    data = block(c);
+
+    uint32_t handle;
+    if (!freeHandles.empty()) {
+        handle = freeHandles.back();
+        freeHandles.pop_back();
+    } else {
+        handle = static_cast<uint32_t>(arrays.size());
+        arrays.emplace_back();
+    }
+    Array& a = arrays[handle];
+    a.data = data;
+    a.length = static_cast<uint32_t>(n);
+    a.kind = kind;
+    a.sizeClass = c;
+    a.marked = false;
+    liveBytes += classBytes(c);
+    sinceSweep += classBytes(c);
+    return Value::array(handle);
+}
+
+const ArrayPool::Array& ArrayPool::get(Value v, const char* what) const {
+    if (!v.isArray() || v.asArray() >= arrays.size() || !arrays[v.asArray()].data)
+        throw std::runtime_error(what);
+    return arrays[v.asArray()];
+}
+
+void ArrayPool::sweep() {
+    for (size_t h = 0; h < arrays.size(); ++h) {
+        Array& a = arrays[h];
+        if (a.data && !a.marked) {
+            release(a.sizeClass, a.data);
+            liveBytes -= classBytes(a.sizeClass);
+            a.data = nullptr;
+            freeHandles.push_back(static_cast<uint32_t>(h));
+        }
+        a.marked = false;
+    }
+    keptBytes = liveBytes;
+    sinceSweep = 0;
+}
+
+void ArrayPool::clear() {
+    for (Array& a : arrays)
+        if (a.data) release(a.sizeClass, a.data);
+    arrays.clear();
+    freeHandles.clear();
+    liveBytes = 0;
+    keptBytes = 0;
+    sinceSweep = 0;
+}
+
+Value ArrayPool::make(const Value* elements, size_t n) {
+    bool ints = true;
+    for (size_t i = 0; i < n; ++i) {
+        if (elements[i].isArray()) throw std::runtime_error("Array elements must be numbers");
+        ints = ints && elements[i].isInt();
+    }
+    void* data;
+    Value result = allocate(ints ? Kind::Int : Kind::Double, n, data);
+    if (ints) {
+        auto out = static_cast<int32_t*>(data);
+        for (size_t i = 0; i < n; ++i) out[i] = elements[i].asInt();
+    } else {
+        auto out = static_cast<double*>(data);
+        for (size_t i = 0; i < n; ++i) out[i] = elements[i].toDouble();
+    }
+    return result;
+}
+
+Value ArrayPool::range(Value n) {
+    if (!n.isInt() || n.asInt() < 0) throw std::runtime_error("range() needs a non-negative int");
+    void* data;
+    Value result = allocate(Kind::Int, static_cast<size_t>(n.asInt()), data);
+    auto out = static_cast<int32_t*>(data);
+    for (int32_t i = 0; i < n.asInt(); ++i) out[i] = i;
+    return result;
+}
+
+Value ArrayPool::binary(ArrayOp op, Value a, Value b) {
+    // copies: allocating may move the records
+    const Array none;
+    const Array x = a.isArray() ? get(a, "Invalid array") : none;
+    const Array y = b.isArray() ? get(b, "Invalid array") : none;
+    if (a.isArray() && b.isArray() && x.length != y.length) throw std::runtime_error("Array lengths differ");
+    const size_t n = a.isArray() ? x.length : y.length;
+    const bool compare = op >= ArrayOp::Eq;
+    const bool division = op == ArrayOp::Div || op == ArrayOp::Mod;
+
+    // a number operand stands for itself at every index
+    const bool aInt = a.isArray() ? x.kind == Kind::Int : a.isInt();
+    const bool bInt = b.isArray() ? y.kind == Kind::Int : b.isInt();
+    int32_t aScalar = a.isInt() ? a.asInt() : 0, bScalar = b.isInt() ? b.asInt() : 0;
+
+    if (division) {
+        bool zero = b.isArray() ? (bInt ? kernels->countInt(static_cast<const int32_t*>(y.data), n)
+                                        : kernels->countDouble(static_cast<const double*>(y.data), n)) != n
+                                : isZero(b);
+        if (zero) throw std::runtime_error("Division by zero");
+    }
+
+    void* data;
+    if (aInt && bInt) {
+        const int32_t* l = a.isArray() ? static_cast<const int32_t*>(x.data) : &aScalar;
+        const int32_t* r = b.isArray() ? static_cast<const int32_t*>(y.data) : &bScalar;
+        const bool lOne = !a.isArray(), rOne = !b.isArray();
+        Value result = allocate(Kind::Int, n, data);
+        auto out = static_cast<int32_t*>(data);
+        if (compare) {
+            kernels->compareInt(op, l, lOne, r, rOne, out, n);
+        } else if (division) {
+            // no SIMD integer division; same rules as divide() and modulo()
+            for (size_t i = 0; i < n; ++i) {
+                int32_t p = l[lOne ? 0 : i], q = r[rOne ? 0 : i];
+                if (q == -1) out[i] = op == ArrayOp::Div ? static_cast<int32_t>(0u - static_cast<uint32_t>(p)) : 0;
+                else out[i] = op == ArrayOp::Div ? p / q : p % q;
+            }
+        } else {
+            kernels->arithInt(op, l, lOne, r, rOne, out, n);
+        }
+        return result;
+    }
+
+    // Mixed or double: int arrays are widened into scratch blocks first
+    double aNumber = a.isArray() ? 0.0 : a.toDouble(), bNumber = b.isArray() ? 0.0 : b.toDouble();
+    const double* l = &aNumber;
+    const double* r = &bNumber;
+    void* scratch[2] = {nullptr, nullptr};
+    const uint8_t scratchClass = sizeClassFor(n * sizeof(double));
+    Value result;
+    try {
+        if (a.isArray() && x.kind == Kind::Int) {
+            scratch[0] = block(scratchClass);
+            kernels->widen(static_cast<const int32_t*>(x.data), static_cast<double*>(scratch[0]), n);
+            l = static_cast<const double*>(scratch[0]);
+        } else if (a.isArray()) {
+            l = static_cast<const double*>(x.data);
+        }
+        if (b.isArray() && y.kind == Kind::Int) {
+            scratch[1] = block(scratchClass);
+            kernels->widen(static_cast<const int32_t*>(y.data), static_cast<double*>(scratch[1]), n);
+            r = static_cast<const double*>(scratch[1]);
+        } else if (b.isArray()) {
+            r = static_cast<const double*>(y.data);
+        }
+        const bool lOne = !a.isArray(), rOne = !b.isArray();
+
+        if (compare) {
+            result = allocate(Kind::Int, n, data);
+            kernels->compareDouble(op, l, lOne, r, rOne, static_cast<int32_t*>(data), n);
+        } else {
+            result = allocate(Kind::Double, n, data);
+            auto out = static_cast<double*>(data);
+            if (op == ArrayOp::Mod) {
+                for (size_t i = 0; i < n; ++i) out[i] = std::fmod(l[lOne ? 0 : i], r[rOne ? 0 : i]);
+            } else {
+                kernels->arithDouble(op, l, lOne, r, rOne, out, n);
+            }
+        }
+    } catch (...) {
+        for (void* s : scratch)
+            if (s) release(scratchClass, s);
+        throw;
+    }
+    for (void* s : scratch)
+        if (s) release(scratchClass, s);
+    return result;
+}
+
+Value ArrayPool::index(Value array, Value i) const {
+    const Array& a = get(array, "Only arrays can be indexed");
+    if (!i.isInt()) throw std::runtime_error("Array index must be an int");
+    if (i.asInt() < 0 || static_cast<uint32_t>(i.asInt()) >= a.length) throw std::runtime_error("Array index out of range");
+    if (a.kind == Kind::Int) return static_cast<const int32_t*>(a.data)[i.asInt()];
+    return static_cast<const double*>(a.data)[i.asInt()];
+}
+
+Value ArrayPool::length(Value array) const {
+    return static_cast<int>(get(array, "len() needs an array").length);
+}
+
+// Int sums wrap like ADD; the sum of no elements is int 0
+Value ArrayPool::sum(Value array) const {
+    const Array& a = get(array, "sum() needs an array");
+    if (a.kind == Kind::Int) return kernels->sumInt(static_cast<const int32_t*>(a.data), a.length);
+    return kernels->sumDouble(static_cast<const double*>(a.data), a.length);
+}
+
+Value ArrayPool::min(Value array) const {
+    const Array& a = get(array, "min() needs an array");
+    if (a.length == 0) throw std::runtime_error("min() of an empty array");
+    if (a.kind == Kind::Int) return kernels->minInt(static_cast<const int32_t*>(a.data), a.length);
+    return kernels->minDouble(static_cast<const double*>(a.data), a.length);
+}
+
+Value ArrayPool::max(Value array) const {
+    const Array& a = get(array, "max() needs an array");
+    if (a.length == 0) throw std::runtime_error("max() of an empty array");
+    if (a.kind == Kind::Int) return kernels->maxInt(static_cast<const int32_t*>(a.data), a.length);
+    return kernels->maxDouble(static_cast<const double*>(a.data), a.length);
+}
+
+Value ArrayPool::count(Value array) const {
+    const Array& a = get(array, "count() needs an array");
+    if (a.kind == Kind::Int) return static_cast<int>(kernels->countInt(static_cast<const int32_t*>(a.data), a.length));
+    return static_cast<int>(kernels->countDouble(static_cast<const double*>(a.data), a.length));
+}
+
+void ArrayPool::format(Value array, std::string& out) const {
+    const Array& a = get(array, "Invalid array");
+    char text[32];
+    out += '[';
+    for (uint32_t i = 0; i < a.length; ++i) {
+        if (i) out += ", ";
+        char* end = a.kind == Kind::Int
+                        ? std::to_chars(text, text + sizeof text, static_cast<const int32_t*>(a.data)[i]).ptr
+                        : formatDouble(static_cast<const double*>(a.data)[i], text);
+        out.append(text, end);
+    }
+    out += ']';
+}
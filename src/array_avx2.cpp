@@ -0,0 +1,78 @@
+// AVX2 array kernels. The build compiles this file alone with AVX2
+// enabled, and arrayKernels() only picks it on a CPU that has AVX2.
+#include "array.h"
+#include <cstdint>
+#include <limits>
+#include <immintrin.h>
+
+#include "array_kernels.inc"
+
+namespace {
+
+struct Avx2Int {
+    using V = __m256i;
+    using M = __m256i;
+    static constexpr size_t W = 8;
+
+    static V load(const int32_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static void store(int32_t* p, V v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+    static V set1(int32_t x) { return _mm256_set1_epi32(x); }
+    static V add(V a, V b) { return _mm256_add_epi32(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_epi32(a, b); }
+    static V mul(V a, V b) { return _mm256_mullo_epi32(a, b); }
+    static V min(V a, V b) { return _mm256_min_epi32(a, b); }
+    static V max(V a, V b) { return _mm256_max_epi32(a, b); }
+    static M eq(V a, V b) { return _mm256_cmpeq_epi32(a, b); }
+    static M ne(V a, V b) { return _mm256_xor_si256(eq(a, b), _mm256_set1_epi32(-1)); }
+    static M lt(V a, V b) { return _mm256_cmpgt_epi32(b, a); }
+    static M le(V a, V b) { return _mm256_xor_si256(_mm256_cmpgt_epi32(a, b), _mm256_set1_epi32(-1)); }
+    static void storeBool(int32_t* p, M m) { store(p, _mm256_srli_epi32(m, 31)); }
+    static V oneWhere(M m) { return _mm256_srli_epi32(m, 31); }
+    static unsigned bits(M m) { return static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(m))); }
+};
+
+struct Avx2Double {
+    using V = __m256d;
+    using M = __m256d;
+    static constexpr size_t W = 4;
+
+    static V load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+    static V set1(double x) { return _mm256_set1_pd(x); }
+    static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm256_div_pd(a, b); }
+    static V min(V a, V b) { return _mm256_min_pd(a, b); }
+    static V max(V a, V b) { return _mm256_max_pd(a, b); }
+    static M eq(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+    static M ne(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); }
+    static M lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static M le(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static M unordered(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_UNORD_Q); }
+    static M either(M a, M b) { return _mm256_or_pd(a, b); }
+    static bool any(M m) { return _mm256_movemask_pd(m) != 0; }
+    // the low dword of each 64-bit mask, gathered into 128 bits, as 0 or 1
+    static void storeBool(int32_t* p, M m) {
+        __m256i low = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(m), _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_srli_epi32(_mm256_castsi256_si128(low), 31));
+    }
+    static V oneWhere(M m) { return _mm256_and_pd(m, _mm256_set1_pd(1.0)); }
+    static unsigned bits(M m) { return static_cast<unsigned>(_mm256_movemask_pd(m)); }
+    static void widen(const int32_t* in, double* out) {
+        _mm256_storeu_pd(out, _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))));
+    }
+};
+
+struct Avx2 {
+    using I = Avx2Int;
+    using D = Avx2Double;
+};
+
+const ArrayKernels kernels = makeKernels<Avx2>("avx2");
+
+}  // namespace
+
+const ArrayKernels& avx2ArrayKernels() {
+    return kernels;
+}
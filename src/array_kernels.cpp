@@ -0,0 +1,114 @@
+#include "array.h"
+#include <cstdint>
+#include <limits>
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define BYTECODE_SSE2 1
+#include <emmintrin.h>
+#else
+#define BYTECODE_SSE2 0
+#endif
+
+#include "array_kernels.inc"
+
+#ifndef BYTECODE_AVX2
+#define BYTECODE_AVX2 0
+#endif
+
+#if BYTECODE_AVX2
+const ArrayKernels& avx2ArrayKernels();   // array_avx2.cpp
+#endif
+
+namespace {
+
+#if BYTECODE_SSE2
+// SSE2 only: it is part of x86-64, so this set needs no CPU check. SSE2
+// has no 32-bit multiply, min or max; they are built from other ops.
+struct Sse2Int {
+    using V = __m128i;
+    using M = __m128i;
+    static constexpr size_t W = 4;
+
+    static V load(const int32_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static void store(int32_t* p, V v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+    static V set1(int32_t x) { return _mm_set1_epi32(x); }
+    static V add(V a, V b) { return _mm_add_epi32(a, b); }
+    static V sub(V a, V b) { return _mm_sub_epi32(a, b); }
+    static V mul(V a, V b) {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+    static V select(M m, V a, V b) { return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); }
+    static V min(V a, V b) { return select(_mm_cmplt_epi32(a, b), a, b); }
+    static V max(V a, V b) { return select(_mm_cmpgt_epi32(a, b), a, b); }
+    static M eq(V a, V b) { return _mm_cmpeq_epi32(a, b); }
+    static M ne(V a, V b) { return _mm_xor_si128(eq(a, b), _mm_set1_epi32(-1)); }
+    static M lt(V a, V b) { return _mm_cmplt_epi32(a, b); }
+    static M le(V a, V b) { return _mm_xor_si128(_mm_cmpgt_epi32(a, b), _mm_set1_epi32(-1)); }
+    static void storeBool(int32_t* p, M m) { store(p, _mm_srli_epi32(m, 31)); }
+    static V oneWhere(M m) { return _mm_srli_epi32(m, 31); }
+    static unsigned bits(M m) { return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(m))); }
+};
+
+struct Sse2Double {
+    using V = __m128d;
+    using M = __m128d;
+    static constexpr size_t W = 2;
+
+    static V load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+    static V set1(double x) { return _mm_set1_pd(x); }
+    static V add(V a, V b) { return _mm_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm_div_pd(a, b); }
+    static V min(V a, V b) { return _mm_min_pd(a, b); }
+    static V max(V a, V b) { return _mm_max_pd(a, b); }
+    static M eq(V a, V b) { return _mm_cmpeq_pd(a, b); }
+    static M ne(V a, V b) { return _mm_cmpneq_pd(a, b); }
+    static M lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+    static M le(V a, V b) { return _mm_cmple_pd(a, b); }
+    static M unordered(V a, V b) { return _mm_cmpunord_pd(a, b); }
+    static M either(M a, M b) { return _mm_or_pd(a, b); }
+    static bool any(M m) { return _mm_movemask_pd(m) != 0; }
+    // the low dword of each 64-bit mask, as 0 or 1
+    static void storeBool(int32_t* p, M m) {
+        __m128i low = _mm_shuffle_epi32(_mm_castpd_si128(m), _MM_SHUFFLE(2, 0, 2, 0));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_srli_epi32(low, 31));
+    }
+    static V oneWhere(M m) { return _mm_and_pd(m, _mm_set1_pd(1.0)); }
+    static unsigned bits(M m) { return static_cast<unsigned>(_mm_movemask_pd(m)); }
+    static void widen(const int32_t* in, double* out) {
+        _mm_storeu_pd(out, _mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in))));
+    }
+};
+
+struct Sse2 {
+    using I = Sse2Int;
+    using D = Sse2Double;
+};
+
+const ArrayKernels sse2Kernels = makeKernels<Sse2>("sse2");
+#endif
+
+const ArrayKernels scalarKernels = makeKernels<Scalar>("scalar");
+
+}  // namespace
+
+std::vector<const ArrayKernels*> availableArrayKernels() {
+    std::vector<const ArrayKernels*> sets;
+#if BYTECODE_AVX2
+    if (__builtin_cpu_supports("avx2")) sets.push_back(&avx2ArrayKernels());
+#endif
+#if BYTECODE_SSE2
+    sets.push_back(&sse2Kernels);
+#endif
+    sets.push_back(&scalarKernels);
+    return sets;
+}
+
+const ArrayKernels& arrayKernels() {
+    static const ArrayKernels* best = availableArrayKernels().front();
+    return *best;
+}
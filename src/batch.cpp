@@ -0,0 +1,168 @@
+#include "batch.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <system_error>
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Same form main.cpp prints: name:line:column: error: message
+static std::string describe(const std::string& name, const std::runtime_error& e) {
+    std::string text = name;
+    auto located = dynamic_cast<const SourceError*>(&e);
+    if (located && located->pos.line)
+        text += ":" + std::to_string(located->pos.line) + ":" + std::to_string(located->pos.column);
+    return text + ": error: " + e.what();
+}
+
+BatchRunner::BatchRunner(unsigned threads, bool optimize) : optimize(optimize) {
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    if (threads == 0) threads = cores;
+    threads = std::min(threads, maxThreadsPerCore * cores);
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(new Worker);
+        workers.back()->vm.setOutput(&workers.back()->sink);
+    }
+    try {
+        for (size_t i = 0; i < workers.size(); ++i) workers[i]->thread = std::thread(&BatchRunner::work, this, i);
+    } catch (std::system_error& e) {
+        // the destructor will not run: stop the workers already started
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers)
+            if (w->thread.joinable()) w->thread.join();
+        throw std::runtime_error(std::string("cannot start worker threads: ") + e.what());
+    }
+}
+
+BatchRunner::~BatchRunner() {
+    {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers) w->thread.join();
+}
+
+void BatchRunner::forEach(size_t count, std::function<void(size_t, Worker&)> body) {
+    if (count == 0) return;
+    // Each worker gets a contiguous block, lowest index at the back where
+    // the owner takes from; thieves take the other end
+    const size_t n = workers.size();
+    for (size_t i = 0; i < n; ++i) {
+        std::lock_guard<std::mutex> g(workers[i]->lock);
+        for (size_t j = count * (i + 1) / n; j-- > count * i / n;) workers[i]->jobs.push_back(j);
+    }
+
+    std::unique_lock<std::mutex> g(lock);
+    task = std::move(body);
+    active = n;
+    ++round;
+    wake.notify_all();
+    finished.wait(g, [&] { return active == 0; });
+    task = nullptr;
+}
+
+void BatchRunner::work(size_t self) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> g(lock);
+            wake.wait(g, [&] { return stopping || round != seen; });
+            if (stopping) return;
+            seen = round;
+        }
+        // no job creates more, so once every deque is empty this round is
+        // over for this worker
+        size_t job;
+        while (next(self, job)) task(job, *workers[self]);
+
+        std::lock_guard<std::mutex> g(lock);
+        if (--active == 0) finished.notify_one();
+    }
+}
+
+bool BatchRunner::next(size_t self, size_t& job) {
+    Worker& own = *workers[self];
+    {
+        std::lock_guard<std::mutex> g(own.lock);
+        if (!own.jobs.empty()) {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+
+    // Steal half of the first non-empty deque, so a thief comes back less
+    // often when jobs are tiny
+    std::vector<size_t> taken;
+    for (size_t i = 1; i < workers.size() && taken.empty(); ++i) {
+        Worker& victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> g(victim.lock);
+        size_t half = (victim.jobs.size() + 1) / 2;
+        taken.assign(victim.jobs.begin(), victim.jobs.begin() + half);
+        victim.jobs.erase(victim.jobs.begin(), victim.jobs.begin() + half);
+    }
+    if (taken.empty()) return false;
+    stolen += taken.size();
+
+    job = taken.front();
+    std::lock_guard<std::mutex> g(own.lock);
+    own.jobs.insert(own.jobs.end(), taken.rbegin(), taken.rend() - 1);
+    return true;
+}
+
+std::vector<BatchProgram> BatchRunner::compile(const std::vector<std::string>& names,
+                                               const std::vector<std::string>& sources) {
+    std::vector<BatchProgram> programs(sources.size());
+    forEach(sources.size(), [&](size_t i, Worker&) {
+        BatchProgram& p = programs[i];
+        p.name = names[i];
+        try {
+            Lexer lexer(sources[i]);
+            Parser parser(lexer.tokenize());
+            auto program = parser.parse();
+            if (optimize) foldConstants(program);
+            Compiler compiler;
+            p.chunk = compiler.compile(program);
+            if (optimize) peephole(p.chunk);
+        } catch (std::runtime_error& e) {
+            p.chunk = Chunk();
+            p.error = describe(p.name, e);
+        }
+    });
+    return programs;
+}
+
+std::vector<BatchResult> BatchRunner::run(const std::vector<const BatchProgram*>& jobs) {
+    std::vector<BatchResult> results(jobs.size());
+    const Clock::time_point start = Clock::now();
+    forEach(jobs.size(), [&](size_t i, Worker& w) {
+        const BatchProgram& p = *jobs[i];
+        BatchResult& r = results[i];
+        const Clock::time_point begin = Clock::now();
+        if (!p.error.empty()) {
+            r.error = p.error;
+        } else {
+            w.vm.reset();
+            try {
+                w.vm.run(p.chunk);
+            } catch (std::runtime_error& e) {
+                r.error = describe(p.name, e);
+            }
+            r.output = w.sink.str();
+            w.sink.clear();
+        }
+        const Clock::time_point end = Clock::now();
+        r.seconds = std::chrono::duration<double>(end - begin).count();
+        r.latency = std::chrono::duration<double>(end - start).count();
+    });
+    return results;
+}
@@ -1,41 +1,135 @@
 #include "bytecode.h"
 #include "parser.h"   // for ASTNode, NumberNode, IdentifierNode, etc.
+#include <algorithm>
+#include <iterator>
 #include <stdexcept>
 
-void generateBytecode(const ASTNode* node, std::vector<Instruction>& instructions) {
-    if (auto num = dynamic_cast<const NumberNode*>(node)) {
-        instructions.push_back({OpCode::LOAD_CONST, std::to_string(num->value)});
+void PositionTable::add(size_t pc, SourcePos pos) {
+    // a later mark at the same pc describes the instruction more closely
+    if (!entries.empty() && entries.back().pc == pc) entries.pop_back();
+    if (!entries.empty() && entries.back().pos == pos) return;
+    entries.push_back({static_cast<uint32_t>(pc), pos});
+}
+
+SourcePos PositionView::at(size_t pc) const {
+    const PositionEntry* end = entries + count;
+    auto it = std::upper_bound(entries, end, pc,
+                               [](size_t p, const PositionEntry& e) { return p < e.pc; });
+    if (it == entries) return {};
+    return std::prev(it)->pos;
+}
+
+void rethrowAt(PositionView positions, size_t pc) {
+    try {
+        throw;
+    } catch (SourceError&) {
+        throw;
+    } catch (std::runtime_error& e) {
+        throw SourceError(e.what(), positions.at(pc));
     }
-    else if (auto id = dynamic_cast<const IdentifierNode*>(node)) {
-        instructions.push_back({OpCode::LOAD_VAR, id->name});
+}
+
+void disassemble(const Chunk& chunk, std::ostream& os) {
+    size_t function = 0;
+    for (size_t pc = 0; pc < chunk.code.size(); ++pc) {
+        const Instruction& instr = chunk.code[pc];
+        if (function < chunk.functions.size() && chunk.functions[function].entry == pc) {
+            const Function& f = chunk.functions[function];
+            os << "function " << function << " (" << f.params << " params, " << f.locals << " locals):\n";
+            ++function;
+        }
+        os << opcodeToString(instr.op);
+        switch (instr.op) {
+            case OpCode::LOAD_CONST:
+            case OpCode::NEW_ARRAY:
+            case OpCode::LOAD_LOCAL:
+            case OpCode::STORE_LOCAL:
+                os << " " << instr.arg;
+                break;
+            case OpCode::CALL:
+            case OpCode::TAIL_CALL:
+                os << " " << instr.arg << " " << instr.slot;
+                break;
+            case OpCode::LOAD_DOUBLE:
+                os << " " << Value(chunk.constants[instr.arg]);
+                break;
+            case OpCode::LOAD_VAR:
+            case OpCode::STORE_VAR:
+                os << " " << chunk.names[instr.arg];
+                break;
+            case OpCode::INC_VAR:
+            case OpCode::LOAD_VAR_CONST:
+            case OpCode::ADD_VAR_CONST:
+            case OpCode::SUB_VAR_CONST:
+            case OpCode::MUL_VAR_CONST:
+                os << " " << chunk.names[instr.slot] << " " << instr.arg;
+                break;
+            default:
+                if (isJump(instr.op)) os << " " << instr.arg;
+                break;
+        }
+        os << "\n";
     }
-    else if (auto bin = dynamic_cast<const BinaryOpNode*>(node)) {
-        generateBytecode(bin->left.get(), instructions);
-        generateBytecode(bin->right.get(), instructions);
-
-        if (bin->op == "+") instructions.push_back({OpCode::ADD, ""});
-        else if (bin->op == "-") instructions.push_back({OpCode::SUB, ""});
-        else if (bin->op == "*") instructions.push_back({OpCode::MUL, ""});
-        else if (bin->op == "/") instructions.push_back({OpCode::DIV, ""});
-        else if (bin->op == "%") instructions.push_back({OpCode::MOD, ""});
-
-        // 🔹 New comparison operators
-        else if (bin->op == "==") instructions.push_back({OpCode::CMP_EQ, ""});
-        else if (bin->op == "!=") instructions.push_back({OpCode::CMP_NEQ, ""});
-        else if (bin->op == "<")  instructions.push_back({OpCode::CMP_LT, ""});
-        else if (bin->op == "<=") instructions.push_back({OpCode::CMP_LTE, ""});
-        else if (bin->op == ">")  instructions.push_back({OpCode::CMP_GT, ""});
-        else if (bin->op == ">=") instructions.push_back({OpCode::CMP_GTE, ""});
-
-        else throw std::runtime_error("Unknown binary operator: " + bin->op);
+}
+
+static int32_t nameIndex(Chunk& chunk, std::string_view name) {
+    auto it = std::find(chunk.names.begin(), chunk.names.end(), name);
+    if (it != chunk.names.end()) return static_cast<int32_t>(it - chunk.names.begin());
+    chunk.names.emplace_back(name);
+    return static_cast<int32_t>(chunk.names.size() - 1);
+}
+
+void generateBytecode(const ASTNode* node, Chunk& chunk) {
+    auto& instructions = chunk.code;
+    switch (node->kind) {
+    case NodeKind::Number: {
+        Value value = static_cast<const NumberNode*>(node)->value;
+        if (value.isInt()) {
+            instructions.push_back({OpCode::LOAD_CONST, value.asInt()});
+        } else {
+            instructions.push_back({OpCode::LOAD_DOUBLE, static_cast<int32_t>(chunk.constants.size())});
+            chunk.constants.push_back(value.asDouble());
+        }
+        break;
     }
+    case NodeKind::Identifier:
+        instructions.push_back({OpCode::LOAD_VAR, nameIndex(chunk, static_cast<const IdentifierNode*>(node)->name)});
+        break;
+    case NodeKind::Binary: {
+        auto bin = static_cast<const BinaryOpNode*>(node);
+        generateBytecode(bin->left, chunk);
+        generateBytecode(bin->right, chunk);
 
-    else if (auto assign = dynamic_cast<const AssignmentNode*>(node)) {
-        generateBytecode(assign->expr.get(), instructions);
-        instructions.push_back({OpCode::STORE_VAR, assign->varName});
+        switch (bin->op) {
+            case Op::Add: instructions.push_back({OpCode::ADD}); break;
+            case Op::Sub: instructions.push_back({OpCode::SUB}); break;
+            case Op::Mul: instructions.push_back({OpCode::MUL}); break;
+            case Op::Div: instructions.push_back({OpCode::DIV}); break;
+            case Op::Mod: instructions.push_back({OpCode::MOD}); break;
+
+            // 🔹 New comparison operators
+            case Op::Eq:  instructions.push_back({OpCode::CMP_EQ}); break;
+            case Op::Neq: instructions.push_back({OpCode::CMP_NEQ}); break;
+            case Op::Lt:  instructions.push_back({OpCode::CMP_LT}); break;
+            case Op::Lte: instructions.push_back({OpCode::CMP_LTE}); break;
+            case Op::Gt:  instructions.push_back({OpCode::CMP_GT}); break;
+            case Op::Gte: instructions.push_back({OpCode::CMP_GTE}); break;
+
+            default: throw std::runtime_error(std::string("Unknown binary operator: ") + opName(bin->op));
+        }
+        break;
+    }
+    case NodeKind::Assignment: {
+        auto assign = static_cast<const AssignmentNode*>(node);
+        generateBytecode(assign->expr, chunk);
+        instructions.push_back({OpCode::STORE_VAR, nameIndex(chunk, assign->varName)});
+        break;
     }
-    else if (auto printNode = dynamic_cast<const PrintNode*>(node)) {
-        generateBytecode(printNode->expr.get(), instructions);
-        instructions.push_back({OpCode::PRINT, ""});
+    case NodeKind::Print:
+        generateBytecode(static_cast<const PrintNode*>(node)->expr, chunk);
+        instructions.push_back({OpCode::PRINT});
+        break;
+    default:
+        break;
     }
 }
@@ -0,0 +1,353 @@
+#include "cache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include "image.h"
+#include "lexer.h"
+#include "parser.h"
+#include "optimizer.h"
+#include "verifier.h"
+
+// Trailing blanks on each line and blank lines at the end. Removing them
+// moves no token, so the cached position table stays right for every
+// source that maps to the entry.
+static std::string normalize(std::string_view source) {
+    auto blank = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; };
+    std::string out;
+    out.reserve(source.size());
+    size_t start = 0;
+    while (start <= source.size()) {
+        size_t end = source.find('\n', start);
+        if (end == std::string_view::npos) end = source.size();
+        size_t last = end;
+        while (last > start && blank(source[last - 1])) --last;
+        out.append(source.data() + start, last - start);
+        if (end < source.size()) out += '\n';
+        start = end + 1;
+    }
+    while (!out.empty() && out.back() == '\n') out.pop_back();
+    return out;
+}
+
+static uint64_t fnv1a(std::string_view text, bool optimize) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : text) hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return (hash ^ (optimize ? 1 : 0)) * 1099511628211ull;
+}
+
+static bool hasSlotField(OpCode op) {
+    switch (op) {
+        case OpCode::INC_VAR:
+        case OpCode::LOAD_VAR_CONST:
+        case OpCode::ADD_VAR_CONST:
+        case OpCode::SUB_VAR_CONST:
+        case OpCode::MUL_VAR_CONST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static size_t entryBytes(const std::string& source, const Chunk& chunk,
+                         const std::vector<Compiler::Import>& imports) {
+    size_t bytes = 128 + source.size() + chunk.code.size() * sizeof(Instruction) +
+                   chunk.constants.size() * sizeof(double) +
+                   chunk.positions.entries.size() * sizeof(PositionEntry);
+    for (const auto& n : chunk.names) bytes += sizeof(std::string) + n.size();
+    for (const auto& i : imports) bytes += sizeof(Compiler::Import) + i.name.size();
+    return bytes;
+}
+
+// The entry's code with its slots renumbered into compiler's symbol
+// table. Returns false when a renumbered slot does not fit an
+// instruction, so the caller compiles directly instead.
+static bool link(const Chunk& cached, const std::vector<Compiler::Import>& imports,
+                 SymbolTable& symbols, Chunk& out) {
+    // Imports are in slot order, so they can be matched while walking the
+    // slots. Names are declared in the order a direct compile would, up
+    // to the first unknown import.
+    std::vector<int32_t> slots(cached.names.size());
+    size_t next = 0;
+    for (size_t i = 0; i < cached.names.size(); ++i) {
+        const std::string& name = cached.names[i];
+        if (next < imports.size() && imports[next].name == name) {
+            slots[i] = symbols.lookup(name);
+            if (slots[i] < 0) throw SourceError("Undefined variable: " + name, imports[next].pos);
+            ++next;
+        } else {
+            slots[i] = symbols.declare(name);
+        }
+    }
+
+    out.code = cached.code;
+    for (Instruction& in : out.code) {
+        if (in.op == OpCode::LOAD_VAR || in.op == OpCode::STORE_VAR) {
+            in.arg = slots[static_cast<size_t>(in.arg)];
+        } else if (hasSlotField(in.op)) {
+            int32_t slot = slots[in.slot];
+            if (slot > UINT16_MAX) return false;
+            in.slot = static_cast<uint16_t>(slot);
+        }
+    }
+    out.names = symbols.names();
+    out.constants = cached.constants;
+    out.positions = cached.positions;
+    out.maxStack = cached.maxStack;
+    return true;
+}
+
+static Ast frontEnd(std::string_view source, bool optimize) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    auto program = parser.parse();
+    if (optimize) foldConstants(program);
+    return program;
+}
+
+static Chunk compileDirect(std::string_view source, Compiler& compiler, bool optimize) {
+    Chunk chunk = compiler.compile(frontEnd(source, optimize));
+    if (optimize) peephole(chunk);
+    return chunk;
+}
+
+Chunk ProgramCache::get(std::string_view source, Compiler& compiler, bool optimize,
+                        const std::function<void(const Ast&)>& parsed) {
+    std::string text = normalize(source);
+    uint64_t hash = fnv1a(text, optimize);
+
+    auto found = index.find(hash);
+    if (found != index.end() && found->second->optimize == optimize && found->second->source == text) {
+        ++counters.hits;
+        entries.splice(entries.begin(), entries, found->second);
+        Chunk chunk;
+        if (link(entries.front().chunk, entries.front().imports, compiler.symbols(), chunk)) return chunk;
+        return compileDirect(source, compiler, optimize);
+    }
+
+    ++counters.misses;
+    Entry entry{hash, optimize, std::move(text), Chunk(), {}, 0};
+    Ast program = frontEnd(source, optimize);
+    if (parsed) parsed(program);
+    if (Compiler::usesFunctions(program)) {
+        Chunk chunk = compiler.compile(program);
+        if (optimize) peephole(chunk);
+        return chunk;
+    }
+    Compiler fresh;
+    entry.chunk = fresh.compileOpen(program, entry.imports);
+    if (optimize) peephole(entry.chunk);
+    entry.bytes = entryBytes(entry.source, entry.chunk, entry.imports);
+
+    // the entry is good even if this caller lacks one of its imports
+    Chunk chunk;
+    bool linked;
+    try {
+        linked = link(entry.chunk, entry.imports, compiler.symbols(), chunk);
+    } catch (std::runtime_error&) {
+        insert(std::move(entry), true);
+        throw;
+    }
+    insert(std::move(entry), true);
+    return linked ? chunk : compileDirect(source, compiler, optimize);
+}
+
+void ProgramCache::insert(Entry entry, bool recent) {
+    if (entry.bytes > budget) return;
+    auto old = index.find(entry.hash);
+    if (old != index.end()) {
+        // same text (or a hash collision): the newer compile wins
+        counters.bytes -= old->second->bytes;
+        entries.erase(old->second);
+        index.erase(old);
+    }
+    counters.bytes += entry.bytes;
+    auto at = recent ? entries.begin() : entries.end();
+    index[entry.hash] = entries.insert(at, std::move(entry));
+    evict();
+    counters.entries = entries.size();
+}
+
+void ProgramCache::evict() {
+    while (counters.bytes > budget && !entries.empty()) {
+        counters.bytes -= entries.back().bytes;
+        index.erase(entries.back().hash);
+        entries.pop_back();
+        ++counters.evictions;
+    }
+    counters.entries = entries.size();
+}
+
+void ProgramCache::setBudget(size_t budgetBytes) {
+    budget = budgetBytes;
+    evict();
+}
+
+void ProgramCache::clear() {
+    entries.clear();
+    index.clear();
+    counters.entries = 0;
+    counters.bytes = 0;
+}
+
+// ---- persistence ----
+//
+// "BVMC", format version, imageVersion (the opcode numbering) and a byte
+// order mark, then the entries, most recently used first, each as
+//   u8 optimize, source, code, constants, names, imports, positions
+// with every string and array prefixed by its uint32 length, in the byte
+// order of the machine that wrote it.
+
+static const char cacheMagic[4] = {'B', 'V', 'M', 'C'};
+static const uint32_t cacheVersion = 2;
+static const uint32_t byteOrderMark = 0x01020304;
+
+namespace {
+struct Writer {
+    std::string bytes;
+
+    template <typename T>
+    void put(const T& value) { bytes.append(reinterpret_cast<const char*>(&value), sizeof value); }
+    template <typename T>
+    void putArray(const std::vector<T>& values) {
+        put(static_cast<uint32_t>(values.size()));
+        bytes.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+    void putString(const std::string& s) {
+        put(static_cast<uint32_t>(s.size()));
+        bytes += s;
+    }
+};
+
+// Bounds-checked reads; any overrun marks the whole file bad
+struct Reader {
+    const std::string& bytes;
+    size_t at = 0;
+    bool ok = true;
+
+    bool has(size_t n) {
+        if (bytes.size() - at < n) ok = false;
+        return ok;
+    }
+    template <typename T>
+    T get() {
+        T value{};
+        if (has(sizeof value)) std::memcpy(&value, bytes.data() + at, sizeof value);
+        if (ok) at += sizeof value;
+        return value;
+    }
+    template <typename T>
+    void getArray(std::vector<T>& values) {
+        uint32_t n = get<uint32_t>();
+        if (!has(uint64_t(n) * sizeof(T))) return;
+        values.resize(n);
+        if (n) std::memcpy(values.data(), bytes.data() + at, n * sizeof(T));   // data() may be null
+        at += n * sizeof(T);
+    }
+    std::string getString() {
+        uint32_t n = get<uint32_t>();
+        if (!has(n)) return {};
+        std::string s = bytes.substr(at, n);
+        at += n;
+        return s;
+    }
+};
+}
+
+void ProgramCache::save(const std::string& path) const {
+    Writer w;
+    w.bytes.append(cacheMagic, sizeof cacheMagic);
+    w.put(cacheVersion);
+    w.put(static_cast<uint32_t>(imageVersion));
+    w.put(byteOrderMark);
+    w.put(static_cast<uint64_t>(entries.size()));
+    for (const Entry& e : entries) {
+        w.put(static_cast<uint8_t>(e.optimize));
+        w.putString(e.source);
+        w.putArray(e.chunk.code);
+        w.putArray(e.chunk.constants);
+        w.put(static_cast<uint32_t>(e.chunk.names.size()));
+        for (const auto& n : e.chunk.names) w.putString(n);
+        w.put(static_cast<uint32_t>(e.imports.size()));
+        for (const auto& i : e.imports) {
+            w.putString(i.name);
+            w.put(i.pos);
+        }
+        w.putArray(e.chunk.positions.entries);
+    }
+
+    // written aside and renamed, so a crash never leaves half a file
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+    out.write(w.bytes.data(), static_cast<std::streamsize>(w.bytes.size()));
+    out.close();
+    if (!out || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+// Everything the VM relies on, since the file may be stale or damaged.
+// verify() covers the code and sets maxStack.
+static bool valid(Chunk& chunk, const std::vector<Compiler::Import>& imports) {
+    try {
+        verify(chunk);
+    } catch (std::runtime_error&) {
+        return false;
+    }
+    size_t next = 0;
+    for (const auto& name : chunk.names)
+        if (next < imports.size() && imports[next].name == name) ++next;
+    if (next != imports.size()) return false;
+    const auto& pos = chunk.positions.entries;
+    for (size_t i = 1; i < pos.size(); ++i)
+        if (pos[i].pc <= pos[i - 1].pc) return false;
+    return true;
+}
+
+bool ProgramCache::load(const std::string& path) {
+    // A directory opens, but reports a bogus size; a pipe reports none
+    std::error_code ec;
+    if (std::filesystem::is_directory(path, ec)) return false;
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    std::streamoff size = in.tellg();
+    if (size < 0) return false;
+    std::string bytes(static_cast<size_t>(size), '\0');
+    in.seekg(0);
+    if (!in.read(&bytes[0], static_cast<std::streamsize>(bytes.size()))) return false;
+
+    Reader r{bytes};
+    if (!r.has(sizeof cacheMagic) || std::memcmp(bytes.data(), cacheMagic, sizeof cacheMagic) != 0) return false;
+    r.at = sizeof cacheMagic;
+    if (r.get<uint32_t>() != cacheVersion || r.get<uint32_t>() != imageVersion ||
+        r.get<uint32_t>() != byteOrderMark)
+        return false;
+
+    uint64_t count = r.get<uint64_t>();
+    std::vector<Entry> loaded;
+    for (uint64_t k = 0; k < count && r.ok; ++k) {
+        Entry e{0, r.get<uint8_t>() != 0, r.getString(), Chunk(), {}, 0};
+        r.getArray(e.chunk.code);
+        r.getArray(e.chunk.constants);
+        uint32_t names = r.get<uint32_t>();
+        for (uint32_t i = 0; i < names && r.ok; ++i) e.chunk.names.push_back(r.getString());
+        uint32_t imports = r.get<uint32_t>();
+        for (uint32_t i = 0; i < imports && r.ok; ++i) {
+            std::string name = r.getString();
+            e.imports.push_back({std::move(name), r.get<SourcePos>()});
+        }
+        r.getArray(e.chunk.positions.entries);
+        if (!r.ok || !valid(e.chunk, e.imports)) return false;
+        e.hash = fnv1a(e.source, e.optimize);
+        e.bytes = entryBytes(e.source, e.chunk, e.imports);
+        loaded.push_back(std::move(e));
+    }
+    if (!r.ok || r.at != bytes.size()) return false;
+
+    // behind what is already cached, keeping the saved order
+    for (auto& e : loaded)
+        if (!index.count(e.hash)) insert(std::move(e), false);
+    return true;
+}
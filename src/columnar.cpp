@@ -0,0 +1,415 @@
+#include "columnar.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+// ---- Compiling ----
+
+namespace {
+
+// Instruction of each binary operator but && and ||, indexed by Op
+const ColumnOp binaryOps[] = {
+    ColumnOp::ADD, ColumnOp::SUB, ColumnOp::MUL, ColumnOp::DIV, ColumnOp::MOD,
+    ColumnOp::CMP_EQ, ColumnOp::CMP_NEQ, ColumnOp::CMP_LT, ColumnOp::CMP_LTE, ColumnOp::CMP_GT, ColumnOp::CMP_GTE,
+};
+
+struct ColumnCompiler {
+    ColumnProgram& out;
+    std::unordered_map<std::string_view, int32_t> slots;   // input by name
+    std::unordered_map<uint64_t, int32_t> constantIndex;   // by Value bits
+    size_t depth = 0, nesting = 0;
+
+    explicit ColumnCompiler(ColumnProgram& program) : out(program) {}
+
+    size_t emit(ColumnOp op, int32_t arg, SourcePos pos) {
+        out.code.push_back({op, arg});
+        out.positions.push_back(pos);
+        return out.code.size() - 1;
+    }
+
+    void push() { out.maxDepth = std::max(out.maxDepth, ++depth); }
+
+    void constant(Value value, SourcePos pos) {
+        auto found = constantIndex.emplace(value.raw(), static_cast<int32_t>(out.constants.size()));
+        if (found.second) out.constants.push_back(value);
+        emit(ColumnOp::CONSTANT, found.first->second, pos);
+        push();
+    }
+
+    void expr(const ASTNode* node) {
+        switch (node->kind) {
+            case NodeKind::Number:
+                constant(static_cast<const NumberNode*>(node)->value, node->pos);
+                return;
+            case NodeKind::Identifier: {
+                auto id = static_cast<const IdentifierNode*>(node);
+                auto found = slots.emplace(id->name, static_cast<int32_t>(out.inputs.size()));
+                if (found.second) out.inputs.emplace_back(id->name);
+                emit(ColumnOp::COLUMN, found.first->second, node->pos);
+                push();
+                return;
+            }
+            case NodeKind::Unary: {
+                auto un = static_cast<const UnaryOpNode*>(node);
+                if (un->op == Op::Not) {
+                    expr(un->expr);
+                    emit(ColumnOp::NOT, 0, un->pos);
+                    return;
+                }
+                // expr * -1, like the stack compiler: negate() on every row
+                expr(un->expr);
+                constant(-1, un->pos);
+                emit(ColumnOp::MUL, 0, un->pos);
+                --depth;
+                return;
+            }
+            case NodeKind::Binary: {
+                auto bin = static_cast<const BinaryOpNode*>(node);
+                expr(bin->left);
+                if (bin->op == Op::And || bin->op == Op::Or) {
+                    bool isAnd = bin->op == Op::And;
+                    out.maxNesting = std::max(out.maxNesting, ++nesting);
+                    size_t narrow = emit(isAnd ? ColumnOp::NARROW_AND : ColumnOp::NARROW_OR, 0, bin->pos);
+                    expr(bin->right);
+                    emit(isAnd ? ColumnOp::AND : ColumnOp::OR, 0, bin->pos);
+                    out.code[narrow].arg = static_cast<int32_t>(out.code.size());
+                    --nesting;
+                } else {
+                    expr(bin->right);
+                    emit(binaryOps[static_cast<size_t>(bin->op)], 0, bin->pos);
+                }
+                --depth;
+                return;
+            }
+            default:
+                throw SourceError("Batch expressions take numbers and variables only", node->pos);
+        }
+    }
+};
+
+}  // namespace
+
+ColumnProgram compileColumns(const ASTNode* expr) {
+    ColumnProgram program;
+    ColumnCompiler compiler(program);
+    compiler.expr(expr);
+    return program;
+}
+
+// ---- Evaluating ----
+
+namespace {
+
+const size_t chunkWords = columnChunkRows / 64;
+const int32_t zeroInt = 0;
+const double zeroDouble = 0.0;
+
+// An operand of the chunk being evaluated. A constant holds one value
+// for every row; a Bool is never constant.
+struct Operand {
+    ColumnType type;
+    bool one;
+    const void* data;
+};
+
+class Evaluator {
+public:
+    Evaluator(const ColumnProgram& p, const ArrayKernels& k)
+        : program(p), kernels(k), stack(p.maxDepth),
+          valueStorage(p.maxDepth * columnChunkRows), bitStorage(p.maxDepth * chunkWords),
+          widened(2 * columnChunkRows), saved(p.maxNesting * chunkWords),
+          foldedInts(p.maxDepth), foldedDoubles(p.maxDepth) {
+        for (Value c : p.constants) {
+            constInts.push_back(c.isInt() ? c.asInt() : 0);
+            constDoubles.push_back(c.toDouble());
+        }
+    }
+
+    void run(const ColumnRef* inputs, size_t rows, ColumnResult& out) {
+        size_t start = 0;
+        do {
+            n = std::min(columnChunkRows, rows - start);
+            chunk(inputs, start);
+            if (failed) throw RowError("Division by zero", failPos, failRow);
+            store(out, start, rows);
+            start += n;
+        } while (start < rows);
+    }
+
+private:
+    const ColumnProgram& program;
+    const ArrayKernels& kernels;
+    std::vector<Operand> stack;
+    // Each stack depth writes its results to its own chunk of values and
+    // its own bitmap, so a conversion never reads what it overwrites
+    std::vector<double> valueStorage;
+    std::vector<uint64_t> bitStorage;
+    std::vector<double> widened;           // int operands of double operations
+    std::vector<uint64_t> saved;           // the active rows outside each open && and ||
+    std::vector<int32_t> constInts;
+    std::vector<double> constDoubles;
+    // constant results, apart from the values an operation may overwrite
+    // while still reading its constant operand
+    std::vector<int32_t> foldedInts;
+    std::vector<double> foldedDoubles;
+
+    size_t n = 0;                          // rows in this chunk
+    uint64_t active[chunkWords] = {};      // rows whose values count
+    bool failed = false;
+    size_t failRow = 0;
+    SourcePos failPos;
+
+    void* values(size_t d) { return &valueStorage[d * columnChunkRows]; }
+    uint64_t* bits(size_t d) { return &bitStorage[d * chunkWords]; }
+    size_t words() const { return (n + 63) / 64; }
+    // The bits of word w that are rows of this chunk
+    uint64_t rowsOf(size_t w) const { return n - w * 64 >= 64 ? ~uint64_t(0) : (uint64_t(1) << (n - w * 64)) - 1; }
+
+    void fill(uint64_t* out, bool value) {
+        for (size_t w = 0; w < words(); ++w) out[w] = value ? rowsOf(w) : 0;
+    }
+
+    static Value scalar(const Operand& x) {
+        if (x.type == ColumnType::Int) return *static_cast<const int32_t*>(x.data);
+        return *static_cast<const double*>(x.data);
+    }
+
+    void chunk(const ColumnRef* inputs, size_t start);
+    void binary(ColumnOp op, size_t d, size_t pc, size_t start);
+    void constantBinary(ArrayOp op, size_t d, size_t pc, size_t start);
+    void checkDivisor(const Operand& b, size_t pc, size_t start);
+    void fail(size_t row, size_t pc);
+    const uint64_t* truth(size_t d);
+    void toInts(size_t d);
+    const double* toDoubles(const Operand& x, size_t scratch);
+    void store(ColumnResult& out, size_t start, size_t rows);
+};
+
+void Evaluator::chunk(const ColumnRef* inputs, size_t start) {
+    fill(active, true);
+    size_t depth = 0, nesting = 0;
+    const ColumnInstr* code = program.code.data();
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        const ColumnInstr& in = code[pc];
+        switch (in.op) {
+            case ColumnOp::COLUMN: {
+                const ColumnRef& column = inputs[in.arg];
+                size_t size = column.type == ColumnType::Int ? sizeof(int32_t) : sizeof(double);
+                stack[depth++] = {column.type, false, static_cast<const char*>(column.data) + start * size};
+                break;
+            }
+            case ColumnOp::CONSTANT:
+                if (program.constants[in.arg].isInt()) stack[depth++] = {ColumnType::Int, true, &constInts[in.arg]};
+                else stack[depth++] = {ColumnType::Double, true, &constDoubles[in.arg]};
+                break;
+            case ColumnOp::NOT: {
+                const uint64_t* t = truth(depth - 1);
+                uint64_t* out = bits(depth - 1);
+                for (size_t w = 0; w < words(); ++w) out[w] = ~t[w] & rowsOf(w);
+                break;
+            }
+            case ColumnOp::NARROW_AND:
+            case ColumnOp::NARROW_OR: {
+                const uint64_t* t = truth(depth - 1);
+                uint64_t* outer = &saved[nesting * chunkWords];
+                std::memcpy(outer, active, sizeof active);
+                uint64_t any = 0;
+                for (size_t w = 0; w < words(); ++w) {
+                    active[w] &= in.op == ColumnOp::NARROW_AND ? t[w] : ~t[w];
+                    any |= active[w];
+                }
+                if (any) {
+                    ++nesting;
+                } else {
+                    // the left side decides every row: skip the right one
+                    std::memcpy(active, outer, sizeof active);
+                    pc = static_cast<size_t>(in.arg) - 1;
+                }
+                break;
+            }
+            case ColumnOp::AND:
+            case ColumnOp::OR: {
+                const uint64_t* t = truth(depth - 1);
+                uint64_t* out = bits(depth - 2);   // the left side, already a bitmap
+                for (size_t w = 0; w < words(); ++w) out[w] = in.op == ColumnOp::AND ? out[w] & t[w] : out[w] | t[w];
+                --depth;
+                --nesting;
+                std::memcpy(active, &saved[nesting * chunkWords], sizeof active);
+                break;
+            }
+            default:
+                binary(in.op, depth - 2, pc, start);
+                --depth;
+                break;
+        }
+    }
+}
+
+void Evaluator::fail(size_t row, size_t pc) {
+    // the VM evaluates a row's operations in program order, so among
+    // failures at the same row the earliest instruction wins
+    if (failed && row >= failRow) return;
+    failed = true;
+    failRow = row;
+    failPos = program.positions[pc];
+}
+
+// Records the first active row whose divisor b is zero
+void Evaluator::checkDivisor(const Operand& b, size_t pc, size_t start) {
+    uint64_t zero[chunkWords];
+    if (b.one) fill(zero, isZero(scalar(b)));
+    else if (b.type == ColumnType::Int) kernels.selectInt(ArrayOp::Eq, static_cast<const int32_t*>(b.data), false, &zeroInt, true, zero, n);
+    else kernels.selectDouble(ArrayOp::Eq, static_cast<const double*>(b.data), false, &zeroDouble, true, zero, n);
+    for (size_t w = 0; w < words(); ++w) {
+        if (uint64_t hit = zero[w] & active[w]) {
+            size_t bit = 0;
+            while (!(hit >> bit & 1)) ++bit;
+            fail(start + w * 64 + bit, pc);
+            return;
+        }
+    }
+}
+
+// Both operands constant: one scalar operation, as value.h does it
+void Evaluator::constantBinary(ArrayOp op, size_t d, size_t pc, size_t start) {
+    Value a = scalar(stack[d]), b = scalar(stack[d + 1]);
+    Value r;
+    switch (op) {
+        case ArrayOp::Add: r = add(a, b); break;
+        case ArrayOp::Sub: r = sub(a, b); break;
+        case ArrayOp::Mul: r = mul(a, b); break;
+        case ArrayOp::Div:
+        case ArrayOp::Mod:
+            checkDivisor(stack[d + 1], pc, start);
+            if (!isZero(b)) r = op == ArrayOp::Div ? divide(a, b) : modulo(a, b);
+            break;
+        case ArrayOp::Eq:  fill(bits(d), equal(a, b)); break;
+        case ArrayOp::Neq: fill(bits(d), !equal(a, b)); break;
+        case ArrayOp::Lt:  fill(bits(d), less(a, b)); break;
+        case ArrayOp::Lte: fill(bits(d), lessEqual(a, b)); break;
+        case ArrayOp::Gt:  fill(bits(d), less(b, a)); break;
+        case ArrayOp::Gte: fill(bits(d), lessEqual(b, a)); break;
+    }
+    if (op >= ArrayOp::Eq) {
+        stack[d] = {ColumnType::Bool, false, bits(d)};
+    } else if (r.isInt()) {
+        foldedInts[d] = r.asInt();
+        stack[d] = {ColumnType::Int, true, &foldedInts[d]};
+    } else {
+        foldedDoubles[d] = r.asDouble();
+        stack[d] = {ColumnType::Double, true, &foldedDoubles[d]};
+    }
+}
+
+void Evaluator::binary(ColumnOp op, size_t d, size_t pc, size_t start) {
+    // a selection in arithmetic is ints 1 and 0, as the VM has them
+    if (stack[d].type == ColumnType::Bool) toInts(d);
+    if (stack[d + 1].type == ColumnType::Bool) toInts(d + 1);
+    const Operand a = stack[d], b = stack[d + 1];
+    const auto aop = static_cast<ArrayOp>(static_cast<int>(op) - static_cast<int>(ColumnOp::ADD));
+    if (a.one && b.one) return constantBinary(aop, d, pc, start);
+
+    const bool compare = aop >= ArrayOp::Eq;
+    const bool division = aop == ArrayOp::Div || aop == ArrayOp::Mod;
+    if (division) checkDivisor(b, pc, start);
+
+    if (a.type == ColumnType::Int && b.type == ColumnType::Int) {
+        auto l = static_cast<const int32_t*>(a.data), r = static_cast<const int32_t*>(b.data);
+        if (compare) {
+            kernels.selectInt(aop, l, a.one, r, b.one, bits(d), n);
+            stack[d] = {ColumnType::Bool, false, bits(d)};
+            return;
+        }
+        auto out = static_cast<int32_t*>(values(d));
+        if (division) {
+            // no SIMD integer division; same rules as divide() and modulo().
+            // Rows that divide by zero were recorded above or do not count.
+            for (size_t i = 0; i < n; ++i) {
+                int32_t p = l[a.one ? 0 : i], q = r[b.one ? 0 : i];
+                q += q == 0;
+                if (q == -1) out[i] = aop == ArrayOp::Div ? static_cast<int32_t>(0u - static_cast<uint32_t>(p)) : 0;
+                else out[i] = aop == ArrayOp::Div ? p / q : p % q;
+            }
+        } else {
+            kernels.arithInt(aop, l, a.one, r, b.one, out, n);
+        }
+        stack[d] = {ColumnType::Int, false, out};
+        return;
+    }
+
+    const double* l = toDoubles(a, 0);
+    const double* r = toDoubles(b, 1);
+    if (compare) {
+        kernels.selectDouble(aop, l, a.one, r, b.one, bits(d), n);
+        stack[d] = {ColumnType::Bool, false, bits(d)};
+        return;
+    }
+    auto out = static_cast<double*>(values(d));
+    if (aop == ArrayOp::Mod) {
+        for (size_t i = 0; i < n; ++i) out[i] = std::fmod(l[a.one ? 0 : i], r[b.one ? 0 : i]);
+    } else {
+        kernels.arithDouble(aop, l, a.one, r, b.one, out, n);
+    }
+    stack[d] = {ColumnType::Double, false, out};
+}
+
+// The operand at depth d as a selection of its nonzero rows
+const uint64_t* Evaluator::truth(size_t d) {
+    Operand& x = stack[d];
+    uint64_t* out = bits(d);
+    if (x.type == ColumnType::Bool) return out;
+    if (x.one) fill(out, scalar(x).truthy());
+    else if (x.type == ColumnType::Int) kernels.selectInt(ArrayOp::Neq, static_cast<const int32_t*>(x.data), false, &zeroInt, true, out, n);
+    // NaN is true and -0.0 false, as Value::truthy has them
+    else kernels.selectDouble(ArrayOp::Neq, static_cast<const double*>(x.data), false, &zeroDouble, true, out, n);
+    x = {ColumnType::Bool, false, out};
+    return out;
+}
+
+void Evaluator::toInts(size_t d) {
+    const uint64_t* in = bits(d);
+    auto out = static_cast<int32_t*>(values(d));
+    for (size_t i = 0; i < n; ++i) out[i] = static_cast<int32_t>(in[i / 64] >> (i % 64) & 1);
+    stack[d] = {ColumnType::Int, false, out};
+}
+
+const double* Evaluator::toDoubles(const Operand& x, size_t scratch) {
+    if (x.type == ColumnType::Double) return static_cast<const double*>(x.data);
+    double* out = &widened[scratch * columnChunkRows];
+    kernels.widen(static_cast<const int32_t*>(x.data), out, x.one ? 1 : n);
+    return out;
+}
+
+// The result of the chunk starting at row start into out; the first
+// chunk decides the type and sizes the column
+void Evaluator::store(ColumnResult& out, size_t start, size_t rows) {
+    const Operand& x = stack[0];
+    if (start == 0) {
+        out.type = x.type;
+        if (x.type == ColumnType::Int) out.ints.resize(rows);
+        else if (x.type == ColumnType::Double) out.doubles.resize(rows);
+        else out.selection.resize((rows + 63) / 64);
+    }
+    if (x.type == ColumnType::Bool) {
+        std::copy(bits(0), bits(0) + words(), out.selection.begin() + start / 64);
+    } else if (x.type == ColumnType::Int) {
+        auto in = static_cast<const int32_t*>(x.data);
+        if (x.one) std::fill_n(out.ints.begin() + start, n, in[0]);
+        else std::copy(in, in + n, out.ints.begin() + start);
+    } else {
+        auto in = static_cast<const double*>(x.data);
+        if (x.one) std::fill_n(out.doubles.begin() + start, n, in[0]);
+        else std::copy(in, in + n, out.doubles.begin() + start);
+    }
+}
+
+}  // namespace
+
+void evaluateColumns(const ColumnProgram& program, const ColumnRef* inputs, size_t rows, ColumnResult& out,
+                     const ArrayKernels& kernels) {
+    Evaluator evaluator(program, kernels);
+    evaluator.run(inputs, rows, out);
+}
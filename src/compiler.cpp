@@ -1,154 +1,520 @@
 #include "compiler.h"
+#include "verifier.h"
+#include <algorithm>
 #include <stdexcept>
+#include <unordered_set>
 
 // Compile a whole program (list of AST nodes/statements)
-std::vector<Instruction> Compiler::compile(const std::vector<std::unique_ptr<ASTNode>>& program) {
-    std::vector<Instruction> out;
-    for (const auto& stmt : program) {
-        compileNode(stmt.get(), out);
+Chunk Compiler::compile(const Ast& program) {
+    std::vector<const FunctionNode*> declared;
+    for (const ASTNode* stmt : program.statements) {
+        if (auto fn = stmt->as<FunctionNode>()) declared.push_back(fn);
     }
+    if (declared.empty()) return compileProgram(program, declared);
+
+    // a program that fails to compile leaves the functions as they were
+    auto savedFunctions = functions;
+    auto savedIndex = functionIndex;
+    try {
+        return compileProgram(program, declared);
+    } catch (...) {
+        functions = std::move(savedFunctions);
+        functionIndex = std::move(savedIndex);
+        scope = nullptr;
+        throw;
+    }
+}
+
+Chunk Compiler::compileProgram(const Ast& program, const std::vector<const FunctionNode*>& declared) {
+    Chunk out;
+    constantIndex.clear();
+    // every function is known before any code is compiled, so a call may
+    // come before its function and functions may call each other
+    std::unordered_set<std::string_view> names;
+    for (const FunctionNode* fn : declared) {
+        if (!names.insert(fn->name).second)
+            throw SourceError("Function already defined: " + std::string(fn->name), fn->pos);
+        declareFunction(fn);
+    }
+    for (const ASTNode* stmt : program.statements) {
+        if (stmt->kind != NodeKind::Function) compileStatement(stmt, out);
+    }
+    // the bodies come last, so they see every global the main code assigns
+    for (const FunctionNode* fn : declared) compileFunction(fn);
+    linkFunctions(out);
+    out.names = symbolTable.names();
+    verify(out);
     return out;
 }
 
+Chunk Compiler::compileOpen(const Ast& program, std::vector<Import>& found) {
+    imports = &found;
+    try {
+        Chunk out = compile(program);
+        imports = nullptr;
+        return out;
+    } catch (...) {
+        imports = nullptr;
+        throw;
+    }
+}
+
+// Instructions emitted from here on belong to node
+void Compiler::mark(const ASTNode* node, Chunk& out) {
+    out.positions.add(out.code.size(), node->pos);
+}
+
 // Dispatcher: decide which compile* helper to call
-void Compiler::compileNode(const ASTNode* node, std::vector<Instruction>& out) {
-    if (auto num = dynamic_cast<const NumberNode*>(node)) {
-        compileNumber(num, out);
-    } 
-    else if (auto id = dynamic_cast<const IdentifierNode*>(node)) {
-        compileIdentifier(id, out);
-    } 
-    else if (auto bin = dynamic_cast<const BinaryOpNode*>(node)) {
-        compileBinary(bin, out);
-    } 
-    else if (auto un = dynamic_cast<const UnaryOpNode*>(node)) {
-        compileUnary(un, out);
-    } 
-    else if (auto assign = dynamic_cast<const AssignmentNode*>(node)) {
-        compileAssignment(assign, out);
-    } 
-    else if (auto printNode = dynamic_cast<const PrintNode*>(node)) {
-        compilePrint(printNode, out);
-    }
-        else if (auto iff = dynamic_cast<const IfNode*>(node)) {
-        compileIf(iff, out);
-    }
-    else if (auto wh = dynamic_cast<const WhileNode*>(node)) {
-        compileWhile(wh, out);
-    } 
-    else {
-        throw std::runtime_error("Unknown AST node in compiler");
+void Compiler::compileNode(const ASTNode* node, Chunk& out) {
+    mark(node, out);
+    switch (node->kind) {
+        case NodeKind::Number:     compileNumber(static_cast<const NumberNode*>(node), out); return;
+        case NodeKind::Identifier: compileIdentifier(static_cast<const IdentifierNode*>(node), out); return;
+        case NodeKind::Binary:     compileBinary(static_cast<const BinaryOpNode*>(node), out); return;
+        case NodeKind::Unary:      compileUnary(static_cast<const UnaryOpNode*>(node), out); return;
+        case NodeKind::Array:      compileArray(static_cast<const ArrayNode*>(node), out); return;
+        case NodeKind::Index:      compileIndex(static_cast<const IndexNode*>(node), out); return;
+        case NodeKind::Call:       compileCall(static_cast<const CallNode*>(node), out); return;
+        case NodeKind::Assignment: compileAssignment(static_cast<const AssignmentNode*>(node), out); return;
+        case NodeKind::Print:      compilePrint(static_cast<const PrintNode*>(node), out); return;
+        case NodeKind::If:         compileIf(static_cast<const IfNode*>(node), out); return;
+        case NodeKind::While:      compileWhile(static_cast<const WhileNode*>(node), out); return;
+        case NodeKind::Block:      compileBlock(static_cast<const BlockNode*>(node), out); return;
+        case NodeKind::Return:     compileReturn(static_cast<const ReturnNode*>(node), out); return;
+        case NodeKind::Function:
+            throw SourceError("Functions can only be declared at the top level", node->pos);
+    }
+    throw std::runtime_error("Unknown AST node in compiler");
+}
+
+void Compiler::compileStatement(const ASTNode* node, Chunk& out) {
+    compileNode(node, out);
+    // keep every statement stack-neutral, so loops do not grow the stack
+    if (isExpression(node->kind)) {
+        out.code.push_back({OpCode::POP});
     }
 }
 
 // ---- Helpers ----
-void Compiler::compileNumber(const NumberNode* num, std::vector<Instruction>& out) {
-    out.push_back({OpCode::LOAD_CONST, std::to_string(num->value)});
+void Compiler::compileNumber(const NumberNode* num, Chunk& out) {
+    if (num->value.isInt()) {
+        out.code.push_back({OpCode::LOAD_CONST, num->value.asInt()});
+        return;
+    }
+    // doubles do not fit the instruction; each distinct one is stored once
+    auto found = constantIndex.emplace(num->value.raw(), static_cast<int32_t>(out.constants.size()));
+    if (found.second) out.constants.push_back(num->value.asDouble());
+    out.code.push_back({OpCode::LOAD_DOUBLE, found.first->second});
 }
 
-void Compiler::compileIdentifier(const IdentifierNode* id, std::vector<Instruction>& out) {
-    out.push_back({OpCode::LOAD_VAR, id->name});
+void Compiler::compileIdentifier(const IdentifierNode* id, Chunk& out) {
+    if (scope) {
+        auto local = scope->slots.find(id->name);
+        if (local != scope->slots.end()) {
+            // locals are not checked at runtime, so every path must assign them first
+            if (!scope->assigned[local->second])
+                throw SourceError("Variable may be used before it is assigned: " + std::string(id->name), id->pos);
+            out.code.push_back({OpCode::LOAD_LOCAL, local->second});
+            return;
+        }
+    }
+    // Reading a name that no statement so far has assigned can never succeed
+    int32_t slot = symbolTable.lookup(id->name);
+    if (slot < 0 && imports) {
+        slot = symbolTable.declare(id->name);
+        imports->push_back({std::string(id->name), id->pos});
+    }
+    if (slot < 0) throw SourceError("Undefined variable: " + std::string(id->name), id->pos);
+    out.code.push_back({OpCode::LOAD_VAR, slot});
 }
 
-void Compiler::compileAssignment(const AssignmentNode* assign, std::vector<Instruction>& out) {
-    compileNode(assign->expr.get(), out);
-    out.push_back({OpCode::STORE_VAR, assign->varName});
+void Compiler::compileAssignment(const AssignmentNode* assign, Chunk& out) {
+    compileNode(assign->expr, out);
+    mark(assign, out);
+    if (scope) {
+        // a function assigns only its own locals
+        uint16_t local = scope->slots.at(assign->varName);
+        out.code.push_back({OpCode::STORE_LOCAL, local});
+        scope->assigned[local] = 1;
+        return;
+    }
+    out.code.push_back({OpCode::STORE_VAR, symbolTable.declare(assign->varName)});
 }
 
-void Compiler::compilePrint(const PrintNode* print, std::vector<Instruction>& out) {
-    compileNode(print->expr.get(), out);
-    out.push_back({OpCode::PRINT, ""});
+void Compiler::compilePrint(const PrintNode* print, Chunk& out) {
+    compileNode(print->expr, out);
+    mark(print, out);
+    out.code.push_back({OpCode::PRINT});
 }
 
-void Compiler::compileBinary(const BinaryOpNode* bin, std::vector<Instruction>& out) {
-    compileNode(bin->left.get(), out);
-    compileNode(bin->right.get(), out);
+// Opcode of each binary operator, indexed by Op. && and || are not
+// compiled to theirs, they short-circuit (see compileLogical).
+static const OpCode binaryOpcodes[] = {
+    OpCode::ADD, OpCode::SUB, OpCode::MUL, OpCode::DIV, OpCode::MOD,
+    OpCode::CMP_EQ, OpCode::CMP_NEQ, OpCode::CMP_LT, OpCode::CMP_LTE, OpCode::CMP_GT, OpCode::CMP_GTE,
+    OpCode::LOGICAL_AND, OpCode::LOGICAL_OR,
+};
+static_assert(sizeof binaryOpcodes / sizeof binaryOpcodes[0] == binaryOpCount, "one opcode per binary Op");
 
-    if (bin->op == "+") out.push_back({OpCode::ADD, ""});
-    else if (bin->op == "-") out.push_back({OpCode::SUB, ""});
-    else if (bin->op == "*") out.push_back({OpCode::MUL, ""});
-    else if (bin->op == "/") out.push_back({OpCode::DIV, ""});
-    else if (bin->op == "%") out.push_back({OpCode::MOD, ""});
-    else if (bin->op == "==") out.push_back({OpCode::CMP_EQ, ""});
-    else if (bin->op == "!=") out.push_back({OpCode::CMP_NEQ, ""});
-    else if (bin->op == "<") out.push_back({OpCode::CMP_LT, ""});
-    else if (bin->op == "<=") out.push_back({OpCode::CMP_LTE, ""});
-    else if (bin->op == ">") out.push_back({OpCode::CMP_GT, ""});
-    else if (bin->op == ">=") out.push_back({OpCode::CMP_GTE, ""});
-    else if (bin->op == "&&") out.push_back({OpCode::LOGICAL_AND, ""});
-    else if (bin->op == "||") out.push_back({OpCode::LOGICAL_OR, ""});
+void Compiler::compileBinary(const BinaryOpNode* bin, Chunk& out) {
+    if (bin->op == Op::And || bin->op == Op::Or) {
+        compileLogical(bin, out);
+        return;
+    }
+    compileNode(bin->left, out);
+    compileNode(bin->right, out);
+    mark(bin, out);
+
+    if (!isBinary(bin->op))
+        throw std::runtime_error(std::string("Unknown binary operator: ") + opName(bin->op));
+    out.code.push_back({binaryOpcodes[static_cast<size_t>(bin->op)]});
+}
+
+void Compiler::compileUnary(const UnaryOpNode* un, Chunk& out) {
+    if (un->op == Op::Not) {
+        // FIX: UnaryOpNode uses 'expr' as its child expression.
+        compileNode(un->expr, out);
+        mark(un, out);
+        out.code.push_back({OpCode::LOGICAL_NOT});
+    }
+    else if (un->op == Op::Neg) {
+        // emulate NEG: expr * -1, which is negate() on numbers and keeps
+        // the sign of zero (0 - 0.0 would be 0.0, not -0.0)
+        compileNode(un->expr, out);
+        out.code.push_back({OpCode::LOAD_CONST, -1});
+        mark(un, out);
+        out.code.push_back({OpCode::MUL});
+    }
     else {
-        throw std::runtime_error("Unknown binary operator: " + bin->op);
+        throw std::runtime_error(std::string("Unknown unary operator: ") + opName(un->op));
     }
 }
 
-void Compiler::compileUnary(const UnaryOpNode* un, std::vector<Instruction>& out) {
-    // FIX: UnaryOpNode uses 'expr' as its child expression.
-    compileNode(un->expr.get(), out);
+void Compiler::compileArray(const ArrayNode* array, Chunk& out) {
+    for (const ASTNode* element : array->elements) compileNode(element, out);
+    mark(array, out);
+    out.code.push_back({OpCode::NEW_ARRAY, static_cast<int32_t>(array->elements.count)});
+}
+
+void Compiler::compileIndex(const IndexNode* index, Chunk& out) {
+    compileNode(index->array, out);
+    compileNode(index->index, out);
+    mark(index, out);
+    out.code.push_back({OpCode::INDEX});
+}
+
+// The builtins, each taking one argument
+static const struct {
+    std::string_view name;
+    OpCode op;
+} builtins[] = {
+    {"len", OpCode::LEN}, {"sum", OpCode::SUM}, {"min", OpCode::MIN},
+    {"max", OpCode::MAX}, {"count", OpCode::COUNT}, {"range", OpCode::RANGE},
+};
 
-    if (un->op == "!") {
-        out.push_back({OpCode::LOGICAL_NOT, ""});
+bool Compiler::isBuiltin(std::string_view name) {
+    for (const auto& builtin : builtins) {
+        if (builtin.name == name) return true;
     }
-    else if (un->op == "-") {
-        // emulate NEG: 0 - expr
-        out.push_back({OpCode::LOAD_CONST, "0"});
-        out.push_back({OpCode::SUB, ""});
+    return false;
+}
+
+static std::string arguments(size_t n) {
+    return n == 1 ? "one argument" : std::to_string(n) + " arguments";
+}
+
+void Compiler::compileCall(const CallNode* call, Chunk& out, OpCode op) {
+    for (const auto& builtin : builtins) {
+        if (builtin.name != call->name) continue;
+        if (call->args.count != 1)
+            throw SourceError(std::string(call->name) + "() takes one argument", call->pos);
+        compileNode(call->args.items[0], out);
+        mark(call, out);
+        out.code.push_back({builtin.op});
+        return;
     }
-    else {
-        throw std::runtime_error("Unknown unary operator: " + un->op);
+    auto found = functionIndex.find(std::string(call->name));
+    if (found == functionIndex.end()) throw SourceError("Unknown function: " + std::string(call->name), call->pos);
+    const FunctionCode& function = functions[found->second];
+    if (call->args.count != function.params)
+        throw SourceError(function.name + "() takes " + arguments(function.params), call->pos);
+    // the arguments are left on the stack, where they become the callee's first locals
+    for (const ASTNode* arg : call->args) compileNode(arg, out);
+    mark(call, out);
+    out.code.push_back({op, static_cast<int32_t>(found->second), function.params});
+}
+
+void Compiler::compileReturn(const ReturnNode* ret, Chunk& out) {
+    if (!scope) throw SourceError("Return outside a function", ret->pos);
+    auto call = ret->expr ? ret->expr->as<CallNode>() : nullptr;
+    if (call && !isBuiltin(call->name)) {
+        // the callee takes over this call's frame and returns straight to
+        // our caller, so recursion through return f(...) needs no depth
+        compileCall(call, out, OpCode::TAIL_CALL);
+    } else {
+        if (ret->expr) compileNode(ret->expr, out);
+        else out.code.push_back({OpCode::LOAD_CONST, 0});
+        mark(ret, out);
+        out.code.push_back({OpCode::RETURN});
     }
+    // no path goes on from here, so it has nothing left to assign
+    std::fill(scope->assigned.begin(), scope->assigned.end(), 1);
+}
+
+// ---- Functions ----
+
+void Compiler::declareFunction(const FunctionNode* fn) {
+    std::string name(fn->name);
+    if (isBuiltin(fn->name)) throw SourceError("Cannot redefine builtin function: " + name, fn->pos);
+    if (fn->params.count > UINT16_MAX) throw SourceError("Too many parameters: " + name, fn->pos);
+    const auto params = static_cast<uint16_t>(fn->params.count);
+    auto found = functionIndex.find(name);
+    if (found == functionIndex.end()) {
+        functionIndex.emplace(name, functions.size());
+        functions.push_back({name, params, params, Chunk()});
+    } else if (functions[found->second].params != params) {
+        // a later REPL line may replace a function's body, but the calls
+        // compiled into other functions pass the old number of arguments
+        throw SourceError(name + "() is already defined with " + arguments(functions[found->second].params),
+                          fn->pos);
+    }
+}
+
+void Compiler::compileFunction(const FunctionNode* fn) {
+    FunctionCode& function = functions[functionIndex.at(std::string(fn->name))];
+
+    // the parameters come first, where a call leaves its arguments; names
+    // the function does not assign are globals
+    Scope local;
+    for (const ASTNode* p : fn->params) {
+        auto param = static_cast<const IdentifierNode*>(p);
+        if (!local.slots.emplace(param->name, static_cast<uint16_t>(local.slots.size())).second)
+            throw SourceError("Duplicate parameter: " + std::string(param->name), param->pos);
+    }
+    // from the body as parsed, so -O dropping a dead branch changes nothing
+    for (const ASTNode* a : fn->assignments) {
+        std::string_view name = static_cast<const AssignmentNode*>(a)->varName;
+        if (local.slots.size() == UINT16_MAX && !local.slots.count(name))
+            throw SourceError("Too many local variables in " + function.name, fn->pos);
+        local.slots.emplace(name, static_cast<uint16_t>(local.slots.size()));
+    }
+    local.assigned.assign(local.slots.size(), 0);
+    std::fill_n(local.assigned.begin(), fn->params.count, 1);
+
+    Chunk body;
+    constantIndex.clear();
+    scope = &local;
+    compileStatement(fn->body, body);
+    scope = nullptr;
+
+    // falling off the end returns 0
+    const NodeList& statements = static_cast<const BlockNode*>(fn->body)->statements;
+    if (statements.empty() || statements.items[statements.count - 1]->kind != NodeKind::Return) {
+        mark(fn, body);
+        body.code.push_back({OpCode::LOAD_CONST, 0});
+        body.code.push_back({OpCode::RETURN});
+    }
+    function.locals = static_cast<uint16_t>(local.slots.size());
+    function.body = std::move(body);
+}
+
+void Compiler::linkFunctions(Chunk& out) {
+    if (functions.empty()) return;
+    // the main code stops before the first function
+    out.code.push_back({OpCode::HALT});
+    for (const FunctionCode& function : functions) {
+        const auto entry = static_cast<uint32_t>(out.code.size());
+        const auto firstConstant = static_cast<int32_t>(out.constants.size());
+        const Chunk& body = function.body;
+        out.constants.insert(out.constants.end(), body.constants.begin(), body.constants.end());
+        for (Instruction in : body.code) {
+            if (isJump(in.op)) in.arg += static_cast<int32_t>(entry);
+            else if (in.op == OpCode::LOAD_DOUBLE) in.arg += firstConstant;
+            out.code.push_back(in);
+        }
+        for (const PositionEntry& e : body.positions.entries) out.positions.add(entry + e.pc, e.pos);
+        out.functions.push_back({entry, static_cast<uint32_t>(out.code.size()), function.params, function.locals});
+    }
+}
+
+// Does node declare, return from or call a user function?
+static bool usesFunctions(const ASTNode* node) {
+    switch (node->kind) {
+        case NodeKind::Number:
+        case NodeKind::Identifier:
+            return false;
+        case NodeKind::Binary: {
+            auto bin = static_cast<const BinaryOpNode*>(node);
+            return usesFunctions(bin->left) || usesFunctions(bin->right);
+        }
+        case NodeKind::Unary:
+            return usesFunctions(static_cast<const UnaryOpNode*>(node)->expr);
+        case NodeKind::Array:
+            return std::any_of(static_cast<const ArrayNode*>(node)->elements.begin(),
+                               static_cast<const ArrayNode*>(node)->elements.end(),
+                               [](const ASTNode* e) { return usesFunctions(e); });
+        case NodeKind::Index: {
+            auto index = static_cast<const IndexNode*>(node);
+            return usesFunctions(index->array) || usesFunctions(index->index);
+        }
+        case NodeKind::Call: {
+            auto call = static_cast<const CallNode*>(node);
+            return !Compiler::isBuiltin(call->name) ||
+                   std::any_of(call->args.begin(), call->args.end(), [](const ASTNode* a) { return usesFunctions(a); });
+        }
+        case NodeKind::Assignment:
+            return usesFunctions(static_cast<const AssignmentNode*>(node)->expr);
+        case NodeKind::Print:
+            return usesFunctions(static_cast<const PrintNode*>(node)->expr);
+        case NodeKind::If: {
+            auto iff = static_cast<const IfNode*>(node);
+            return usesFunctions(iff->condition) || usesFunctions(iff->thenBranch) ||
+                   (iff->elseBranch && usesFunctions(iff->elseBranch));
+        }
+        case NodeKind::While: {
+            auto wh = static_cast<const WhileNode*>(node);
+            return usesFunctions(wh->condition) || usesFunctions(wh->body);
+        }
+        case NodeKind::Block: {
+            const NodeList& statements = static_cast<const BlockNode*>(node)->statements;
+            return std::any_of(statements.begin(), statements.end(), [](const ASTNode* s) { return usesFunctions(s); });
+        }
+        case NodeKind::Function:
+        case NodeKind::Return:
+            return true;
+    }
+    return false;
+}
+
+bool Compiler::usesFunctions(const Ast& program) {
+    return std::any_of(program.statements.begin(), program.statements.end(),
+                       [](const ASTNode* s) { return ::usesFunctions(s); });
 }
 
 // --- Control-flow helpers ---
 
-static size_t emit(std::vector<Instruction>& out, OpCode op, std::string arg = "") {
-    out.push_back({op, std::move(arg)});
-    return out.size() - 1;
+static size_t emit(Chunk& out, OpCode op, int32_t arg = 0) {
+    out.code.push_back({op, arg});
+    return out.code.size() - 1;
+}
+
+static void patch(Chunk& out, size_t at, size_t target) {
+    out.code[at].arg = static_cast<int32_t>(target);
+}
+
+// Jumps whose target is not known yet are chained through their arg: each
+// holds the index of the previous one and noJump ends the list.
+static const int32_t noJump = -1;
+
+static int32_t chain(Chunk& out, OpCode op, int32_t list) {
+    return static_cast<int32_t>(emit(out, op, list));
+}
+
+static void patchList(Chunk& out, int32_t list, size_t target) {
+    while (list != noJump) {
+        int32_t next = out.code[list].arg;
+        patch(out, static_cast<size_t>(list), target);
+        list = next;
+    }
 }
 
-static void patch(std::vector<Instruction>& out, size_t at, size_t target) {
-    out[at].arg = std::to_string(target);
+int32_t Compiler::compileJump(const ASTNode* cond, bool jumpIf, int32_t list, Chunk& out) {
+    switch (cond->kind) {
+        case NodeKind::Binary: {
+            auto bin = static_cast<const BinaryOpNode*>(cond);
+            if (bin->op != Op::And && bin->op != Op::Or) break;
+            bool isOr = bin->op == Op::Or;
+            if (jumpIf == isOr) {
+                // either operand alone is enough to take the jump
+                list = compileJump(bin->left, jumpIf, list, out);
+                return compileJump(bin->right, jumpIf, list, out);
+            }
+            // the left operand alone can decide the other way, skipping the right
+            int32_t skip = compileJump(bin->left, isOr, noJump, out);
+            list = compileJump(bin->right, jumpIf, list, out);
+            patchList(out, skip, out.code.size());
+            return list;
+        }
+        case NodeKind::Unary: {
+            auto un = static_cast<const UnaryOpNode*>(cond);
+            if (un->op == Op::Not) return compileJump(un->expr, !jumpIf, list, out);
+            break;
+        }
+        case NodeKind::Number:
+            // known outcome: an unconditional jump or nothing at all
+            if (static_cast<const NumberNode*>(cond)->value.truthy() == jumpIf) return chain(out, OpCode::JMP, list);
+            return list;
+        default:
+            break;
+    }
+    compileNode(cond, out);
+    return chain(out, jumpIf ? OpCode::JMP_IF_TRUE : OpCode::JMP_IF_FALSE, list);
 }
 
-void Compiler::compileIf(const IfNode* iff, std::vector<Instruction>& out) {
-    // condition
-    compileNode(iff->condition.get(), out);
-    // if false, jump to else/end (patch later)
-    size_t jfalse = emit(out, OpCode::JMP_IF_FALSE, "0");
+// a && b / a || b as a value: the condition's jumps pick 1 or 0
+void Compiler::compileLogical(const BinaryOpNode* bin, Chunk& out) {
+    int32_t falses = compileJump(bin, false, noJump, out);
+    emit(out, OpCode::LOAD_CONST, 1);
+    size_t end = emit(out, OpCode::JMP);
+    patchList(out, falses, out.code.size());
+    emit(out, OpCode::LOAD_CONST, 0);
+    patch(out, end, out.code.size());
+}
+
+// In a function, a local is assigned after an if only if it is after
+// both branches
+static void intersect(std::vector<uint8_t>& assigned, const std::vector<uint8_t>& other) {
+    for (size_t i = 0; i < assigned.size(); ++i) assigned[i] = assigned[i] && other[i];
+}
+
+void Compiler::compileIf(const IfNode* iff, Chunk& out) {
+    // condition; where false, jump to else/end (patch later)
+    int32_t jfalse = compileJump(iff->condition, false, noJump, out);
+    std::vector<uint8_t> before;
+    if (scope) before = scope->assigned;
 
     // then-branch
-    compileNode(iff->thenBranch.get(), out);
+    compileStatement(iff->thenBranch, out);
 
     if (iff->elseBranch) {
         // jump over else after then executes
-        size_t jend = emit(out, OpCode::JMP, "0");
+        size_t jend = emit(out, OpCode::JMP);
         // false -> start of else
-        patch(out, jfalse, out.size());
+        patchList(out, jfalse, out.code.size());
         // else-branch
-        compileNode(iff->elseBranch.get(), out);
+        if (scope) std::swap(before, scope->assigned);   // before: what then assigned
+        compileStatement(iff->elseBranch, out);
         // end -> after else
-        patch(out, jend, out.size());
+        patch(out, jend, out.code.size());
     } else {
         // no else: false -> after then
-        patch(out, jfalse, out.size());
+        patchList(out, jfalse, out.code.size());
     }
+    if (scope) intersect(scope->assigned, before);
 }
 
-void Compiler::compileWhile(const WhileNode* wh, std::vector<Instruction>& out) {
-    size_t loopStart = out.size();
+void Compiler::compileWhile(const WhileNode* wh, Chunk& out) {
+    size_t loopStart = out.code.size();
 
-    // condition
-    compileNode(wh->condition.get(), out);
-    // exit loop if condition false
-    size_t jfalse = emit(out, OpCode::JMP_IF_FALSE, "0");
+    // condition; exit loop where false
+    int32_t jfalse = compileJump(wh->condition, false, noJump, out);
 
-    // body
-    compileNode(wh->body.get(), out);
+    // body; it may not run at all, so what it assigns does not count after
+    std::vector<uint8_t> before;
+    if (scope) before = scope->assigned;
+    compileStatement(wh->body, out);
+    if (scope) scope->assigned = std::move(before);
 
     // back edge to loop start
-    emit(out, OpCode::JMP, std::to_string(loopStart));
+    emit(out, OpCode::JMP, static_cast<int32_t>(loopStart));
 
-    // patch exit to right after body
-    patch(out, jfalse, out.size());
+    // patch exits to right after body
+    patchList(out, jfalse, out.code.size());
 }
 
+
+void Compiler::compileBlock(const BlockNode* block, Chunk& out) {
+    for (const ASTNode* stmt : block->statements) {
+        compileStatement(stmt, out);
+    }
+}
@@ -0,0 +1,275 @@
+#include "image.h"
+#include "verifier.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define BYTECODE_MMAP 1
+#else
+#define BYTECODE_MMAP 0
+#endif
+
+static_assert(sizeof(ImageHeader) == 72, "image header layout changed");
+static_assert(sizeof(PositionEntry) == 12, "position entry layout changed");
+
+static const char imageMagic[4] = {'B', 'V', 'M', 'I'};
+static const uint32_t byteOrderMark = 0x01020304;
+
+// ---- writing ----
+
+static uint32_t align8(size_t n) {
+    return static_cast<uint32_t>((n + 7) & ~size_t(7));
+}
+
+namespace {
+// Lays the sections out one after another and writes them
+struct ImageWriter {
+    ImageHeader header{};
+    std::string body;   // everything after the header
+
+    explicit ImageWriter(ImageEngine engine) {
+        std::memcpy(header.magic, imageMagic, sizeof imageMagic);
+        header.version = imageVersion;
+        header.engine = static_cast<uint8_t>(engine);
+        header.byteOrder = byteOrderMark;
+    }
+
+    void add(ImageSection& s, const void* bytes, size_t count, size_t elementSize) {
+        body.resize(align8(body.size()), '\0');
+        size_t offset = sizeof(ImageHeader) + body.size();
+        if (offset + count * elementSize > UINT32_MAX) throw std::runtime_error("Program too large for an image");
+        s.offset = static_cast<uint32_t>(offset);
+        s.count = static_cast<uint32_t>(count);
+        body.append(static_cast<const char*>(bytes), count * elementSize);
+    }
+
+    void addNames(const std::vector<std::string>& names) {
+        std::vector<uint32_t> lengths;
+        std::string bytes;
+        for (const auto& n : names) {
+            lengths.push_back(static_cast<uint32_t>(n.size()));
+            bytes += n;
+        }
+        add(header.nameLengths, lengths.data(), lengths.size(), sizeof(uint32_t));
+        add(header.nameBytes, bytes.data(), bytes.size(), 1);
+    }
+
+    void write(std::ostream& out) {
+        body.resize(align8(body.size()), '\0');
+        header.fileSize = sizeof(ImageHeader) + body.size();
+        out.write(reinterpret_cast<const char*>(&header), sizeof header);
+        out.write(body.data(), static_cast<std::streamsize>(body.size()));
+        if (!out) throw std::runtime_error("Cannot write bytecode image");
+    }
+};
+}
+
+void writeImage(const Chunk& chunk, std::ostream& out) {
+    ImageWriter w(ImageEngine::Stack);
+    w.add(w.header.code, chunk.code.data(), chunk.code.size(), sizeof(Instruction));
+    w.add(w.header.constants, chunk.constants.data(), chunk.constants.size(), sizeof(double));
+    w.addNames(chunk.names);
+    const auto& pos = chunk.positions.entries;
+    w.add(w.header.positions, pos.data(), pos.size(), sizeof(PositionEntry));
+    w.add(w.header.functions, chunk.functions.data(), chunk.functions.size(), sizeof(Function));
+    w.write(out);
+}
+
+void writeImage(const RegChunk& chunk, std::ostream& out) {
+    ImageWriter w(ImageEngine::Register);
+    w.header.numRegisters = static_cast<uint32_t>(chunk.numRegisters);
+    w.add(w.header.code, chunk.code.data(), chunk.code.size(), sizeof(RegInstr));
+    w.add(w.header.constants, chunk.constants.data(), chunk.constants.size(), sizeof(int32_t));
+    w.addNames(chunk.names);
+    const auto& pos = chunk.positions.entries;
+    w.add(w.header.positions, pos.data(), pos.size(), sizeof(PositionEntry));
+    w.add(w.header.functions, nullptr, 0, sizeof(Function));
+    w.write(out);
+}
+
+// ---- loading ----
+
+[[noreturn]] static void bad(const std::string& why) {
+    throw std::runtime_error("Bad bytecode image: " + why);
+}
+
+[[noreturn]] static void badAt(const char* why, size_t pc) {
+    bad(std::string(why) + " at instruction " + std::to_string(pc));
+}
+
+bool Image::isImage(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof imageMagic];
+    // Reading a pipe would take the magic away from the source reader;
+    // an image is mapped, so it has to be a file that can seek anyway
+    if (!in.seekg(0, std::ios::end) || !in.seekg(0)) return false;
+    return in.read(magic, sizeof magic) && std::memcmp(magic, imageMagic, sizeof magic) == 0;
+}
+
+Image::Image(const std::string& path) {
+#if BYTECODE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot read file");
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot read file");
+    }
+    length = static_cast<size_t>(st.st_size);
+    if (length < sizeof(ImageHeader)) {
+        ::close(fd);
+        bad("file too small");
+    }
+    void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("cannot map file");
+    data = static_cast<const char*>(p);
+    mapped = true;
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("cannot read file");
+    length = static_cast<size_t>(in.tellg());
+    if (length < sizeof(ImageHeader)) bad("file too small");
+    buffer.resize((length + 7) / 8);
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(length)))
+        throw std::runtime_error("cannot read file");
+    data = reinterpret_cast<const char*>(buffer.data());
+#endif
+    header = reinterpret_cast<const ImageHeader*>(data);
+    try {
+        validate();
+    } catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+Image::~Image() {
+    unmap();
+}
+
+void Image::unmap() {
+#if BYTECODE_MMAP
+    if (mapped) ::munmap(const_cast<char*>(data), length);
+#endif
+    mapped = false;
+}
+
+ChunkView Image::chunk() const {
+    return {section<Instruction>(header->code), header->code.count,
+            names.data(), names.size(),
+            {section<PositionEntry>(header->positions), header->positions.count}, maxStack,
+            section<double>(header->constants), header->constants.count,
+            section<Function>(header->functions), header->functions.count};
+}
+
+RegChunkView Image::regChunk() const {
+    return {section<RegInstr>(header->code), header->code.count,
+            section<int>(header->constants), header->constants.count,
+            names.data(), names.size(), header->numRegisters,
+            {section<PositionEntry>(header->positions), header->positions.count}};
+}
+
+static void checkRegisterCode(const RegInstr* code, size_t size, size_t constants,
+                              size_t slots, size_t registers) {
+    for (size_t pc = 0; pc < size; ++pc) {
+        const RegInstr& in = code[pc];
+        auto reg = [&](uint16_t r) { if (r >= registers) badAt("register out of range", pc); };
+        auto constant = [&](uint16_t k) { if (k >= constants) badAt("constant out of range", pc); };
+        auto target = [&] { if (in.target() > size) badAt("jump target out of range", pc); };
+        if (static_cast<size_t>(in.op) >= REGOP_COUNT) badAt("unknown opcode", pc);
+        switch (in.op) {
+            case RegOp::MOVE:
+            case RegOp::NOT:
+                reg(in.a); reg(in.b);
+                break;
+            case RegOp::LOADK:
+                reg(in.a); constant(in.b);
+                break;
+            case RegOp::ADDK: case RegOp::SUBK: case RegOp::MULK:
+            case RegOp::DIVK: case RegOp::MODK:
+            case RegOp::EQK:  case RegOp::NEQK:
+            case RegOp::LTK:  case RegOp::LTEK:
+            case RegOp::GTK:  case RegOp::GTEK:
+                reg(in.a); reg(in.b); constant(in.c);
+                break;
+            case RegOp::JMP:
+                target();
+                break;
+            case RegOp::JMPT:
+            case RegOp::JMPF:
+                reg(in.a); target();
+                break;
+            case RegOp::CHECK:
+            case RegOp::DEFINE:
+                if (in.a >= slots) badAt("variable out of range", pc);
+                break;
+            case RegOp::PRINT:
+                reg(in.a);
+                break;
+            default:
+                reg(in.a); reg(in.b); reg(in.c);
+                break;
+        }
+    }
+}
+
+void Image::validate() {
+    const ImageHeader& h = *header;
+    if (std::memcmp(h.magic, imageMagic, sizeof imageMagic) != 0) bad("not a bytecode image");
+    if (h.byteOrder != byteOrderMark) bad("written on a machine with another byte order");
+    if (h.version != imageVersion)
+        bad("version " + std::to_string(h.version) + ", expected " + std::to_string(imageVersion));
+    if (h.engine > static_cast<uint8_t>(ImageEngine::Register)) bad("unknown engine");
+    if (h.fileSize != length) bad("truncated or oversized file");
+
+    auto inBounds = [&](const ImageSection& s, size_t elementSize, const char* name) {
+        if (s.offset % 8 != 0 || s.offset < sizeof(ImageHeader) ||
+            s.offset + uint64_t(s.count) * elementSize > length)
+            bad(std::string(name) + " section out of bounds");
+    };
+    inBounds(h.code, sizeof(Instruction), "code");
+    inBounds(h.constants, engine() == ImageEngine::Stack ? sizeof(double) : sizeof(int32_t), "constant");
+    inBounds(h.nameLengths, sizeof(uint32_t), "name");
+    inBounds(h.nameBytes, 1, "name");
+    inBounds(h.positions, sizeof(PositionEntry), "position");
+    inBounds(h.functions, sizeof(Function), "function");
+    if (engine() == ImageEngine::Register && h.functions.count) bad("functions in a register image");
+
+    // names are small, so they are the one part copied out
+    const uint32_t* lengths = section<uint32_t>(h.nameLengths);
+    const char* bytes = section<char>(h.nameBytes);
+    uint64_t used = 0;
+    names.reserve(h.nameLengths.count);
+    for (uint32_t i = 0; i < h.nameLengths.count; ++i) {
+        if (used + lengths[i] > h.nameBytes.count) bad("name table out of bounds");
+        names.emplace_back(bytes + used, lengths[i]);
+        used += lengths[i];
+    }
+    if (names.size() > UINT16_MAX) bad("too many variables");
+
+    const PositionEntry* pos = section<PositionEntry>(h.positions);
+    for (uint32_t i = 1; i < h.positions.count; ++i)
+        if (pos[i].pc <= pos[i - 1].pc) bad("position table not sorted");
+
+    if (engine() == ImageEngine::Stack) {
+        // verified once here, so the VM can run the mapped code unchecked
+        ChunkView view = chunk();
+        try {
+            maxStack = verify(view);
+        } catch (std::runtime_error& e) {
+            bad(e.what());
+        }
+    } else {
+        if (h.numRegisters < names.size() || h.numRegisters > UINT16_MAX + size_t(1))
+            bad("register count out of range");
+        checkRegisterCode(section<RegInstr>(h.code), h.code.count, h.constants.count,
+                          names.size(), h.numRegisters);
+    }
+}
@@ -0,0 +1,337 @@
+#include "jit.h"
+
+#if BYTECODE_JIT
+#include <cstring>
+#include <sys/mman.h>
+
+namespace {
+
+// The native code keeps the operand stack on the machine stack, so every
+// path through the loop must leave it where it found it.
+bool balanced(const ChunkView& chunk, size_t head, size_t backEdge) {
+    const size_t n = backEdge - head + 1;
+    std::vector<int> depth(n, -1);
+    std::vector<size_t> work{head};
+    depth[0] = 0;
+
+    auto flow = [&](size_t to, int d) {
+        if (to < head || to > backEdge) return d == 0;   // leaving the loop
+        int& seen = depth[to - head];
+        if (seen < 0) { seen = d; work.push_back(to); return true; }
+        return seen == d;
+    };
+
+    while (!work.empty()) {
+        size_t pc = work.back();
+        work.pop_back();
+        const auto& in = chunk.code[pc];
+        int pops, pushes;
+        if (!stackEffect(in, pops, pushes)) return false;
+        int d = depth[pc - head] - pops;
+        if (d < 0) return false;
+        d += pushes;
+
+        if (in.op == OpCode::HALT) {
+            if (d != 0) return false;
+            continue;
+        }
+        if (isJump(in.op) && !flow(static_cast<size_t>(in.arg), d)) return false;
+        if (in.op != OpCode::JMP && !flow(pc + 1, d)) return false;
+    }
+    return true;
+}
+
+// Minimal x86-64 machine code buffer
+struct Assembler {
+    std::vector<uint8_t> bytes;
+
+    void emit(std::initializer_list<uint8_t> b) { bytes.insert(bytes.end(), b); }
+    void emit32(int32_t v) {
+        uint8_t b[4];
+        std::memcpy(b, &v, 4);
+        bytes.insert(bytes.end(), b, b + 4);
+    }
+    void emit64(uint64_t v) {
+        uint8_t b[8];
+        std::memcpy(b, &v, 8);
+        bytes.insert(bytes.end(), b, b + 8);
+    }
+    size_t size() const { return bytes.size(); }
+    void patch32(size_t at, int32_t v) { std::memcpy(&bytes[at], &v, 4); }
+
+    void pushRax() { emit({0x50}); }
+    void popRax()  { emit({0x58}); }
+    void popRcx()  { emit({0x59}); }
+    // Variables are 8-byte Values holding ints: the payload is the low
+    // dword and the tag above it is left alone
+    // mov eax, [rbx + slot*8]
+    void loadVar(int32_t slot) { emit({0x8B, 0x83}); emit32(slot * 8); }
+    // mov [rbx + slot*8], eax
+    void storeVar(int32_t slot) { emit({0x89, 0x83}); emit32(slot * 8); }
+    // eax = (cond) ? 1 : 0 from the flags of the last cmp/test
+    void setcc(uint8_t cc) { emit({0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0}); }
+};
+
+// setcc / jcc condition nibbles
+const uint8_t CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF;
+
+uint8_t compareCC(OpCode op) {
+    switch (op) {
+        case OpCode::CMP_EQ:  return CC_E;
+        case OpCode::CMP_NEQ: return CC_NE;
+        case OpCode::CMP_LT:  return CC_L;
+        case OpCode::CMP_LTE: return CC_LE;
+        case OpCode::CMP_GT:  return CC_G;
+        default:              return CC_GE;
+    }
+}
+
+// Condition under which JMP_IF_NOT_xx jumps (the negated comparison)
+uint8_t negatedCC(OpCode op) {
+    switch (op) {
+        case OpCode::JMP_IF_NOT_EQ:  return CC_NE;
+        case OpCode::JMP_IF_NOT_NEQ: return CC_E;
+        case OpCode::JMP_IF_NOT_LT:  return CC_GE;
+        case OpCode::JMP_IF_NOT_LTE: return CC_G;
+        case OpCode::JMP_IF_NOT_GT:  return CC_LE;
+        default:                     return CC_L;
+    }
+}
+
+} // namespace
+
+JitLoopFn Jit::compileLoop(const ChunkView& chunk, size_t head, size_t backEdge,
+                           const uint8_t* defined, JitPrintFn print) {
+    if (backEdge >= chunk.size || head > backEdge) return nullptr;
+    for (size_t pc = head; pc <= backEdge; ++pc) {
+        int32_t slot = slotOf(chunk.code[pc]);
+        if (slot >= 0 && !defined[slot]) return nullptr;
+    }
+    if (!balanced(chunk, head, backEdge)) return nullptr;
+
+    Assembler a;
+    // push rbp; mov rbp, rsp; push rbx; push r12; push r13
+    a.emit({0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54, 0x41, 0x55});
+    // mov rbx, rdi (variables); mov r13, rsi (context)
+    a.emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF5});
+
+    // The code below computes in int only, and nothing in the loop makes
+    // a double (LOAD_DOUBLE is declined), so ints on entry stay ints. If
+    // a variable holds a double, hand the iteration back at the head.
+    std::vector<size_t> bails;
+    std::vector<bool> guarded(chunk.slots);
+    for (size_t pc = head; pc <= backEdge; ++pc) {
+        int32_t slot = slotOf(chunk.code[pc]);
+        if (slot < 0 || guarded[slot]) continue;
+        guarded[slot] = true;
+        a.emit({0x81, 0xBB}); a.emit32(slot * 8 + 4);                  // cmp dword [rbx+d], tag
+        a.emit32(static_cast<int32_t>(Value::intTagHigh));
+        a.emit({0x0F, 0x85});                                           // jne bail
+        bails.push_back(a.size());
+        a.emit32(0);
+    }
+
+    struct Fixup { size_t at; int64_t target; };   // target: pc, or -(pc+1) for errors
+    std::vector<Fixup> fixups;
+    std::vector<size_t> native(backEdge - head + 1);
+
+    auto jumpTo = [&](std::initializer_list<uint8_t> opcode, int64_t target) {
+        a.emit(opcode);
+        fixups.push_back({a.size(), target});
+        a.emit32(0);
+    };
+
+    for (size_t pc = head; pc <= backEdge; ++pc) {
+        native[pc - head] = a.size();
+        const auto& in = chunk.code[pc];
+        switch (in.op) {
+            case OpCode::LOAD_CONST:
+                a.emit({0x68}); a.emit32(in.arg);                // push imm32
+                break;
+            case OpCode::LOAD_DOUBLE:
+                return nullptr;                                  // int code only
+            case OpCode::LOAD_VAR:
+                a.loadVar(in.arg); a.pushRax();
+                break;
+            case OpCode::STORE_VAR:
+                a.popRax(); a.storeVar(in.arg);
+                break;
+            case OpCode::POP:
+                a.popRax();
+                break;
+            case OpCode::ADD:
+            case OpCode::SUB:
+            case OpCode::MUL:
+                a.popRcx(); a.popRax();
+                if (in.op == OpCode::ADD) a.emit({0x01, 0xC8});         // add eax, ecx
+                else if (in.op == OpCode::SUB) a.emit({0x29, 0xC8});    // sub eax, ecx
+                else a.emit({0x0F, 0xAF, 0xC1});                        // imul eax, ecx
+                a.pushRax();
+                break;
+            case OpCode::DIV:
+            case OpCode::MOD: {
+                a.popRcx(); a.popRax();
+                a.emit({0x85, 0xC9});                                   // test ecx, ecx
+                jumpTo({0x0F, 0x84}, -static_cast<int64_t>(pc) - 1);    // jz error
+                // x / -1 would trap on INT_MIN, so handle it without idiv
+                a.emit({0x83, 0xF9, 0xFF, 0x75, 0x04});                 // cmp ecx, -1; jne +4
+                if (in.op == OpCode::DIV) a.emit({0xF7, 0xD8});         // neg eax
+                else a.emit({0x31, 0xC0});                              // xor eax, eax
+                a.emit({0xEB, 0x05});                                   // jmp +5
+                a.emit({0x99, 0xF7, 0xF9});                             // cdq; idiv ecx
+                if (in.op == OpCode::DIV) a.emit({0x90, 0x90});         // nop; nop
+                else a.emit({0x89, 0xD0});                              // mov eax, edx
+                a.pushRax();
+                break;
+            }
+            case OpCode::CMP_EQ: case OpCode::CMP_NEQ:
+            case OpCode::CMP_LT: case OpCode::CMP_LTE:
+            case OpCode::CMP_GT: case OpCode::CMP_GTE:
+                a.popRcx(); a.popRax();
+                a.emit({0x39, 0xC8});                                   // cmp eax, ecx
+                a.setcc(0x90 | compareCC(in.op));
+                a.pushRax();
+                break;
+            case OpCode::LOGICAL_AND:
+            case OpCode::LOGICAL_OR:
+                a.popRcx(); a.popRax();
+                a.emit({0x85, 0xC0, 0x0F, 0x95, 0xC0});                 // test eax, eax; setne al
+                a.emit({0x85, 0xC9, 0x0F, 0x95, 0xC1});                 // test ecx, ecx; setne cl
+                if (in.op == OpCode::LOGICAL_AND) a.emit({0x20, 0xC8}); // and al, cl
+                else a.emit({0x08, 0xC8});                              // or al, cl
+                a.emit({0x0F, 0xB6, 0xC0});                             // movzx eax, al
+                a.pushRax();
+                break;
+            case OpCode::LOGICAL_NOT:
+                a.popRax();
+                a.emit({0x85, 0xC0});                                   // test eax, eax
+                a.setcc(0x90 | CC_E);
+                a.pushRax();
+                break;
+            case OpCode::PRINT:
+                a.emit({0x5E});                                         // pop rsi (value)
+                a.emit({0x4C, 0x89, 0xEF});                             // mov rdi, r13
+                a.emit({0x49, 0x89, 0xE4});                             // mov r12, rsp
+                a.emit({0x48, 0x83, 0xE4, 0xF0});                       // and rsp, -16
+                a.emit({0x48, 0xB8});                                   // mov rax, print
+                a.emit64(reinterpret_cast<uint64_t>(print));
+                a.emit({0xFF, 0xD0});                                   // call rax
+                a.emit({0x4C, 0x89, 0xE4});                             // mov rsp, r12
+                break;
+            case OpCode::HALT:
+                jumpTo({0xE9}, static_cast<int64_t>(chunk.size));
+                break;
+            case OpCode::JMP:
+                jumpTo({0xE9}, in.arg);
+                break;
+            case OpCode::JMP_IF_TRUE:
+            case OpCode::JMP_IF_FALSE:
+                a.popRax();
+                a.emit({0x85, 0xC0});                                   // test eax, eax
+                jumpTo({0x0F, static_cast<uint8_t>(0x80 | (in.op == OpCode::JMP_IF_TRUE ? CC_NE : CC_E))},
+                       in.arg);
+                break;
+            case OpCode::JMP_IF_NOT_EQ: case OpCode::JMP_IF_NOT_NEQ:
+            case OpCode::JMP_IF_NOT_LT: case OpCode::JMP_IF_NOT_LTE:
+            case OpCode::JMP_IF_NOT_GT: case OpCode::JMP_IF_NOT_GTE:
+                a.popRcx(); a.popRax();
+                a.emit({0x39, 0xC8});                                   // cmp eax, ecx
+                jumpTo({0x0F, static_cast<uint8_t>(0x80 | negatedCC(in.op))}, in.arg);
+                break;
+            case OpCode::INC_VAR:
+                a.emit({0x81, 0x83}); a.emit32(in.slot * 8); a.emit32(in.arg);  // add [rbx+d], imm32
+                break;
+            case OpCode::LOAD_VAR_CONST:
+                a.loadVar(in.slot); a.pushRax();
+                a.emit({0x68}); a.emit32(in.arg);
+                break;
+            case OpCode::ADD_VAR_CONST:
+                a.loadVar(in.slot); a.emit({0x05}); a.emit32(in.arg);           // add eax, imm32
+                a.pushRax();
+                break;
+            case OpCode::SUB_VAR_CONST:
+                a.loadVar(in.slot); a.emit({0x2D}); a.emit32(in.arg);           // sub eax, imm32
+                a.pushRax();
+                break;
+            case OpCode::MUL_VAR_CONST:
+                a.loadVar(in.slot); a.emit({0x69, 0xC0}); a.emit32(in.arg);     // imul eax, eax, imm32
+                a.pushRax();
+                break;
+            case OpCode::LOAD_VAR_SLOT: case OpCode::STORE_VAR_SLOT:
+            case OpCode::LOAD_VAR_CONST_SLOT: case OpCode::INC_VAR_INT:
+            case OpCode::ADD_INT_INT: case OpCode::SUB_INT_INT: case OpCode::MUL_INT_INT:
+            case OpCode::ADD_DBL_DBL: case OpCode::SUB_DBL_DBL: case OpCode::MUL_DBL_DBL:
+                return nullptr;                                  // the VM passes compiled code
+            case OpCode::NEW_ARRAY: case OpCode::INDEX: case OpCode::LEN:
+            case OpCode::SUM: case OpCode::MIN: case OpCode::MAX:
+            case OpCode::COUNT: case OpCode::RANGE:
+                return nullptr;                                  // arrays stay in the VM
+            case OpCode::CALL: case OpCode::TAIL_CALL: case OpCode::RETURN:
+            case OpCode::LOAD_LOCAL: case OpCode::STORE_LOCAL:
+                return nullptr;                                  // calls and locals too
+        }
+    }
+
+    // Exit stubs: mov rax, result; jmp epilogue
+    std::vector<std::pair<int64_t, size_t>> stubs;
+    std::vector<size_t> toEpilogue;
+    for (auto& f : fixups) {
+        size_t dest;
+        if (f.target >= static_cast<int64_t>(head) && f.target <= static_cast<int64_t>(backEdge)) {
+            dest = native[f.target - head];
+        } else {
+            dest = 0;
+            for (auto& s : stubs) if (s.first == f.target) dest = s.second;
+            if (!dest) {
+                dest = a.size();
+                stubs.push_back({f.target, dest});
+                a.emit({0x48, 0xC7, 0xC0}); a.emit32(static_cast<int32_t>(f.target));
+                a.emit({0xE9});
+                toEpilogue.push_back(a.size());
+                a.emit32(0);
+            }
+        }
+        a.patch32(f.at, static_cast<int32_t>(dest - (f.at + 4)));
+    }
+
+    if (!bails.empty()) {
+        size_t dest = a.size();
+        a.emit({0x48, 0xC7, 0xC0}); a.emit32(static_cast<int32_t>(head));
+        a.emit({0xE9});
+        toEpilogue.push_back(a.size());
+        a.emit32(0);
+        for (size_t at : bails) a.patch32(at, static_cast<int32_t>(dest - (at + 4)));
+    }
+
+    // Epilogue: drop whatever is left on the operand stack
+    size_t epilogue = a.size();
+    for (size_t at : toEpilogue) a.patch32(at, static_cast<int32_t>(epilogue - (at + 4)));
+    a.emit({0x48, 0x8D, 0x65, 0xE8});                                   // lea rsp, [rbp-24]
+    a.emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D, 0xC3});                 // pop r13, r12, rbx, rbp; ret
+
+    size_t length = a.size();
+    void* mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    std::memcpy(mem, a.bytes.data(), length);
+    if (mprotect(mem, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, length);
+        return nullptr;
+    }
+    regions.push_back({mem, length});
+    return reinterpret_cast<JitLoopFn>(mem);
+}
+
+void Jit::release() {
+    for (auto& r : regions) munmap(r.first, r.second);
+    regions.clear();
+}
+
+#else
+
+JitLoopFn Jit::compileLoop(const ChunkView&, size_t, size_t, const uint8_t*, JitPrintFn) {
+    return nullptr;
+}
+
+void Jit::release() {}
+
+#endif
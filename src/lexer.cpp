@@ -1,116 +1,142 @@
 #include "lexer.h"
-#include <cctype>
 
-Lexer::Lexer(const std::string& src) : source(src), pos(0) {}
+namespace {
+enum CharClass : uint8_t {
+    Space = 1,
+    Alpha = 2,
+    Digit = 4,
+};
 
-char Lexer::peek() {
-    return pos < source.size() ? source[pos] : '\0';
-}
+// Class of every byte value, in place of the locale-aware <cctype> calls.
+// Matches them in the "C" locale: bytes >= 0x80 are in no class.
+struct CharTable {
+    uint8_t classes[256] = {};
+
+    constexpr CharTable() {
+        for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) classes[static_cast<unsigned char>(c)] = Space;
+        for (int c = 'a'; c <= 'z'; ++c) classes[c] = Alpha;
+        for (int c = 'A'; c <= 'Z'; ++c) classes[c] = Alpha;
+        for (int c = '0'; c <= '9'; ++c) classes[c] = Digit;
+    }
 
-char Lexer::get() {
-    return pos < source.size() ? source[pos++] : '\0';
+    bool is(char c, uint8_t mask) const { return classes[static_cast<unsigned char>(c)] & mask; }
+};
+
+constexpr CharTable chars;
 }
 
-void Lexer::skipWhitespace() {
-    while (std::isspace(static_cast<unsigned char>(peek()))) get();
+// Perfect hash of the keywords: (length + first letter) % 8 differs for
+// each of them, so a single comparison decides
+static bool isKeyword(std::string_view word) {
+    static const std::string_view slots[8] = {
+        "return", "else", "func", "if", "while", "print", "", "",
+    };
+    return word == slots[(word.size() + static_cast<unsigned char>(word[0])) % 8];
 }
 
-Token Lexer::identifier() {
-    std::string result;
-    while (std::isalnum(static_cast<unsigned char>(peek()))) result += get();
+const char* opName(Op op) {
+    static const char* const names[] = {
+        "+", "-", "*", "/", "%",
+        "==", "!=", "<", "<=", ">", ">=",
+        "&&", "||",
+        "!", "-", "?",
+    };
+    return names[static_cast<size_t>(op)];
+}
 
-    if (result == "print" || result == "if" || result == "while" || result == "else")
-        return Token(TokenType::Keyword, result); // else now recognized
+Lexer::Lexer(std::string_view src) : source(src), pos(0) {}
 
-    return Token(TokenType::Identifier, result);
+void Lexer::skipWhitespace() {
+    while (pos < source.size() && chars.is(source[pos], Space)) {
+        if (source[pos++] == '\n') {
+            ++line;
+            lineStart = pos;
+        }
+    }
 }
 
-
-Token Lexer::number() {
-    std::string result;
-    while (std::isdigit(static_cast<unsigned char>(peek()))) result += get();
-    return Token(TokenType::Number, result);
+// Consumes c if it is next
+bool Lexer::match(char c) {
+    if (pos < source.size() && source[pos] == c) {
+        ++pos;
+        return true;
+    }
+    return false;
 }
 
 std::vector<Token> Lexer::tokenize() {
     std::vector<Token> tokens;
+    tokens.reserve(source.size() / 3 + 1);   // typical programs have a token every few bytes
 
     while (true) {
         skipWhitespace();
-        char c = peek();
+        size_t start = pos;
+        SourcePos at{line, static_cast<uint32_t>(pos - lineStart + 1)};
+        uint32_t offset = static_cast<uint32_t>(start);
 
-        if (c == '\0') {
-            tokens.emplace_back(TokenType::EndOfFile, "");
+        if (pos == source.size()) {
+            tokens.emplace_back(TokenType::EndOfFile, source.substr(pos), at, offset);
             break;
-        } else if (std::isalpha(static_cast<unsigned char>(c))) {
-            tokens.push_back(identifier());
-        } else if (std::isdigit(static_cast<unsigned char>(c))) {
-            tokens.push_back(number());
-        } else if (c == '=') {
-            get();
-            if (peek() == '=') {
-                get();
-                tokens.emplace_back(TokenType::Operator, "==");
-            } else {
-                tokens.emplace_back(TokenType::Assign, "=");
-            }
-        } else if (c == '!') {
-            get();
-            if (peek() == '=') {
-                get();
-                tokens.emplace_back(TokenType::Operator, "!=");
-            } else {
-                tokens.emplace_back(TokenType::Operator, "!");
-            }
-        } else if (c == '<') {
-            get();
-            if (peek() == '=') {
-                get();
-                tokens.emplace_back(TokenType::Operator, "<=");
-            } else {
-                tokens.emplace_back(TokenType::Operator, "<");
-            }
-        } else if (c == '>') {
-            get();
-            if (peek() == '=') {
-                get();
-                tokens.emplace_back(TokenType::Operator, ">=");
-            } else {
-                tokens.emplace_back(TokenType::Operator, ">");
-            }
-        } else if (c == '&') {
-            // bounds-safe lookahead for &&
-            if (pos + 1 < source.size() && source[pos + 1] == '&') {
-                get(); get();
-                tokens.emplace_back(TokenType::Operator, "&&");
-            } else {
-                // treat single '&' as unknown for now
-                get();
-                tokens.emplace_back(TokenType::Unknown, "&");
+        }
+
+        char c = source[pos++];
+        TokenType type = TokenType::Operator;
+        Op op = Op::None;
+        if (chars.is(c, Alpha)) {
+            while (pos < source.size() && chars.is(source[pos], Alpha | Digit)) ++pos;
+            type = isKeyword(source.substr(start, pos - start)) ? TokenType::Keyword : TokenType::Identifier;
+        } else if (chars.is(c, Digit)) {
+            while (pos < source.size() && chars.is(source[pos], Digit)) ++pos;
+            // a fraction and an exponent make it a double; each needs a
+            // digit, so "1." or "2e" end the number before the '.' or 'e'
+            if (pos + 1 < source.size() && source[pos] == '.' && chars.is(source[pos + 1], Digit)) {
+                pos += 2;
+                while (pos < source.size() && chars.is(source[pos], Digit)) ++pos;
             }
-        } else if (c == '|') {
-            // bounds-safe lookahead for ||
-            if (pos + 1 < source.size() && source[pos + 1] == '|') {
-                get(); get();
-                tokens.emplace_back(TokenType::Operator, "||");
-            } else {
-                get();
-                tokens.emplace_back(TokenType::Unknown, "|");
+            if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+                size_t digits = pos + 1;
+                if (digits < source.size() && (source[digits] == '+' || source[digits] == '-')) ++digits;
+                if (digits < source.size() && chars.is(source[digits], Digit)) {
+                    pos = digits;
+                    while (pos < source.size() && chars.is(source[pos], Digit)) ++pos;
+                }
             }
-        } else if (c == '+' || c == '-' || c == '*' || c == '/' || c == '%') {
-            tokens.emplace_back(TokenType::Operator, std::string(1, get()));
-        } else if (c == ';') {
-            get();
-            tokens.emplace_back(TokenType::Semicolon, ";");
-        } else if (c == '(') {
-            get();
-            tokens.emplace_back(TokenType::LParen, "(");
-        } else if (c == ')') {
-            get();
-            tokens.emplace_back(TokenType::RParen, ")");
+            type = TokenType::Number;
         } else {
-            tokens.emplace_back(TokenType::Unknown, std::string(1, get()));
+            switch (c) {
+                case '=':
+                    if (match('=')) op = Op::Eq;
+                    else type = TokenType::Assign;
+                    break;
+                case '!': op = match('=') ? Op::Neq : Op::Not; break;
+                case '<': op = match('=') ? Op::Lte : Op::Lt; break;
+                case '>': op = match('=') ? Op::Gte : Op::Gt; break;
+                // a single '&' or '|' is unknown for now
+                case '&':
+                    if (match('&')) op = Op::And;
+                    else type = TokenType::Unknown;
+                    break;
+                case '|':
+                    if (match('|')) op = Op::Or;
+                    else type = TokenType::Unknown;
+                    break;
+                case '+': op = Op::Add; break;
+                case '-': op = Op::Sub; break;
+                case '*': op = Op::Mul; break;
+                case '/': op = Op::Div; break;
+                case '%': op = Op::Mod; break;
+                case ';': type = TokenType::Semicolon; break;
+                case '(': type = TokenType::LParen; break;
+                case ')': type = TokenType::RParen; break;
+                case '{': type = TokenType::LBrace; break;
+                case '}': type = TokenType::RBrace; break;
+                case '[': type = TokenType::LBracket; break;
+                case ']': type = TokenType::RBracket; break;
+                case ',': type = TokenType::Comma; break;
+                default:  type = TokenType::Unknown; break;
+            }
         }
+        tokens.emplace_back(type, source.substr(start, pos - start), at, offset, op);
     }
 
     return tokens;
@@ -0,0 +1,198 @@
+#include "libbytecode.h"
+#include <stdexcept>
+#include "columnar.h"
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "vm.h"
+
+namespace bytecode {
+
+// What compile() produced; shared, read-only, by every copy of a Program
+struct Program::Code {
+    Chunk chunk;
+    std::vector<std::string> inputs;
+    std::unordered_map<std::string, size_t> slots;   // by name
+    Error error;
+    bool ok = true;
+};
+
+static Error toError(const std::runtime_error& e) {
+    Error error;
+    error.message = e.what();
+    if (auto located = dynamic_cast<const SourceError*>(&e)) {
+        error.line = located->pos.line;
+        error.column = located->pos.column;
+    }
+    return error;
+}
+
+const Value* Result::find(std::string_view name) const {
+    for (const auto& v : variables)
+        if (v.first == name) return &v.second;
+    return nullptr;
+}
+
+Program compile(std::string_view source, const CompileOptions& options) {
+    auto code = std::make_shared<Program::Code>();
+    try {
+        Lexer lexer(source);
+        Parser parser(lexer.tokenize());
+        auto program = parser.parse();
+        if (options.optimize) foldConstants(program);
+
+        // open compile: names read before any assignment become inputs
+        // instead of errors, to be bound at run time
+        std::vector<Compiler::Import> imports;
+        Compiler compiler;
+        code->chunk = compiler.compileOpen(program, imports);
+        if (options.optimize) peephole(code->chunk);
+        for (auto& i : imports) code->inputs.push_back(std::move(i.name));
+        for (size_t slot = 0; slot < code->chunk.names.size(); ++slot)
+            code->slots.emplace(code->chunk.names[slot], slot);
+    } catch (std::runtime_error& e) {
+        code->chunk = Chunk();
+        code->error = toError(e);
+        code->ok = false;
+    }
+    return Program(std::move(code));
+}
+
+bool Program::ok() const {
+    return code->ok;
+}
+
+const Error& Program::error() const {
+    return code->error;
+}
+
+const std::vector<std::string>& Program::inputs() const {
+    return code->inputs;
+}
+
+Result Program::run(const Bindings& bindings) const {
+    Result result;
+    if (!code->ok) {
+        result.ok = false;
+        result.error = code->error;
+        return result;
+    }
+
+    VM vm;
+    CaptureSink sink;
+    vm.setOutput(&sink);
+    for (const auto& b : bindings) {
+        auto slot = code->slots.find(b.first);
+        if (slot != code->slots.end()) vm.setVariable(slot->second, b.second);
+    }
+    try {
+        vm.run(code->chunk);
+    } catch (std::runtime_error& e) {
+        result.ok = false;
+        result.error = toError(e);
+    }
+    result.output = sink.str();
+
+    const auto& names = code->chunk.names;
+    for (size_t slot = 0; slot < names.size(); ++slot) {
+        Value value;
+        if (vm.getVariable(slot, value) && !value.isArray()) result.variables.emplace_back(names[slot], value);
+    }
+    return result;
+}
+
+// ---- Batch evaluation ----
+
+struct Expression::Code {
+    ColumnProgram program;
+    Error error;
+    bool ok = true;
+};
+
+size_t BatchResult::count() const {
+    size_t n = 0;
+    for (uint64_t word : selection)
+        for (; word; word &= word - 1) ++n;
+    return n;
+}
+
+Value BatchResult::value(size_t r) const {
+    switch (type) {
+        case Type::Int:    return ints[r];
+        case Type::Double: return doubles[r];
+        case Type::Bool:   break;
+    }
+    return selected(r) ? 1 : 0;
+}
+
+Expression compileExpression(std::string_view source, const CompileOptions& options) {
+    auto code = std::make_shared<Expression::Code>();
+    try {
+        Lexer lexer(source);
+        Parser parser(lexer.tokenize());
+        auto ast = parser.parseExpression();
+        if (options.optimize) foldConstants(ast);
+        code->program = compileColumns(ast.statements.front());
+    } catch (std::runtime_error& e) {
+        code->program = ColumnProgram();
+        code->error = toError(e);
+        code->ok = false;
+    }
+    return Expression(std::move(code));
+}
+
+bool Expression::ok() const {
+    return code->ok;
+}
+
+const Error& Expression::error() const {
+    return code->error;
+}
+
+const std::vector<std::string>& Expression::inputs() const {
+    return code->program.inputs;
+}
+
+BatchResult Expression::evaluate(const Columns& columns, size_t rows) const {
+    BatchResult result;
+    result.rows = rows;
+    if (!code->ok) {
+        result.ok = false;
+        result.error = code->error;
+        return result;
+    }
+
+    std::vector<ColumnRef> inputs;
+    for (const auto& name : code->program.inputs) {
+        auto column = columns.find(name);
+        if (column == columns.end() || (rows && !column->second.ints && !column->second.doubles)) {
+            result.ok = false;
+            result.error.message = "Missing column: " + name;
+            return result;
+        }
+        if (column->second.ints) inputs.push_back({ColumnType::Int, column->second.ints});
+        else inputs.push_back({ColumnType::Double, column->second.doubles});
+    }
+
+    ColumnResult out;
+    try {
+        evaluateColumns(code->program, inputs.data(), rows, out);
+    } catch (RowError& e) {
+        result.ok = false;
+        result.error = toError(e);
+        result.row = e.row;
+        return result;
+    }
+    switch (out.type) {
+        case ColumnType::Int:    result.type = BatchResult::Type::Int; break;
+        case ColumnType::Double: result.type = BatchResult::Type::Double; break;
+        case ColumnType::Bool:   result.type = BatchResult::Type::Bool; break;
+    }
+    result.ints = std::move(out.ints);
+    result.doubles = std::move(out.doubles);
+    result.selection = std::move(out.selection);
+    return result;
+}
+
+}  // namespace bytecode
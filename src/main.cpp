@@ -1,36 +1,134 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <vector>
 #include "lexer.h"
 #include "parser.h"
+#include "batch.h"
+#include "cache.h"
 #include "bytecode.h"
 #include "compiler.h"
+#include "image.h"
+#include "optimizer.h"
+#include "regcompiler.h"
 #include "vm.h"
 
 // Helper: pretty-print AST
 static void printAST(const ASTNode* node, int indent = 0) {
     std::string space(indent, ' ');
-    if (auto num = dynamic_cast<const NumberNode*>(node)) {
-        std::cout << space << "Number(" << num->value << ")\n";
-    } else if (auto id = dynamic_cast<const IdentifierNode*>(node)) {
-        std::cout << space << "Identifier(" << id->name << ")\n";
-    } else if (auto bin = dynamic_cast<const BinaryOpNode*>(node)) {
-        std::cout << space << "BinaryOp(" << bin->op << ")\n";
-        printAST(bin->left.get(), indent + 2);
-        printAST(bin->right.get(), indent + 2);
-    } else if (auto un = dynamic_cast<const UnaryOpNode*>(node)) {
-        std::cout << space << "UnaryOp(" << un->op << ")\n";
-        printAST(un->expr.get(), indent + 2);
-    } else if (auto assign = dynamic_cast<const AssignmentNode*>(node)) {
+    switch (node->kind) {
+    case NodeKind::Number:
+        std::cout << space << "Number(" << node->as<NumberNode>()->value << ")\n";
+        break;
+    case NodeKind::Identifier:
+        std::cout << space << "Identifier(" << node->as<IdentifierNode>()->name << ")\n";
+        break;
+    case NodeKind::Binary: {
+        auto bin = node->as<BinaryOpNode>();
+        std::cout << space << "BinaryOp(" << opName(bin->op) << ")\n";
+        printAST(bin->left, indent + 2);
+        printAST(bin->right, indent + 2);
+        break;
+    }
+    case NodeKind::Unary: {
+        auto un = node->as<UnaryOpNode>();
+        std::cout << space << "UnaryOp(" << opName(un->op) << ")\n";
+        printAST(un->expr, indent + 2);
+        break;
+    }
+    case NodeKind::Array:
+        std::cout << space << "Array\n";
+        for (const ASTNode* e : node->as<ArrayNode>()->elements) printAST(e, indent + 2);
+        break;
+    case NodeKind::Index: {
+        auto index = node->as<IndexNode>();
+        std::cout << space << "Index\n";
+        printAST(index->array, indent + 2);
+        printAST(index->index, indent + 2);
+        break;
+    }
+    case NodeKind::Call: {
+        auto call = node->as<CallNode>();
+        std::cout << space << "Call(" << call->name << ")\n";
+        for (const ASTNode* a : call->args) printAST(a, indent + 2);
+        break;
+    }
+    case NodeKind::Assignment: {
+        auto assign = node->as<AssignmentNode>();
         std::cout << space << "Assignment(" << assign->varName << ")\n";
-        printAST(assign->expr.get(), indent + 2);
-    } else if (auto printNode = dynamic_cast<const PrintNode*>(node)) {
+        printAST(assign->expr, indent + 2);
+        break;
+    }
+    case NodeKind::Print:
         std::cout << space << "Print\n";
-        printAST(printNode->expr.get(), indent + 2);
+        printAST(node->as<PrintNode>()->expr, indent + 2);
+        break;
+    case NodeKind::Function: {
+        auto fn = node->as<FunctionNode>();
+        std::cout << space << "Function(" << fn->name << ")\n";
+        for (const ASTNode* p : fn->params) printAST(p, indent + 2);
+        for (const ASTNode* stmt : fn->body->as<BlockNode>()->statements) printAST(stmt, indent + 2);
+        break;
+    }
+    case NodeKind::Return:
+        std::cout << space << "Return\n";
+        if (auto expr = node->as<ReturnNode>()->expr) printAST(expr, indent + 2);
+        break;
+    default:
+        break;
+    }
+}
+
+struct Options {
+    enum class Mode { Repl, Run, Compile, Batch } mode = Mode::Repl;
+    bool optimize = false;          // -O
+    bool registerEngine = false;    // --engine=register
+    bool time = false;              // --time (run and batch)
+    bool profile = false;           // --profile[=file] (run only)
+    std::string profileOutput = "profile.folded";
+    std::string path;               // input file; empty or "-" is stdin
+    std::string output;             // -o (compile only)
+    std::vector<std::string> paths; // batch: every script
+    unsigned threads = 0;           // -j (batch only), 0 is one per core
+    unsigned repeat = 1;            // --repeat (batch only)
+    std::string cacheFile;          // --cache (REPL and run, stack engine)
+    size_t cacheBudget = 64 << 20;  // --cache-budget, given in MB
+};
+
+using Clock = std::chrono::steady_clock;
+
+static void printCacheStats(const ProgramCache& cache) {
+    const auto& st = cache.stats();
+    std::cerr << "cache: " << st.hits << " hits, " << st.misses << " misses, " << st.evictions
+              << " evictions, " << st.entries << " entries, " << st.bytes / 1024 << " KB\n";
+}
+
+// Prints every statement's AST, as the REPL does for each line
+static void printProgram(const Ast& program) {
+    for (const ASTNode* stmt : program.statements) {
+        std::cout << "[AST]\n";
+        printAST(stmt);
     }
 }
 
-int main() {
+static int runRepl(const Options& opts) {
+    StdoutSink out(OutputSink::Flush::Line);   // show each value at once
     VM vm;
+    Compiler compiler;  // keeps the symbol table across lines
+    RegisterVM regVM;
+    RegisterCompiler regCompiler;
+    ProgramCache cache(opts.cacheBudget);
+    vm.setOutput(&out);
+    regVM.setOutput(&out);
+    if (!opts.cacheFile.empty()) cache.load(opts.cacheFile);
     std::string line;
     std::cout << "Bytecode REPL (Parser + Bytecode Test). Type 'exit' to quit.\n";
 
@@ -39,40 +137,432 @@ int main() {
         if (!std::getline(std::cin, line)) break;
         if (line == "exit") break;
 
-        // 1) Lex
-        Lexer lexer(line);
-        auto tokens = lexer.tokenize();
-
-        // 2) Parse
-        Parser parser(tokens);
+        bool running = false;   // past compiling: errors come from the program
         try {
-            auto stmts = parser.parse();
+            if (opts.registerEngine) {
+                Lexer lexer(line);
+                Parser parser(lexer.tokenize());
+                auto program = parser.parse();
+                if (opts.optimize) foldConstants(program);
+                printProgram(program);
 
-            // Print AST (all statements for this line)
-            for (auto& stmt : stmts) {
-                std::cout << "[AST]\n";
-                printAST(stmt.get());
+                auto code = regCompiler.compile(program);
+                if (opts.optimize) threadJumps(code);
+                std::cout << "[Register bytecode]\n";
+                disassemble(code, std::cout);
+                running = true;
+                regVM.run(code);
+                continue;
             }
 
-            // 3) Compile using Compiler (handles &&, ||, !, comparisons, etc.)
-            Compiler compiler;
-            auto bytecode = compiler.compile(stmts);
+            // 1-3) Lex, parse and compile, unless the same line was
+            // compiled before; then the cached code is reused
+            bool parsed = false;
+            auto bytecode = cache.get(line, compiler, opts.optimize, [&](const Ast& program) {
+                parsed = true;
+                printProgram(program);
+            });
+            if (!parsed) std::cout << "[AST] (cached)\n";
 
             // 4) Disassemble/print bytecode
             std::cout << "[Bytecode]\n";
-            for (const auto& instr : bytecode) {
-                std::cout << opcodeToString(instr.op);
-                if (!instr.arg.empty()) std::cout << " " << instr.arg;
-                std::cout << "\n";
-            }
+            disassemble(bytecode, std::cout);
 
             // 5) Run on VM
+            running = true;
             vm.run(bytecode);
 
         } catch (std::runtime_error& e) {
-            std::cerr << "Parser error: " << e.what() << "\n";
+            std::cerr << (running ? "Runtime error: " : "Parser error: ") << e.what() << "\n";
         }
     }
 
+    if (!opts.cacheFile.empty()) {
+        try {
+            cache.save(opts.cacheFile);
+        } catch (std::runtime_error& e) {
+            std::cerr << opts.cacheFile << ": error: " << e.what() << "\n";
+        }
+        printCacheStats(cache);
+    }
     return 0;
 }
+
+static bool readSource(const std::string& path, std::string& source) {
+    if (path.empty() || path == "-") {
+        source.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+        return !std::cin.bad();
+    }
+    // A directory opens, but reports a bogus size and throws on reading
+    std::error_code ec;
+    if (std::filesystem::is_directory(path, ec)) return false;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::streamoff size = in.seekg(0, std::ios::end).tellg();
+    if (size < 0) {
+        // A pipe has no size up front: read it as it comes
+        in.clear();
+        source.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return !in.bad();
+    }
+    source.resize(static_cast<size_t>(size));
+    in.seekg(0);
+    in.read(&source[0], static_cast<std::streamsize>(source.size()));
+    return static_cast<bool>(in);
+}
+
+// One line of --time output
+static void report(const char* what, Clock::time_point from, Clock::time_point to) {
+    std::cerr << std::left << std::setw(20) << what << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << std::chrono::duration<double, std::milli>(to - from).count() << " ms\n";
+}
+
+// Errors go to stderr as file:line:column: error: message
+static void printError(const std::string& name, const std::runtime_error& e) {
+    std::cout.flush();
+    std::cerr << name;
+    auto located = dynamic_cast<const SourceError*>(&e);
+    if (located && located->pos.line) std::cerr << ":" << located->pos.line << ":" << located->pos.column;
+    std::cerr << ": error: " << e.what() << "\n";
+}
+
+static std::string inputName(const Options& opts) {
+    return opts.path.empty() || opts.path == "-" ? "<stdin>" : opts.path;
+}
+
+// Report to stderr, collapsed stacks to the --profile file
+static void writeProfile(const Options& opts, const Profiler& profiler, const std::string& name) {
+    std::cout.flush();
+    profiler.report(std::cerr, name);
+    std::ofstream out(opts.profileOutput);
+    profiler.writeCollapsed(out);
+    if (!out) std::cerr << opts.profileOutput << ": error: cannot write profile\n";
+    else std::cerr << "\ncollapsed stacks written to " << opts.profileOutput << "\n";
+}
+
+// Runs chunk on vm, under the profiler if --profile was given
+static void runStack(const Options& opts, VM& vm, const ChunkView& chunk, const std::string& name) {
+    if (!opts.profile) {
+        vm.run(chunk);
+        return;
+    }
+    Profiler profiler;
+    vm.setProfiler(&profiler);
+    try {
+        vm.run(chunk);
+    } catch (std::runtime_error&) {
+        // still show where the time went before the error
+        writeProfile(opts, profiler, name);
+        throw;
+    }
+    writeProfile(opts, profiler, name);
+}
+
+// Runs a compiled image straight from the mapped file
+static int runImage(const Options& opts, Clock::time_point started) {
+    Clock::time_point loaded, finished;
+    try {
+        Image image(opts.path);
+        if (image.engine() == ImageEngine::Register) {
+            if (opts.profile) throw std::runtime_error("--profile works with the stack engine only");
+            RegisterVM vm;
+            loaded = Clock::now();
+            vm.run(image.regChunk());
+        } else {
+            VM vm;
+            loaded = Clock::now();
+            runStack(opts, vm, image.chunk(), opts.path);
+        }
+        finished = Clock::now();
+    } catch (std::runtime_error& e) {
+        printError(opts.path, e);
+        return 1;
+    }
+
+    if (opts.time) {
+        std::cout.flush();
+        report("first instruction", started, loaded);
+        report("run", loaded, finished);
+        report("total", started, finished);
+    }
+    return 0;
+}
+
+// run --cache: the compiled program comes from the cache file when the
+// same source ran before, and the file is updated afterwards
+static int runCached(const Options& opts, const std::string& source, Clock::time_point started) {
+    const std::string name = inputName(opts);
+    Clock::time_point read = Clock::now(), loaded, compiled, finished;
+    ProgramCache cache(opts.cacheBudget);
+    try {
+        cache.load(opts.cacheFile);
+        loaded = Clock::now();
+        Compiler compiler;
+        auto code = cache.get(source, compiler, opts.optimize);
+        VM vm;
+        compiled = Clock::now();
+        // saved before running, so a runtime error keeps the entry
+        if (cache.stats().misses) cache.save(opts.cacheFile);
+        runStack(opts, vm, code.view(), name);
+        finished = Clock::now();
+    } catch (std::runtime_error& e) {
+        printError(name, e);
+        return 1;
+    }
+
+    if (opts.time) {
+        std::cout.flush();
+        report("read", started, read);
+        report("load cache", read, loaded);
+        report(cache.stats().hits ? "cache hit" : "compile", loaded, compiled);
+        report("first instruction", started, compiled);
+        report("run", compiled, finished);
+        report("total", started, finished);
+        printCacheStats(cache);
+    }
+    return 0;
+}
+
+// Whole-file mode: the program is compiled as one unit and run once, with
+// none of the REPL's printing.
+static int runFile(const Options& opts, Clock::time_point started) {
+    if (!opts.path.empty() && opts.path != "-" && Image::isImage(opts.path)) return runImage(opts, started);
+
+    const std::string name = inputName(opts);
+    std::string source;
+    if (!readSource(opts.path, source)) {
+        std::cerr << name << ": error: cannot read file\n";
+        return 1;
+    }
+
+    if (!opts.cacheFile.empty() && !opts.registerEngine) return runCached(opts, source, started);
+
+    Clock::time_point read = Clock::now(), lexed, parsed, compiled, finished;
+    try {
+        Lexer lexer(source);
+        auto tokens = lexer.tokenize();
+        lexed = Clock::now();
+
+        Parser parser(std::move(tokens));
+        auto program = parser.parse();
+        if (opts.optimize) foldConstants(program);
+        parsed = Clock::now();
+
+        if (opts.registerEngine) {
+            RegisterCompiler compiler;
+            auto code = compiler.compile(program);
+            if (opts.optimize) threadJumps(code);
+            RegisterVM vm;
+            compiled = Clock::now();
+            vm.run(code);
+            finished = Clock::now();
+        } else {
+            Compiler compiler;
+            auto code = compiler.compile(program);
+            if (opts.optimize) peephole(code);
+            VM vm;
+            compiled = Clock::now();
+            runStack(opts, vm, code.view(), name);
+            finished = Clock::now();
+        }
+    } catch (std::runtime_error& e) {
+        printError(name, e);
+        return 1;
+    }
+
+    if (opts.time) {
+        std::cout.flush();
+        report("read", started, read);
+        report("lex", read, lexed);
+        report(opts.optimize ? "parse + fold" : "parse", lexed, parsed);
+        report("compile", parsed, compiled);
+        report("first instruction", started, compiled);
+        report("run", compiled, finished);
+        report("total", started, finished);
+    }
+    return 0;
+}
+
+// compile: writes the program as a bytecode image instead of running it
+static int compileFile(const Options& opts) {
+    const std::string name = inputName(opts);
+    std::string source;
+    if (!readSource(opts.path, source)) {
+        std::cerr << name << ": error: cannot read file\n";
+        return 1;
+    }
+
+    try {
+        Lexer lexer(source);
+        Parser parser(lexer.tokenize());
+        auto program = parser.parse();
+        if (opts.optimize) foldConstants(program);
+
+        std::ofstream out(opts.output, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("cannot write " + opts.output);
+        if (opts.registerEngine) {
+            RegisterCompiler compiler;
+            auto code = compiler.compile(program);
+            if (opts.optimize) threadJumps(code);
+            writeImage(code, out);
+        } else {
+            Compiler compiler;
+            auto code = compiler.compile(program);
+            if (opts.optimize) peephole(code);
+            writeImage(code, out);
+        }
+    } catch (std::runtime_error& e) {
+        printError(name, e);
+        std::remove(opts.output.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+// Whole decimal number, nothing else
+static bool parseCount(const std::string& text, unsigned& value) {
+    auto end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+// One line of --time output for a batch: per-job times in microseconds
+static void reportLatency(const char* what, std::vector<double> us) {
+    std::sort(us.begin(), us.end());
+    auto at = [&](double q) { return us[static_cast<size_t>(q * (us.size() - 1))]; };
+    std::cerr << std::left << std::setw(20) << what << std::right << std::fixed << std::setprecision(1)
+              << "p50 " << at(0.5) << "  p95 " << at(0.95) << "  p99 " << at(0.99)
+              << "  max " << us.back() << " us\n";
+}
+
+// batch: compiles every script once and runs them all (each --repeat
+// times) on a pool of worker threads. Outputs are printed in command
+// line order, whole, whatever order the jobs finished in.
+static int runBatch(const Options& opts, Clock::time_point started) {
+    std::vector<std::string> sources(opts.paths.size());
+    for (size_t i = 0; i < opts.paths.size(); ++i) {
+        if (opts.paths[i] == "-" || !readSource(opts.paths[i], sources[i])) {
+            std::cerr << opts.paths[i] << ": error: cannot read file\n";
+            return 1;
+        }
+    }
+
+    std::unique_ptr<BatchRunner> pool;
+    try {
+        pool = std::make_unique<BatchRunner>(opts.threads, opts.optimize);
+    } catch (std::runtime_error& e) {
+        std::cerr << "batch: error: " << e.what() << "\n";
+        return 1;
+    }
+    BatchRunner& runner = *pool;
+    Clock::time_point read = Clock::now();
+    auto programs = runner.compile(opts.paths, sources);
+    Clock::time_point compiled = Clock::now();
+
+    std::vector<const BatchProgram*> jobs;
+    for (unsigned r = 0; r < opts.repeat; ++r)
+        for (const auto& p : programs) jobs.push_back(&p);
+    auto results = runner.run(jobs);
+    Clock::time_point finished = Clock::now();
+
+    int failed = 0;
+    for (const auto& r : results) {
+        std::cout << r.output;
+        if (!r.error.empty()) {
+            ++failed;
+            std::cout.flush();
+            std::cerr << r.error << "\n";
+        }
+    }
+
+    if (opts.time) {
+        std::cout.flush();
+        std::vector<double> latency, execution;
+        for (const auto& r : results) {
+            latency.push_back(r.latency * 1e6);
+            execution.push_back(r.seconds * 1e6);
+        }
+        double wall = std::chrono::duration<double>(finished - compiled).count();
+        std::cerr << jobs.size() << " jobs on " << runner.threads() << " threads, "
+                  << std::fixed << std::setprecision(0) << jobs.size() / wall << " jobs/s, "
+                  << runner.steals() << " stolen\n";
+        report("read", started, read);
+        report("compile", read, compiled);
+        report("run", compiled, finished);
+        if (!results.empty()) {
+            reportLatency("job latency", latency);
+            reportLatency("job execution", execution);
+        }
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    const auto started = Clock::now();
+
+    // -O: fold constants in the AST, thread jumps and run the peephole optimizer
+    // --engine=register: run on the register VM instead of the stack VM
+    // run [file|-]: execute a whole script or image instead of the REPL
+    // compile [file|-] -o out: write a bytecode image
+    // batch [-j N] [--repeat=N] file...: run many scripts on a thread pool
+    // --cache=file: reuse compiled code across REPL lines and runs (stack engine)
+    using Mode = Options::Mode;
+    Options opts;
+    int first = 1;
+    if (argc > 1 && std::string(argv[1]) == "run") opts.mode = Mode::Run;
+    else if (argc > 1 && std::string(argv[1]) == "compile") opts.mode = Mode::Compile;
+    else if (argc > 1 && std::string(argv[1]) == "batch") opts.mode = Mode::Batch;
+    if (opts.mode != Mode::Repl) first = 2;
+
+    bool ok = true;
+    for (int i = first; i < argc && ok; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-O") opts.optimize = true;
+        else if (arg == "--engine=stack") opts.registerEngine = false;
+        else if (arg == "--engine=register") opts.registerEngine = true;
+        else if (arg == "--time" && (opts.mode == Mode::Run || opts.mode == Mode::Batch)) opts.time = true;
+        else if (arg.rfind("--cache=", 0) == 0 && opts.mode != Mode::Compile && opts.mode != Mode::Batch) {
+            opts.cacheFile = arg.substr(8);
+            ok = !opts.cacheFile.empty();
+        }
+        else if (arg.rfind("--cache-budget=", 0) == 0 && opts.mode != Mode::Compile && opts.mode != Mode::Batch) {
+            unsigned mb = 0;
+            ok = parseCount(arg.substr(15), mb);
+            opts.cacheBudget = size_t(mb) << 20;
+        }
+        else if (arg == "-j" && opts.mode == Mode::Batch && i + 1 < argc) ok = parseCount(argv[++i], opts.threads);
+        else if (arg.rfind("--repeat=", 0) == 0 && opts.mode == Mode::Batch) ok = parseCount(arg.substr(9), opts.repeat) && opts.repeat > 0;
+        else if (opts.mode == Mode::Batch && arg[0] != '-') opts.paths.push_back(arg);
+        else if (arg.rfind("--profile", 0) == 0 && opts.mode == Mode::Run) {
+            opts.profile = true;
+            if (arg.size() > 9 && arg[9] == '=') opts.profileOutput = arg.substr(10);
+            else ok = arg.size() == 9;
+        }
+        else if (arg == "-o" && opts.mode == Mode::Compile && i + 1 < argc) opts.output = argv[++i];
+        else if (opts.mode != Mode::Repl && opts.path.empty() && (arg == "-" || arg[0] != '-')) opts.path = arg;
+        else ok = false;
+    }
+    if (ok && opts.mode == Mode::Batch && opts.registerEngine) {
+        std::cerr << "batch works with the stack engine only\n";
+        return 1;
+    }
+    if (ok && opts.profile && opts.registerEngine) {
+        std::cerr << "--profile works with the stack engine only\n";
+        return 1;
+    }
+    if (!ok || (opts.mode == Mode::Compile && opts.output.empty()) || (opts.mode == Mode::Batch && opts.paths.empty())) {
+        std::cerr << "Usage: Bytecode [-O] [--engine=stack|register] [--cache=file] [--cache-budget=MB]\n"
+                  << "       Bytecode run [-O] [--engine=stack|register] [--time] [--profile[=out.folded]]\n"
+                  << "                    [--cache=file] [--cache-budget=MB] [file|-]\n"
+                  << "       Bytecode compile [-O] [--engine=stack|register] [file|-] -o image.bvc\n"
+                  << "       Bytecode batch [-O] [-j threads] [--repeat=N] [--time] file...\n";
+        return 1;
+    }
+
+    switch (opts.mode) {
+        case Mode::Run: return runFile(opts, started);
+        case Mode::Compile: return compileFile(opts);
+        case Mode::Batch: return runBatch(opts, started);
+        default: return runRepl(opts);
+    }
+}
@@ -0,0 +1,326 @@
+#include "optimizer.h"
+#include "verifier.h"
+#include <cstdint>
+#include <limits>
+
+// CMP_xx ; JMP_IF_FALSE  ->  JMP_IF_NOT_xx
+// JMP_IF_TRUE is left alone: it would need the negated comparison, and
+// with doubles !(a < b) is not a >= b (NaN compares false both ways).
+static bool compareBranch(OpCode cmp, OpCode branch, OpCode& fused) {
+    if (branch != OpCode::JMP_IF_FALSE) return false;
+    switch (cmp) {
+        case OpCode::CMP_EQ:  fused = OpCode::JMP_IF_NOT_EQ;  return true;
+        case OpCode::CMP_NEQ: fused = OpCode::JMP_IF_NOT_NEQ; return true;
+        case OpCode::CMP_LT:  fused = OpCode::JMP_IF_NOT_LT;  return true;
+        case OpCode::CMP_LTE: fused = OpCode::JMP_IF_NOT_LTE; return true;
+        case OpCode::CMP_GT:  fused = OpCode::JMP_IF_NOT_GT;  return true;
+        case OpCode::CMP_GTE: fused = OpCode::JMP_IF_NOT_GTE; return true;
+        default: return false;
+    }
+}
+
+// Final destination of a jump to target: through any forward JMPs found
+// there. Back edges are left in place so the VM still passes each loop's
+// own JMP, which is where hot loops are counted for the JIT.
+template <typename Code, typename Target>
+static size_t threadTarget(const std::vector<Code>& code, size_t target, Target targetOf) {
+    // a forward chain ends after at most code.size() steps
+    while (target < code.size() && code[target].op == decltype(code[target].op)::JMP) {
+        size_t next = targetOf(code[target]);
+        if (next <= target) break;
+        target = next;
+    }
+    return target;
+}
+
+// A JMP leaves the stack alone, so skipping one changes no depth and a
+// verified chunk's maxStack still holds
+void threadJumps(Chunk& chunk) {
+    auto targetOf = [](const Instruction& in) { return static_cast<size_t>(in.arg); };
+    for (auto& in : chunk.code) {
+        if (isJump(in.op)) in.arg = static_cast<int32_t>(threadTarget(chunk.code, in.arg, targetOf));
+    }
+}
+
+void threadJumps(RegChunk& chunk) {
+    auto targetOf = [](const RegInstr& in) { return static_cast<size_t>(in.target()); };
+    for (auto& in : chunk.code) {
+        if (in.op == RegOp::JMP || in.op == RegOp::JMPT || in.op == RegOp::JMPF)
+            in.setTarget(static_cast<uint32_t>(threadTarget(chunk.code, in.target(), targetOf)));
+    }
+}
+
+// LOAD_VAR ; LOAD_CONST ; op  ->  op_VAR_CONST
+static bool varConstOp(OpCode op, OpCode& fused) {
+    switch (op) {
+        case OpCode::ADD: fused = OpCode::ADD_VAR_CONST; return true;
+        case OpCode::SUB: fused = OpCode::SUB_VAR_CONST; return true;
+        case OpCode::MUL: fused = OpCode::MUL_VAR_CONST; return true;
+        default: return false;
+    }
+}
+
+void peephole(Chunk& chunk) {
+    threadJumps(chunk);
+    const auto& in = chunk.code;
+    const size_t n = in.size();
+
+    // A sequence can only be merged if nothing jumps into its middle
+    std::vector<bool> isTarget(n + 1, false);
+    for (const auto& instr : in) {
+        if (isJump(instr.op)) isTarget[instr.arg] = true;
+    }
+    for (const Function& f : chunk.functions) isTarget[f.entry] = true;
+    auto clear = [&](size_t at, size_t len) {
+        if (at + len > n) return false;
+        for (size_t k = at + 1; k < at + len; ++k)
+            if (isTarget[k]) return false;
+        return true;
+    };
+
+    std::vector<Instruction> out;
+    out.reserve(n);
+    std::vector<int32_t> newIndex(n + 1);
+
+    for (size_t i = 0; i < n;) {
+        const size_t start = out.size();
+        size_t used = 1;
+        OpCode fused;
+
+        bool varConst = clear(i, 2) &&
+                        in[i].op == OpCode::LOAD_VAR &&
+                        in[i + 1].op == OpCode::LOAD_CONST &&
+                        in[i].arg <= std::numeric_limits<uint16_t>::max();
+
+        if (varConst) {
+            const auto slot = static_cast<uint16_t>(in[i].arg);
+            const int32_t k = in[i + 1].arg;
+
+            // x = x + k / x = x - k
+            if (clear(i, 4) &&
+                (in[i + 2].op == OpCode::ADD ||
+                 (in[i + 2].op == OpCode::SUB && k != std::numeric_limits<int32_t>::min())) &&
+                in[i + 3].op == OpCode::STORE_VAR && in[i + 3].arg == in[i].arg) {
+                out.push_back({OpCode::INC_VAR, in[i + 2].op == OpCode::ADD ? k : -k, slot});
+                used = 4;
+            }
+            else if (clear(i, 3) && varConstOp(in[i + 2].op, fused)) {
+                out.push_back({fused, k, slot});
+                used = 3;
+            }
+            else {
+                out.push_back({OpCode::LOAD_VAR_CONST, k, slot});
+                used = 2;
+            }
+        }
+        else if (clear(i, 2) && compareBranch(in[i].op, in[i + 1].op, fused)) {
+            out.push_back({fused, in[i + 1].arg});
+            used = 2;
+        }
+        // a jump to the next instruction does nothing (a conditional one
+        // still has to drop its operand)
+        else if (isJump(in[i].op) && static_cast<size_t>(in[i].arg) == i + 1 &&
+                 (in[i].op == OpCode::JMP || in[i].op == OpCode::JMP_IF_TRUE || in[i].op == OpCode::JMP_IF_FALSE)) {
+            if (in[i].op != OpCode::JMP) out.push_back({OpCode::POP});
+        }
+        else {
+            out.push_back(in[i]);
+        }
+
+        for (size_t k = 0; k < used; ++k) newIndex[i + k] = static_cast<int32_t>(start);
+        i += used;
+    }
+    newIndex[n] = static_cast<int32_t>(out.size());
+
+    for (auto& instr : out) {
+        if (isJump(instr.op)) instr.arg = newIndex[instr.arg];
+    }
+    for (Function& f : chunk.functions) {
+        f.entry = static_cast<uint32_t>(newIndex[f.entry]);
+        f.end = static_cast<uint32_t>(newIndex[f.end]);
+    }
+    chunk.code = std::move(out);
+
+    // a fused instruction keeps the position of its first part
+    PositionTable positions;
+    for (const auto& e : chunk.positions.entries) {
+        auto pc = static_cast<size_t>(newIndex[e.pc]);
+        if (positions.entries.empty() || positions.entries.back().pc != pc) positions.add(pc, e.pos);
+    }
+    chunk.positions = std::move(positions);
+
+    if (chunk.maxStack != unverifiedStack) verify(chunk);
+}
+
+// ---- AST constant folding ----
+
+// An int literal of the given value; identities like x+0 must not turn
+// an int x into a double or back
+static bool isNumber(const ASTNode* node, int value) {
+    auto num = node->as<NumberNode>();
+    return num && num->value.isInt() && num->value.asInt() == value;
+}
+
+// Evaluate a op b the way the VM does (see value.h). Returns false when
+// the operation has to stay in the program because it raises an error.
+static bool evalBinary(Op op, Value a, Value b, Value& result) {
+    switch (op) {
+        case Op::Add: result = add(a, b); break;
+        case Op::Sub: result = sub(a, b); break;
+        case Op::Mul: result = mul(a, b); break;
+        case Op::Div:
+        case Op::Mod:
+            if (isZero(b)) return false;
+            result = op == Op::Div ? divide(a, b) : modulo(a, b);
+            break;
+        case Op::Eq:  result = equal(a, b) ? 1 : 0; break;
+        case Op::Neq: result = !equal(a, b) ? 1 : 0; break;
+        case Op::Lt:  result = less(a, b) ? 1 : 0; break;
+        case Op::Lte: result = lessEqual(a, b) ? 1 : 0; break;
+        case Op::Gt:  result = less(b, a) ? 1 : 0; break;
+        case Op::Gte: result = lessEqual(b, a) ? 1 : 0; break;
+        case Op::And: result = a.truthy() && b.truthy() ? 1 : 0; break;
+        case Op::Or:  result = a.truthy() || b.truthy() ? 1 : 0; break;
+        default: return false;
+    }
+    return true;
+}
+
+namespace {
+// Rewrites the tree in place; replacement nodes come from the AST's arena
+struct Folder {
+    Arena& arena;
+
+    // A folded value keeps the position of the expression it replaces
+    ASTNode* number(Value value, SourcePos pos) {
+        auto num = arena.make<NumberNode>(value);
+        num->pos = pos;
+        return num;
+    }
+
+    ASTNode* emptyStmt(SourcePos pos) {
+        auto block = arena.make<BlockNode>(NodeList{});
+        block->pos = pos;
+        return block;
+    }
+
+    ASTNode* binary(BinaryOpNode* bin) {
+        bin->left = expr(bin->left);
+        bin->right = expr(bin->right);
+
+        auto l = bin->left->as<NumberNode>(), r = bin->right->as<NumberNode>();
+        // a constant left operand that decides && / || leaves the right
+        // one unevaluated, like the short-circuit code would
+        if (l && bin->op == Op::And && !l->value.truthy()) return number(0, bin->pos);
+        if (l && bin->op == Op::Or && l->value.truthy()) return number(1, bin->pos);
+        Value result;
+        if (l && r && evalBinary(bin->op, l->value, r->value, result))
+            return number(result, bin->pos);
+
+        // identities; the surviving operand is still evaluated, so any error
+        // it raises (e.g. an undefined variable) is kept. Not x + 0: a
+        // double -0.0 + 0 is 0.0.
+        Op op = bin->op;
+        if (op == Op::Sub && isNumber(bin->right, 0)) return bin->left;
+        if ((op == Op::Mul || op == Op::Div) && isNumber(bin->right, 1)) return bin->left;
+        if (op == Op::Mul && isNumber(bin->left, 1)) return bin->right;
+        return bin;
+    }
+
+    ASTNode* unary(UnaryOpNode* un) {
+        un->expr = expr(un->expr);
+        if (auto num = un->expr->as<NumberNode>()) {
+            if (un->op == Op::Not) return number(!num->value.truthy() ? 1 : 0, un->pos);
+            if (un->op == Op::Neg) return number(negate(num->value), un->pos);
+        }
+        return un;
+    }
+
+    ASTNode* expr(ASTNode* node) {
+        switch (node->kind) {
+            case NodeKind::Binary: return binary(static_cast<BinaryOpNode*>(node));
+            case NodeKind::Unary:  return unary(static_cast<UnaryOpNode*>(node));
+            // arrays only exist at runtime; their operands can still fold
+            case NodeKind::Array:
+                for (ASTNode*& e : static_cast<ArrayNode*>(node)->elements) e = expr(e);
+                return node;
+            case NodeKind::Index: {
+                auto index = static_cast<IndexNode*>(node);
+                index->array = expr(index->array);
+                index->index = expr(index->index);
+                return node;
+            }
+            case NodeKind::Call:
+                for (ASTNode*& a : static_cast<CallNode*>(node)->args) a = expr(a);
+                return node;
+            default:               return node;
+        }
+    }
+
+    ASTNode* stmt(ASTNode* node) {
+        switch (node->kind) {
+            case NodeKind::Assignment: {
+                auto assign = static_cast<AssignmentNode*>(node);
+                assign->expr = expr(assign->expr);
+                return node;
+            }
+            case NodeKind::Print: {
+                auto print = static_cast<PrintNode*>(node);
+                print->expr = expr(print->expr);
+                return node;
+            }
+            case NodeKind::If: {
+                auto iff = static_cast<IfNode*>(node);
+                iff->condition = expr(iff->condition);
+                if (auto cond = iff->condition->as<NumberNode>()) {
+                    // only the taken branch survives
+                    ASTNode* taken = cond->value.truthy() ? iff->thenBranch : iff->elseBranch;
+                    return taken ? stmt(taken) : emptyStmt(iff->pos);
+                }
+                iff->thenBranch = stmt(iff->thenBranch);
+                if (iff->elseBranch) iff->elseBranch = stmt(iff->elseBranch);
+                return node;
+            }
+            case NodeKind::While: {
+                auto wh = static_cast<WhileNode*>(node);
+                wh->condition = expr(wh->condition);
+                auto cond = wh->condition->as<NumberNode>();
+                if (cond && !cond->value.truthy()) return emptyStmt(wh->pos);
+                wh->body = stmt(wh->body);
+                return node;
+            }
+            case NodeKind::Block: {
+                auto block = static_cast<BlockNode*>(node);
+                for (ASTNode*& s : block->statements) s = stmt(s);
+                return node;
+            }
+            case NodeKind::Function: {
+                auto fn = static_cast<FunctionNode*>(node);
+                fn->body = stmt(fn->body);
+                return node;
+            }
+            case NodeKind::Return: {
+                auto ret = static_cast<ReturnNode*>(node);
+                if (ret->expr) ret->expr = expr(ret->expr);
+                return node;
+            }
+            default:
+                // expression statement
+                return expr(node);
+        }
+    }
+};
+}
+
+void foldConstants(Ast& program) {
+    Folder folder{program.arena};
+    size_t kept = 0;
+    for (ASTNode* stmt : program.statements) {
+        ASTNode* folded = folder.stmt(stmt);
+        // drop statements that folded away entirely
+        auto block = folded->as<BlockNode>();
+        if (block && block->statements.empty()) continue;
+        program.statements[kept++] = folded;
+    }
+    program.statements.resize(kept);
+}
@@ -0,0 +1,7 @@
+#include "output.h"
+#include <cstdio>
+
+void StdoutSink::write(const char* data, size_t size) {
+    std::fwrite(data, 1, size, stdout);
+    std::fflush(stdout);
+}
@@ -1,55 +1,89 @@
 #include "parser.h"
+#include <algorithm>
+#include <charconv>
 #include <stdexcept>
+#include <string>
+#include <utility>
 
-Parser::Parser(const std::vector<Token>& toks) : tokens(toks), pos(0) {}
+Parser::Parser(std::vector<Token> toks) : tokens(std::move(toks)), pos(0) {
+    // The lexer ends every stream with EndOfFile; make sure of it, so the
+    // parser can stop on that token instead of running off the end
+    if (tokens.empty() || tokens.back().type != TokenType::EndOfFile)
+        tokens.emplace_back(TokenType::EndOfFile, "", tokens.empty() ? SourcePos{} : tokens.back().pos);
+}
 
 const Token& Parser::peek() {
-    if (pos < tokens.size()) return tokens[pos];
-    static Token eof(TokenType::EndOfFile, "");
-    return eof;
+    return tokens[pos];
 }
 
 const Token& Parser::get() {
-    if (pos < tokens.size()) return tokens[pos++];
-    static Token eof(TokenType::EndOfFile, "");
-    return eof;
+    // EndOfFile is never consumed, so reading past it repeats it
+    const Token& t = tokens[pos];
+    if (pos + 1 < tokens.size()) ++pos;
+    return t;
+}
+
+const Token& Parser::expect(TokenType type, const char* message) {
+    if (peek().type != type) error(message);
+    return get();
+}
+
+void Parser::error(const std::string& message) {
+    throw SourceError(message, peek().pos);
 }
 
-std::vector<std::unique_ptr<ASTNode>> Parser::parse() {
-    std::vector<std::unique_ptr<ASTNode>> stmts;
+Ast Parser::parse() {
     while (peek().type != TokenType::EndOfFile) {
-        stmts.push_back(statement());
+        ast.statements.push_back(statement());
     }
-    return stmts;
+    return std::move(ast);
+}
+
+Ast Parser::parseExpression() {
+    ast.statements.push_back(expression());
+    if (peek().type != TokenType::EndOfFile) error("Expected end of expression");
+    return std::move(ast);
 }
 
-std::unique_ptr<ASTNode> Parser::statement() {
+ASTNode* Parser::statement() {
     // NEW: if and while statements (single-statement bodies)
     if (peek().type == TokenType::Keyword && peek().value == "if") {
-        get(); // consume 'if'
-        if (get().type != TokenType::LParen) throw std::runtime_error("Expected '(' after if");
+        SourcePos pos = get().pos; // consume 'if'
+        expect(TokenType::LParen, "Expected '(' after if");
         auto cond = expression();
-        if (get().type != TokenType::RParen) throw std::runtime_error("Expected ')' after if condition");
+        expect(TokenType::RParen, "Expected ')' after if condition");
 
         auto thenStmt = statement();
-        std::unique_ptr<ASTNode> elseStmt = nullptr;
+        ASTNode* elseStmt = nullptr;
         if (peek().type == TokenType::Keyword && peek().value == "else") {
             get(); // consume 'else'
             elseStmt = statement();
         }
-        return std::make_unique<IfNode>(std::move(cond), std::move(thenStmt), std::move(elseStmt)); // [7]
+        return node<IfNode>(pos, cond, thenStmt, elseStmt); // [7]
     }
     if (peek().type == TokenType::Keyword && peek().value == "while") {
-        get(); // consume 'while'
-        if (get().type != TokenType::LParen) throw std::runtime_error("Expected '(' after while");
+        SourcePos pos = get().pos; // consume 'while'
+        expect(TokenType::LParen, "Expected '(' after while");
         auto cond = expression();
-        if (get().type != TokenType::RParen) throw std::runtime_error("Expected ')' after while condition");
+        expect(TokenType::RParen, "Expected ')' after while condition");
 
         auto body = statement();
-        return std::make_unique<WhileNode>(std::move(cond), std::move(body)); // [15]
+        return node<WhileNode>(pos, cond, body); // [15]
+    }
+
+    if (peek().type == TokenType::Keyword && peek().value == "func") {
+        return functionDecl();
+    }
+    if (peek().type == TokenType::Keyword && peek().value == "return") {
+        return returnStmt();
     }
 
-    if (peek().type == TokenType::Identifier) {
+    if (peek().type == TokenType::LBrace) {
+        return block();
+    }
+    // a call or an index starts an expression statement
+    if (peek().type == TokenType::Identifier &&
+        tokens[pos + 1].type != TokenType::LParen && tokens[pos + 1].type != TokenType::LBracket) {
         return assignment();
     }
     else if (peek().type == TokenType::Keyword && peek().value == "print") {
@@ -58,115 +92,249 @@ std::unique_ptr<ASTNode> Parser::statement() {
     else {
         // NEW: allow expression statements like "2+2;"
         auto exprNode = expression();
-        if (get().type != TokenType::Semicolon)
-            throw std::runtime_error("Expected semicolon after expression");
+        if (exprNode->kind == NodeKind::Index && peek().type == TokenType::Assign)
+            error("Array elements cannot be assigned");
+        expect(TokenType::Semicolon, "Expected semicolon after expression");
         return exprNode;
     }
 }
 
-std::unique_ptr<ASTNode> Parser::assignment() {
-    std::string name = get().value;
-    if (peek().type != TokenType::Assign)
-    throw std::runtime_error("Expected '=' after identifier");
-    get(); // consume '='
+ASTNode* Parser::assignment() {
+    const Token& name = get();
+    expect(TokenType::Assign, "Expected '=' after identifier");
 
     auto exprNode = expression();
-    if (get().type != TokenType::Semicolon)
-        throw std::runtime_error("Expected semicolon in assignment");
-    return std::make_unique<AssignmentNode>(name, std::move(exprNode));
+    expect(TokenType::Semicolon, "Expected semicolon in assignment");
+    return node<AssignmentNode>(name.pos, ast.arena.copy(name.value), exprNode);
 }
 
-std::unique_ptr<ASTNode> Parser::printStmt() {
-    get(); // consume 'print'
+ASTNode* Parser::printStmt() {
+    SourcePos pos = get().pos; // consume 'print'
     auto exprNode = expression();
-    if (get().type != TokenType::Semicolon)
-    throw std::runtime_error("Expected semicolon after print");
+    expect(TokenType::Semicolon, "Expected semicolon after print");
 
-    return std::make_unique<PrintNode>(std::move(exprNode));
+    return node<PrintNode>(pos, exprNode);
 }
 
-std::unique_ptr<ASTNode> Parser::expression() {
-    return logicalOr();  // top-level entry for logical expressions
+// Every assignment under node, in source order
+static void collectAssignments(ASTNode* node, std::vector<ASTNode*>& out) {
+    switch (node->kind) {
+        case NodeKind::Assignment:
+            out.push_back(node);
+            return;
+        case NodeKind::If: {
+            auto iff = static_cast<IfNode*>(node);
+            collectAssignments(iff->thenBranch, out);
+            if (iff->elseBranch) collectAssignments(iff->elseBranch, out);
+            return;
+        }
+        case NodeKind::While:
+            collectAssignments(static_cast<WhileNode*>(node)->body, out);
+            return;
+        case NodeKind::Block:
+            for (ASTNode* stmt : static_cast<BlockNode*>(node)->statements) collectAssignments(stmt, out);
+            return;
+        default:
+            return;
+    }
 }
 
-// Logical OR (||)
-std::unique_ptr<ASTNode> Parser::logicalOr() {
-    auto node = logicalAnd();
-    while (peek().type == TokenType::Operator && peek().value == "||") {
-        std::string op = get().value;
-        auto rhs = logicalAnd();
-        node = std::make_unique<BinaryOpNode>(op, std::move(node), std::move(rhs));
+ASTNode* Parser::functionDecl() {
+    SourcePos pos = get().pos; // consume 'func'
+    const Token& name = expect(TokenType::Identifier, "Expected function name after func");
+    expect(TokenType::LParen, "Expected '(' after function name");
+    size_t first = pending.size();
+    if (peek().type != TokenType::RParen) {
+        while (true) {
+            const Token& param = expect(TokenType::Identifier, "Expected parameter name");
+            pending.push_back(node<IdentifierNode>(param.pos, ast.arena.copy(param.value)));
+            if (peek().type != TokenType::Comma) break;
+            get(); // consume ','
+        }
     }
-    return node;
+    expect(TokenType::RParen, "Expected ',' or ')' after parameter");
+    NodeList params = take(first);
+    if (peek().type != TokenType::LBrace) error("Expected '{' before function body");
+    ASTNode* body = block();
+    first = pending.size();
+    collectAssignments(body, pending);
+    NodeList assignments = take(first);
+    return node<FunctionNode>(pos, ast.arena.copy(name.value), params, body, assignments);
+}
+
+ASTNode* Parser::returnStmt() {
+    SourcePos pos = get().pos; // consume 'return'
+    ASTNode* exprNode = nullptr;
+    if (peek().type != TokenType::Semicolon) exprNode = expression();
+    expect(TokenType::Semicolon, "Expected semicolon after return");
+    return node<ReturnNode>(pos, exprNode);
 }
 
-// Logical AND (&&)
-std::unique_ptr<ASTNode> Parser::logicalAnd() {
-    auto node = comparison();
-    while (peek().type == TokenType::Operator && peek().value == "&&") {
-        std::string op = get().value;
-        auto rhs = comparison();
-        node = std::make_unique<BinaryOpNode>(op, std::move(node), std::move(rhs));
+ASTNode* Parser::block() {
+    SourcePos pos = get().pos; // consume '{'
+    size_t first = pending.size();
+    while (peek().type != TokenType::RBrace) {
+        if (peek().type == TokenType::EndOfFile)
+            error("Expected '}' at end of block");
+        ASTNode* stmt = statement();
+        pending.push_back(stmt);
     }
-    return node;
+    get(); // consume '}'
+    return node<BlockNode>(pos, take(first));
 }
 
-// Comparison operators (==, !=, <, <=, >, >=)
-std::unique_ptr<ASTNode> Parser::comparison() {
-    auto node = additive();
-    while (peek().type == TokenType::Operator &&
-           (peek().value == "==" || peek().value == "!=" ||
-            peek().value == "<"  || peek().value == "<=" ||
-            peek().value == ">"  || peek().value == ">=")) {
-        std::string op = get().value;
-        auto rhs = additive();
-        node = std::make_unique<BinaryOpNode>(op, std::move(node), std::move(rhs));
+NodeList Parser::take(size_t first) {
+    NodeList nodes;
+    nodes.count = pending.size() - first;
+    nodes.items = ast.arena.array<ASTNode*>(nodes.count);
+    std::copy(pending.begin() + first, pending.end(), nodes.items);
+    pending.resize(first);
+    return nodes;
+}
+
+NodeList Parser::list(TokenType close, const char* message) {
+    size_t first = pending.size();
+    uint32_t tallest = 0;
+    if (peek().type != close) {
+        while (true) {
+            ASTNode* item = expression();
+            tallest = std::max(tallest, height);
+            pending.push_back(item);
+            if (peek().type != TokenType::Comma) break;
+            get(); // consume ','
+        }
     }
-    return node;
+    if (peek().type != close) error(message);
+    get();
+    height = tallest;
+    return take(first);
+}
+
+// Binding power of each binary operator, indexed by Op; higher binds
+// tighter and 0 means the operator never appears between operands. All of
+// them are left-associative.
+static const uint8_t binaryPrecedence[] = {
+    4, 4, 5, 5, 5,          // + - * / %
+    3, 3, 3, 3, 3, 3,       // == != < <= > >=
+    2, 1,                   // && ||
+    0, 0, 0,                // ! (unary) - (unary) none
+};
+static_assert(sizeof binaryPrecedence == static_cast<size_t>(Op::None) + 1, "one entry per Op");
+
+void Parser::enter(SourcePos at) {
+    if (++nesting > maxExpressionDepth) throw SourceError("Expression nested too deeply", at);
 }
 
-// Additive operators (+, -)
-std::unique_ptr<ASTNode> Parser::additive() {
-    auto node = term();
-    while (peek().type == TokenType::Operator &&
-           (peek().value == "+" || peek().value == "-")) {
-        std::string op = get().value;
-        auto rhs = term();
-        node = std::make_unique<BinaryOpNode>(op, std::move(node), std::move(rhs));
+ASTNode* Parser::expression(int minPrecedence) {
+    ASTNode* lhs = prefix();
+    uint32_t lhsHeight = height;
+    while (true) {
+        const Token& op = peek();
+        if (op.type != TokenType::Operator) break;
+        int precedence = binaryPrecedence[static_cast<size_t>(op.op)];
+        if (precedence < minPrecedence || precedence == 0) break;
+        get();
+        // operators of the same precedence are left to the loop here, so
+        // a long chain like a + b + c + ... does not recurse
+        ASTNode* rhs = expression(precedence + 1);
+        lhsHeight = std::max(lhsHeight, height) + 1;
+        if (lhsHeight > maxExpressionDepth) throw SourceError("Expression nested too deeply", op.pos);
+        lhs = node<BinaryOpNode>(op.pos, op.op, lhs, rhs);
     }
-    return node;
+    height = lhsHeight;
+    return lhs;
 }
 
-std::unique_ptr<ASTNode> Parser::term() {
-    auto node = factor();
-    while (peek().type == TokenType::Operator &&
-           (peek().value == "*" || peek().value == "/" || peek().value == "%")) {
-        std::string op = get().value;
-        auto rhs = factor();
-        node = std::make_unique<BinaryOpNode>(op, std::move(node), std::move(rhs));
+ASTNode* Parser::prefix() {
+    const Token& tok = peek();
+    switch (tok.type) {
+    case TokenType::Operator:
+        if (tok.op == Op::Not || tok.op == Op::Sub) {
+            get();
+            enter(tok.pos);
+            ASTNode* operand = prefix();
+            --nesting;
+            ++height;
+            return node<UnaryOpNode>(tok.pos, tok.op == Op::Not ? Op::Not : Op::Neg, operand);
+        }
+        break;
+    default:
+        break;
     }
-    return node;
+    return primary();
 }
 
-std::unique_ptr<ASTNode> Parser::factor() {
-    if (peek().type == TokenType::Operator && peek().value == "!") {
-        get(); // consume '!'
-        auto node = factor();
-        return std::make_unique<UnaryOpNode>("!", std::move(node));
+ASTNode* Parser::primary() {
+    const Token& tok = peek();
+    ASTNode* result = nullptr;
+    switch (tok.type) {
+    case TokenType::Number: {
+        get();
+        // the lexer only lets '.', 'e' and 'E' into a double literal
+        Value val;
+        auto begin = tok.value.data(), end = begin + tok.value.size();
+        std::errc ec;
+        if (tok.value.find_first_of(".eE") != std::string_view::npos) {
+            double d = 0;
+            ec = std::from_chars(begin, end, d).ec;
+            val = d;
+        } else {
+            int i = 0;
+            ec = std::from_chars(begin, end, i).ec;
+            val = i;
+        }
+        if (ec != std::errc())
+            throw SourceError("Number out of range: " + std::string(tok.value), tok.pos);
+        height = 1;
+        result = node<NumberNode>(tok.pos, val);
+        break;
     }
-    else if (peek().type == TokenType::Number) {
-        int val = std::stoi(get().value);
-        return std::make_unique<NumberNode>(val);
+    case TokenType::Identifier:
+        get();
+        if (peek().type == TokenType::LParen) {
+            get(); // consume '('
+            enter(tok.pos);
+            NodeList args = list(TokenType::RParen, "Expected ',' or ')' in call");
+            --nesting;
+            ++height;
+            result = node<CallNode>(tok.pos, ast.arena.copy(tok.value), args);
+            break;
+        }
+        height = 1;
+        result = node<IdentifierNode>(tok.pos, ast.arena.copy(tok.value));
+        break;
+    case TokenType::LParen: {
+        get(); // consume '('
+        enter(tok.pos);
+        result = expression();
+        --nesting;
+        expect(TokenType::RParen, "Expected ')'");
+        break;
     }
-    else if (peek().type == TokenType::Identifier) {
-        return std::make_unique<IdentifierNode>(get().value);
+    case TokenType::LBracket: {
+        get(); // consume '['
+        enter(tok.pos);
+        NodeList elements = list(TokenType::RBracket, "Expected ',' or ']' in array");
+        --nesting;
+        ++height;
+        result = node<ArrayNode>(tok.pos, elements);
+        break;
     }
-    else if (peek().type == TokenType::LParen) {
-        get(); // consume '('
-        auto exprNode = expression();
-        if (get().type != TokenType::RParen)
-            throw std::runtime_error("Expected ')'");
-        return exprNode;
+    default:
+        error("Unexpected token in factor: " + std::string(tok.value));
+    }
+
+    // postfix [index], looping so a[i][j] does not recurse
+    while (peek().type == TokenType::LBracket) {
+        const Token& open = get();
+        uint32_t arrayHeight = height;
+        enter(open.pos);
+        ASTNode* index = expression();
+        --nesting;
+        expect(TokenType::RBracket, "Expected ']' after index");
+        height = std::max(arrayHeight, height) + 1;
+        if (height > maxExpressionDepth) throw SourceError("Expression nested too deeply", open.pos);
+        result = node<IndexNode>(open.pos, result, index);
     }
-    throw std::runtime_error("Unexpected token in factor: " + peek().value);
+    return result;
 }
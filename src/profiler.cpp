@@ -0,0 +1,138 @@
+#include "profiler.h"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+
+void Profiler::begin(const ChunkView& chunk) {
+    ops.resize(chunk.size);
+    loops.clear();
+    for (size_t pc = 0; pc < chunk.size; ++pc) {
+        const Instruction& in = chunk.code[pc];
+        ops[pc] = in.op;
+        // every loop ends in a backward JMP to its condition
+        if (in.op == OpCode::JMP && static_cast<size_t>(in.arg) <= pc) loops.push_back({static_cast<size_t>(in.arg), pc});
+    }
+    std::sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+        return a.head != b.head ? a.head < b.head : a.backEdge > b.backEdge;
+    });
+    positions.assign(chunk.positions.entries, chunk.positions.entries + chunk.positions.count);
+    counts.assign(chunk.size, 0);
+    ticks.assign(chunk.size, 0);
+    last = noPc;
+
+    startTime = std::chrono::steady_clock::now();
+    startTick = now();
+}
+
+void Profiler::end() {
+    uint64_t t = now();
+    if (last != noPc) ticks[last] += t - lastTick;
+    last = noPc;
+
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count();
+    nsPerTick = t > startTick ? elapsed / static_cast<double>(t - startTick) : 1.0;
+}
+
+SourcePos Profiler::at(size_t pc) const {
+    return PositionView{positions.data(), positions.size()}.at(pc);
+}
+
+uint64_t Profiler::instructions() const {
+    uint64_t total = 0;
+    for (uint64_t c : counts) total += c;
+    return total;
+}
+
+void Profiler::report(std::ostream& out, const std::string& name, size_t top) const {
+    uint64_t total = 0;
+    for (uint64_t t : ticks) total += t;
+    auto ms = [&](uint64_t t) { return ns(t) / 1e6; };
+    auto share = [&](uint64_t t) { return total ? 100.0 * t / total : 0.0; };
+
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(2);
+    out << "profile: " << instructions() << " instructions, " << ms(total) << " ms\n";
+
+    struct Row { std::string where; uint64_t time, count; };
+    auto print = [&](const char* title, const char* countTitle, std::vector<Row>& rows, size_t limit) {
+        std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.time > b.time; });
+        if (rows.size() > limit) rows.resize(limit);
+        out << "\n" << std::left << std::setw(32) << title << std::right
+            << std::setw(12) << "time(ms)" << std::setw(9) << "share" << std::setw(14) << countTitle << "\n";
+        for (const auto& r : rows)
+            out << "  " << std::left << std::setw(30) << r.where << std::right
+                << std::setw(12) << ms(r.time) << std::setw(8) << share(r.time) << "%"
+                << std::setw(14) << r.count << "\n";
+    };
+
+    // time and executed instructions per source line
+    std::map<uint32_t, Row> byLine;
+    for (size_t pc = 0; pc < ops.size(); ++pc) {
+        if (!counts[pc]) continue;
+        Row& r = byLine[at(pc).line];
+        r.time += ticks[pc];
+        r.count += counts[pc];
+    }
+    std::vector<Row> lines;
+    for (auto& [line, r] : byLine) {
+        r.where = name + ":" + std::to_string(line);
+        lines.push_back(r);
+    }
+    print("hottest lines", "executed", lines, top);
+
+    // a loop's time includes the loops nested in it; its back edge runs
+    // once per iteration
+    std::vector<Row> hotLoops;
+    for (const Loop& l : loops) {
+        Row r{"", 0, counts[l.backEdge]};
+        for (size_t pc = l.head; pc <= l.backEdge; ++pc) r.time += ticks[pc];
+        if (!r.time) continue;
+        SourcePos pos = at(l.head);
+        r.where = name + ":" + std::to_string(pos.line) + ":" + std::to_string(pos.column);
+        hotLoops.push_back(r);
+    }
+    if (!hotLoops.empty()) print("hottest loops", "iterations", hotLoops, top);
+
+    std::vector<Row> byOp(OPCODE_COUNT);
+    for (size_t pc = 0; pc < ops.size(); ++pc) {
+        Row& r = byOp[static_cast<size_t>(ops[pc])];
+        r.time += ticks[pc];
+        r.count += counts[pc];
+    }
+    std::vector<Row> opRows;
+    for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+        if (!byOp[op].count) continue;
+        byOp[op].where = opcodeToString(static_cast<OpCode>(op));
+        opRows.push_back(byOp[op]);
+    }
+    print("opcodes", "executed", opRows, OPCODE_COUNT);
+    out.flags(flags);
+}
+
+void Profiler::writeCollapsed(std::ostream& out) const {
+    std::map<std::string, double> stacks;
+    std::vector<const Loop*> open;     // loops containing pc, outermost first
+    std::vector<std::string> frames{"main"};
+    size_t next = 0;
+    for (size_t pc = 0; pc < ops.size(); ++pc) {
+        while (!open.empty() && open.back()->backEdge < pc) {
+            open.pop_back();
+            frames.pop_back();
+        }
+        for (; next < loops.size() && loops[next].head == pc; ++next) {
+            open.push_back(&loops[next]);
+            SourcePos pos = at(pc);
+            frames.push_back("loop " + std::to_string(pos.line) + ":" + std::to_string(pos.column));
+        }
+        if (!ticks[pc]) continue;
+
+        std::string stack;
+        for (const auto& f : frames) stack += f + ";";
+        stack += "line " + std::to_string(at(pc).line) + ";" + opcodeToString(ops[pc]);
+        stacks[stack] += ns(ticks[pc]);
+    }
+    for (const auto& [stack, time] : stacks) {
+        auto value = static_cast<uint64_t>(time + 0.5);
+        if (value) out << stack << " " << value << "\n";
+    }
+}
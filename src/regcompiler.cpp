@@ -0,0 +1,351 @@
+#include "regcompiler.h"
+#include "compiler.h"
+#include <limits>
+#include <stdexcept>
+
+static const size_t maxRegister = std::numeric_limits<uint16_t>::max();
+
+RegChunk RegisterCompiler::compile(const Ast& program) {
+    RegChunk chunk;
+    out = &chunk;
+    constantIndex.clear();
+
+    // Variables assigned anywhere in this program get their slots up
+    // front so temporaries can start right after the last variable.
+    size_t previous = symbolTable.size();
+    for (const ASTNode* stmt : program.statements) declareTargets(stmt);
+    if (symbolTable.size() > maxRegister) throw std::runtime_error("Too many variables");
+
+    declared.assign(symbolTable.size(), 0);
+    for (size_t i = 0; i < previous; ++i) declared[i] = 1;
+    // Earlier runs may or may not have assigned a slot, so nothing is
+    // definitely assigned on entry; CHECK guards the first read.
+    known.assign(symbolTable.size(), 0);
+    firstTemp = nextTemp = symbolTable.size();
+    chunk.numRegisters = firstTemp;
+
+    for (const ASTNode* stmt : program.statements) compileStmt(stmt);
+
+    chunk.names = symbolTable.names();
+    out = nullptr;
+    return chunk;
+}
+
+void RegisterCompiler::declareTargets(const ASTNode* node) {
+    switch (node->kind) {
+        case NodeKind::Assignment: {
+            auto assign = static_cast<const AssignmentNode*>(node);
+            symbolTable.declare(assign->varName);
+            break;
+        }
+        case NodeKind::If: {
+            auto iff = static_cast<const IfNode*>(node);
+            declareTargets(iff->thenBranch);
+            if (iff->elseBranch) declareTargets(iff->elseBranch);
+            break;
+        }
+        case NodeKind::While: {
+            auto wh = static_cast<const WhileNode*>(node);
+            declareTargets(wh->body);
+            break;
+        }
+        case NodeKind::Block: {
+            auto block = static_cast<const BlockNode*>(node);
+            for (const ASTNode* stmt : block->statements) declareTargets(stmt);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// ---- emit helpers ----
+
+uint16_t RegisterCompiler::allocTemp() {
+    if (nextTemp >= maxRegister) throw std::runtime_error("Expression needs too many registers");
+    auto reg = static_cast<uint16_t>(nextTemp++);
+    if (nextTemp > out->numRegisters) out->numRegisters = nextTemp;
+    return reg;
+}
+
+uint16_t RegisterCompiler::constant(int value) {
+    auto it = constantIndex.find(value);
+    if (it != constantIndex.end()) return it->second;
+    if (out->constants.size() >= maxRegister) throw std::runtime_error("Too many constants");
+    auto idx = static_cast<uint16_t>(out->constants.size());
+    out->constants.push_back(value);
+    constantIndex.emplace(value, idx);
+    return idx;
+}
+
+// Registers hold ints only, so a double literal stops the compile
+uint16_t RegisterCompiler::constant(const NumberNode* num) {
+    if (!num->value.isInt()) throw SourceError("Floating-point numbers need the stack engine", num->pos);
+    return constant(num->value.asInt());
+}
+
+size_t RegisterCompiler::emit(RegOp op, uint16_t a, uint16_t b, uint16_t c) {
+    RegInstr in{op};
+    in.a = a;
+    in.b = b;
+    in.c = c;
+    out->code.push_back(in);
+    return out->code.size() - 1;
+}
+
+void RegisterCompiler::mark(const ASTNode* node) {
+    out->positions.add(out->code.size(), node->pos);
+}
+
+void RegisterCompiler::patch(size_t at, size_t target) {
+    out->code[at].setTarget(static_cast<uint32_t>(target));
+}
+
+// Jumps whose target is not known yet are chained through their target:
+// each holds the index of the previous one and noJump ends the list.
+static const uint32_t noJump = UINT32_MAX;
+
+uint32_t RegisterCompiler::chain(RegOp op, uint16_t a, uint32_t list) {
+    size_t at = emit(op, a);
+    out->code[at].setTarget(list);
+    return static_cast<uint32_t>(at);
+}
+
+void RegisterCompiler::patchList(uint32_t list, size_t target) {
+    while (list != noJump) {
+        uint32_t next = out->code[list].target();
+        patch(list, target);
+        list = next;
+    }
+}
+
+// ---- conditions ----
+
+uint32_t RegisterCompiler::compileJump(const ASTNode* cond, bool jumpIf, uint32_t list) {
+    switch (cond->kind) {
+        case NodeKind::Binary: {
+            auto bin = static_cast<const BinaryOpNode*>(cond);
+            if (bin->op != Op::And && bin->op != Op::Or) break;
+            bool isOr = bin->op == Op::Or;
+            uint32_t skip = noJump;
+            if (jumpIf == isOr) {
+                // either operand alone is enough to take the jump
+                list = compileJump(bin->left, jumpIf, list);
+            } else {
+                // the left operand alone can decide the other way, skipping the right
+                skip = compileJump(bin->left, isOr, noJump);
+            }
+            // the right operand may not run, so what it checks is not known after
+            auto before = known;
+            list = compileJump(bin->right, jumpIf, list);
+            known = before;
+            patchList(skip, out->code.size());
+            return list;
+        }
+        case NodeKind::Unary: {
+            auto un = static_cast<const UnaryOpNode*>(cond);
+            if (un->op == Op::Not) return compileJump(un->expr, !jumpIf, list);
+            break;
+        }
+        case NodeKind::Number:
+            // known outcome: an unconditional jump or nothing at all
+            if (static_cast<const NumberNode*>(cond)->value.truthy() == jumpIf) return chain(RegOp::JMP, 0, list);
+            return list;
+        default:
+            break;
+    }
+    size_t top = nextTemp;
+    uint16_t c = compileExpr(cond);
+    nextTemp = top;
+    return chain(jumpIf ? RegOp::JMPT : RegOp::JMPF, c, list);
+}
+
+// ---- expressions ----
+
+// Register and register-constant forms of each binary operator, indexed
+// by Op; withConst == reg when there is no constant form
+struct BinaryOps { RegOp reg, withConst; };
+static const BinaryOps binaryOps[] = {
+    {RegOp::ADD, RegOp::ADDK}, {RegOp::SUB, RegOp::SUBK},
+    {RegOp::MUL, RegOp::MULK}, {RegOp::DIV, RegOp::DIVK},
+    {RegOp::MOD, RegOp::MODK},
+    {RegOp::EQ,  RegOp::EQK},  {RegOp::NEQ, RegOp::NEQK},
+    {RegOp::LT,  RegOp::LTK},  {RegOp::LTE, RegOp::LTEK},
+    {RegOp::GT,  RegOp::GTK},  {RegOp::GTE, RegOp::GTEK},
+    {RegOp::AND, RegOp::AND},  {RegOp::OR,  RegOp::OR},
+};
+static_assert(sizeof binaryOps / sizeof binaryOps[0] == binaryOpCount, "one entry per binary Op");
+
+uint16_t RegisterCompiler::compileExpr(const ASTNode* node, int dst) {
+    mark(node);
+    switch (node->kind) {
+        case NodeKind::Number: {
+            auto num = static_cast<const NumberNode*>(node);
+            uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+            emit(RegOp::LOADK, d, constant(num));
+            return d;
+        }
+        case NodeKind::Identifier: {
+            auto id = static_cast<const IdentifierNode*>(node);
+            int32_t slot = symbolTable.lookup(id->name);
+            if (slot < 0 || !declared[slot]) throw SourceError("Undefined variable: " + std::string(id->name), id->pos);
+            auto var = static_cast<uint16_t>(slot);
+            if (!known[var]) {
+                emit(RegOp::CHECK, var);
+                known[var] = 1;
+            }
+            if (dst >= 0 && dst != var) {
+                emit(RegOp::MOVE, static_cast<uint16_t>(dst), var);
+                return static_cast<uint16_t>(dst);
+            }
+            return var;
+        }
+        case NodeKind::Binary: {
+            auto bin = static_cast<const BinaryOpNode*>(node);
+            if (bin->op == Op::And || bin->op == Op::Or) {
+                // short-circuit; dst is only written once both operands are done
+                uint32_t falses = compileJump(bin, false, noJump);
+                uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+                emit(RegOp::LOADK, d, constant(1));
+                size_t end = emit(RegOp::JMP);
+                patchList(falses, out->code.size());
+                emit(RegOp::LOADK, d, constant(0));
+                patch(end, out->code.size());
+                return d;
+            }
+            if (!isBinary(bin->op))
+                throw std::runtime_error(std::string("Unknown binary operator: ") + opName(bin->op));
+            RegOp op = binaryOps[static_cast<size_t>(bin->op)].reg;
+            RegOp withConst = binaryOps[static_cast<size_t>(bin->op)].withConst;
+
+            size_t top = nextTemp;
+            uint16_t l = compileExpr(bin->left);
+            auto rnum = bin->right->as<NumberNode>();
+            if (rnum && withConst != op) {
+                uint16_t k = constant(rnum);
+                nextTemp = top;
+                uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+                mark(bin);
+                emit(withConst, d, l, k);
+                return d;
+            }
+            uint16_t r = compileExpr(bin->right);
+            nextTemp = top;  // operands are dead once the op has read them
+            uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+            mark(bin);
+            emit(op, d, l, r);
+            return d;
+        }
+        case NodeKind::Unary: {
+            auto un = static_cast<const UnaryOpNode*>(node);
+            size_t top = nextTemp;
+            if (un->op == Op::Not) {
+                uint16_t e = compileExpr(un->expr);
+                nextTemp = top;
+                uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+                mark(un);
+                emit(RegOp::NOT, d, e);
+                return d;
+            }
+            if (un->op == Op::Neg) {
+                uint16_t zero = allocTemp();
+                emit(RegOp::LOADK, zero, constant(0));
+                uint16_t e = compileExpr(un->expr);
+                nextTemp = top;
+                uint16_t d = dst >= 0 ? static_cast<uint16_t>(dst) : allocTemp();
+                mark(un);
+                emit(RegOp::SUB, d, zero, e);
+                return d;
+            }
+            throw std::runtime_error(std::string("Unknown unary operator: ") + opName(un->op));
+        }
+        case NodeKind::Call:
+            if (!Compiler::isBuiltin(static_cast<const CallNode*>(node)->name))
+                throw SourceError("Functions need the stack engine", node->pos);
+            throw SourceError("Arrays need the stack engine", node->pos);
+        case NodeKind::Array:
+        case NodeKind::Index:
+            throw SourceError("Arrays need the stack engine", node->pos);
+        default:
+            break;
+    }
+    throw std::runtime_error("Unknown AST node in compiler");
+}
+
+// ---- statements ----
+
+void RegisterCompiler::compileStmt(const ASTNode* node) {
+    mark(node);
+    switch (node->kind) {
+        case NodeKind::Assignment: {
+            auto assign = static_cast<const AssignmentNode*>(node);
+            auto var = static_cast<uint16_t>(symbolTable.lookup(assign->varName));
+            compileExpr(assign->expr, var);
+            declared[var] = 1;
+            if (!known[var]) {
+                emit(RegOp::DEFINE, var);
+                known[var] = 1;
+            }
+            break;
+        }
+        case NodeKind::Print: {
+            auto print = static_cast<const PrintNode*>(node);
+            size_t top = nextTemp;
+            emit(RegOp::PRINT, compileExpr(print->expr));
+            nextTemp = top;
+            break;
+        }
+        case NodeKind::If: {
+            auto iff = static_cast<const IfNode*>(node);
+            uint32_t jfalse = compileJump(iff->condition, false, noJump);
+
+            // a variable is known after the if only if both paths assign it
+            auto before = known;
+            compileStmt(iff->thenBranch);
+            auto afterThen = known;
+            known = before;
+
+            if (iff->elseBranch) {
+                size_t jend = emit(RegOp::JMP);
+                patchList(jfalse, out->code.size());
+                compileStmt(iff->elseBranch);
+                patch(jend, out->code.size());
+            } else {
+                patchList(jfalse, out->code.size());
+            }
+            for (size_t i = 0; i < known.size(); ++i) known[i] = known[i] && afterThen[i];
+            break;
+        }
+        case NodeKind::While: {
+            auto wh = static_cast<const WhileNode*>(node);
+            size_t loopStart = out->code.size();
+            uint32_t jfalse = compileJump(wh->condition, false, noJump);
+
+            // the body may run zero times, so only the condition's reads
+            // count as known afterwards
+            auto afterCondition = known;
+            compileStmt(wh->body);
+            known = afterCondition;
+
+            size_t back = emit(RegOp::JMP);
+            patch(back, loopStart);
+            patchList(jfalse, out->code.size());
+            break;
+        }
+        case NodeKind::Block: {
+            auto block = static_cast<const BlockNode*>(node);
+            for (const ASTNode* stmt : block->statements) compileStmt(stmt);
+            break;
+        }
+        case NodeKind::Function:
+        case NodeKind::Return:
+            throw SourceError("Functions need the stack engine", node->pos);
+        default: {
+            // expression statement: evaluate for its errors, drop the value
+            size_t top = nextTemp;
+            compileExpr(node);
+            nextTemp = top;
+            break;
+        }
+    }
+}
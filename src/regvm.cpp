@@ -0,0 +1,142 @@
+#include "regvm.h"
+#include <stdexcept>
+
+std::string regOpToString(RegOp op) {
+    switch (op) {
+#define REGISTER_NAME_ENTRY(name) case RegOp::name: return #name;
+        REGISTER_OPCODES(REGISTER_NAME_ENTRY)
+#undef REGISTER_NAME_ENTRY
+    }
+    return "UNKNOWN";
+}
+
+void disassemble(const RegChunk& chunk, std::ostream& os) {
+    auto reg = [&](uint16_t r) {
+        std::string s = "r" + std::to_string(r);
+        if (r < chunk.names.size()) s += "(" + chunk.names[r] + ")";
+        return s;
+    };
+    for (const auto& in : chunk.code) {
+        os << regOpToString(in.op);
+        switch (in.op) {
+            case RegOp::MOVE:
+            case RegOp::NOT:
+                os << " " << reg(in.a) << ", " << reg(in.b);
+                break;
+            case RegOp::LOADK:
+                os << " " << reg(in.a) << ", #" << chunk.constants[in.b];
+                break;
+            case RegOp::JMP:
+                os << " " << in.target();
+                break;
+            case RegOp::JMPT:
+            case RegOp::JMPF:
+                os << " " << reg(in.a) << ", " << in.target();
+                break;
+            case RegOp::CHECK:
+            case RegOp::DEFINE:
+            case RegOp::PRINT:
+                os << " " << reg(in.a);
+                break;
+            case RegOp::ADDK: case RegOp::SUBK: case RegOp::MULK:
+            case RegOp::DIVK: case RegOp::MODK:
+            case RegOp::EQK:  case RegOp::NEQK:
+            case RegOp::LTK:  case RegOp::LTEK:
+            case RegOp::GTK:  case RegOp::GTEK:
+                os << " " << reg(in.a) << ", " << reg(in.b) << ", #" << chunk.constants[in.c];
+                break;
+            default:
+                os << " " << reg(in.a) << ", " << reg(in.b) << ", " << reg(in.c);
+                break;
+        }
+        os << "\n";
+    }
+}
+
+void RegisterVM::run(const RegChunkView& chunk) {
+    if (registers.size() < chunk.numRegisters) registers.resize(chunk.numRegisters, 0);
+    if (defined.size() < chunk.slots) defined.resize(chunk.slots, 0);
+    if (chunk.size == 0) return;
+
+    try {
+        if (dispatch == VM::Dispatch::Counting) runSwitch<true>(chunk);
+#if BYTECODE_COMPUTED_GOTO
+        else if (dispatch == VM::Dispatch::Threaded) runThreaded(chunk);
+#endif
+        else runSwitch<false>(chunk);
+    } catch (...) {
+        output->flush();
+        throw;
+    }
+    output->flush();
+}
+
+// Int arithmetic by the stack VM's rules (value.h): results wrap at 32
+// bits, and INT_MIN / -1 wraps to INT_MIN (remainder 0) instead of
+// trapping. The handlers check for a zero divisor first.
+static int wrapAdd(int a, int b) { return static_cast<int>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }
+static int wrapSub(int a, int b) { return static_cast<int>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)); }
+static int wrapMul(int a, int b) { return static_cast<int>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b)); }
+static int wrapDiv(int a, int b) { return b == -1 ? static_cast<int>(0u - static_cast<uint32_t>(a)) : a / b; }
+static int wrapMod(int a, int b) { return b == -1 ? 0 : a % b; }
+
+template <bool Counting>
+void RegisterVM::runSwitch(const RegChunkView& chunk) {
+    const RegInstr* code = chunk.code;
+    const RegInstr* end = code + chunk.size;
+    const RegInstr* ip = code;
+    int* r = registers.data();
+    const int* k = chunk.constants;
+
+#define CASE(name) case RegOp::name:
+#define NEXT ++ip; continue
+#define JUMP(t) ip = code + (t); continue
+
+    try {
+        while (ip != end) {
+            if (Counting) ++executed;
+            switch (ip->op) {
+#include "regvm_ops.inc"
+            }
+        }
+    } catch (std::runtime_error&) {
+        rethrowAt(chunk.positions, ip - code);
+    }
+
+#undef CASE
+#undef NEXT
+#undef JUMP
+}
+
+#if BYTECODE_COMPUTED_GOTO
+void RegisterVM::runThreaded(const RegChunkView& chunk) {
+    static const void* const labels[REGOP_COUNT] = {
+#define REGISTER_LABEL_ENTRY(name) &&op_##name,
+        REGISTER_OPCODES(REGISTER_LABEL_ENTRY)
+#undef REGISTER_LABEL_ENTRY
+    };
+
+    const RegInstr* code = chunk.code;
+    const RegInstr* end = code + chunk.size;
+    const RegInstr* ip = code;
+    int* r = registers.data();
+    const int* k = chunk.constants;
+
+#define DISPATCH() do { if (ip == end) return; goto *labels[static_cast<uint8_t>(ip->op)]; } while (0)
+#define CASE(name) op_##name:
+#define NEXT ++ip; DISPATCH()
+#define JUMP(t) ip = code + (t); DISPATCH()
+
+    try {
+        DISPATCH();
+#include "regvm_ops.inc"
+    } catch (std::runtime_error&) {
+        rethrowAt(chunk.positions, ip - code);
+    }
+
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+#undef JUMP
+}
+#endif
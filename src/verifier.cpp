@@ -0,0 +1,99 @@
+#include "verifier.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+[[noreturn]] static void invalid(const char* why, size_t pc) {
+    throw std::runtime_error(std::string(why) + " at instruction " + std::to_string(pc));
+}
+
+// The main code and each function are checked apart: jumps stay inside
+// one of them, and only a function uses locals and returns
+uint32_t verify(const ChunkView& chunk) {
+    const size_t size = chunk.size;
+    const size_t mainEnd = chunk.numFunctions ? chunk.functions[0].entry : size;
+    for (size_t i = 0; i < chunk.numFunctions; ++i) {
+        const Function& f = chunk.functions[i];
+        size_t start = i ? chunk.functions[i - 1].end : mainEnd;
+        bool last = i + 1 == chunk.numFunctions;
+        if (mainEnd == 0 || f.entry != start || f.end <= f.entry || f.end > size || (last && f.end != size) ||
+            f.params > f.locals)
+            throw std::runtime_error("function table out of range at function " + std::to_string(i));
+    }
+
+    // Depth on entry to each instruction, found by walking every path
+    // from the start of the code; -1 until a path gets there. The main
+    // code may end by falling off the end of the chunk at any depth.
+    std::vector<int64_t> depth(size + 1, -1);
+    std::vector<size_t> work;
+    int64_t deepest = 0;
+
+    auto walk = [&](size_t start, size_t end, const Function* function) {
+        const bool mayEnd = !function && end == size;
+        for (size_t pc = start; pc < end; ++pc) {
+            const Instruction& in = chunk.code[pc];
+            int pops, pushes;
+            if (in.op == OpCode::NEW_ARRAY && in.arg < 0) invalid("array size out of range", pc);
+            if (!stackEffect(in, pops, pushes)) invalid("unknown opcode", pc);
+            int32_t slot = slotOf(in);
+            if (slot != -1 && (slot < 0 || static_cast<size_t>(slot) >= chunk.slots)) invalid("variable out of range", pc);
+            if (isJump(in.op) && (in.arg < static_cast<int64_t>(start) || in.arg > static_cast<int64_t>(end) ||
+                                  (in.arg == static_cast<int64_t>(end) && !mayEnd)))
+                invalid("jump target out of range", pc);
+            if (in.op == OpCode::LOAD_DOUBLE && (in.arg < 0 || static_cast<size_t>(in.arg) >= chunk.numConstants))
+                invalid("constant out of range", pc);
+            if (in.op == OpCode::LOAD_LOCAL || in.op == OpCode::STORE_LOCAL || in.op == OpCode::RETURN ||
+                in.op == OpCode::TAIL_CALL) {
+                if (!function) invalid("local or return outside a function", pc);
+                if (in.op != OpCode::RETURN && in.op != OpCode::TAIL_CALL &&
+                    (in.arg < 0 || in.arg >= function->locals))
+                    invalid("local out of range", pc);
+            }
+            if (in.op == OpCode::CALL || in.op == OpCode::TAIL_CALL) {
+                if (in.arg < 0 || static_cast<size_t>(in.arg) >= chunk.numFunctions) invalid("function out of range", pc);
+                if (in.slot != chunk.functions[in.arg].params) invalid("wrong number of arguments", pc);
+            }
+        }
+
+        auto flow = [&](size_t from, size_t to, int64_t d) {
+            if (to == end && !mayEnd) invalid("code runs past its end", from);
+            if (depth[to] < 0) {
+                depth[to] = d;
+                if (to < end) work.push_back(to);
+            } else if (depth[to] != d && to < end) {
+                invalid("stack depth differs between paths", from);
+            }
+        };
+
+        int64_t frame = 0;
+        if (start < end) {
+            depth[start] = 0;
+            work.push_back(start);
+        }
+        while (!work.empty()) {
+            size_t pc = work.back();
+            work.pop_back();
+            const Instruction& in = chunk.code[pc];
+            int pops, pushes;
+            stackEffect(in, pops, pushes);
+            int64_t d = depth[pc] - pops;
+            if (d < 0) invalid("stack underflow", pc);
+            d += pushes;
+            frame = std::max(frame, d);
+
+            if (in.op == OpCode::HALT || in.op == OpCode::RETURN || in.op == OpCode::TAIL_CALL) continue;
+            if (isJump(in.op)) flow(pc, static_cast<size_t>(in.arg), d);
+            if (in.op != OpCode::JMP) flow(pc, pc + 1, d);
+        }
+        // a call's locals sit below its operands
+        if (function) frame += function->locals;
+        deepest = std::max(deepest, frame);
+        if (deepest >= unverifiedStack) invalid("stack too deep", start);
+    };
+
+    walk(0, mainEnd, nullptr);
+    for (size_t i = 0; i < chunk.numFunctions; ++i)
+        walk(chunk.functions[i].entry, chunk.functions[i].end, &chunk.functions[i]);
+    return static_cast<uint32_t>(deepest);
+}
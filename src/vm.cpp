@@ -1,122 +1,266 @@
 #include "vm.h"
+#include <algorithm>
 
-int VM::pop() {
-    if (stack.empty()) throw std::runtime_error("Stack underflow");
-    int val = stack.back();
-    stack.pop_back();
-    return val;
-}
-
-void VM::run(const std::vector<Instruction>& bytecode) {
-    for (size_t pc = 0; pc < bytecode.size(); /* ++pc below */) {
-        const auto& instr = bytecode[pc];
-        switch (instr.op) {
-            case OpCode::LOAD_CONST:
-                push(std::stoi(instr.arg));
-                break;
-            case OpCode::LOAD_VAR:
-                if (variables.find(instr.arg) == variables.end())
-                    throw std::runtime_error("Undefined variable: " + instr.arg);
-                push(variables[instr.arg]);
-                break;
-            case OpCode::STORE_VAR: {
-                int val = pop();
-                variables[instr.arg] = val;
-                break;
-            }
-            case OpCode::ADD: {
-                int b = pop(), a = pop();
-                push(a + b);
-                break;
-            }
-            case OpCode::SUB: {
-                int b = pop(), a = pop();
-                push(a - b);
-                break;
-            }
-            case OpCode::MUL: {
-                int b = pop(), a = pop();
-                push(a * b);
-                break;
-            }
-            case OpCode::DIV: {
-                int b = pop(), a = pop();
-                if (b == 0) throw std::runtime_error("Division by zero");
-                push(a / b);
-                break;
-            }
-            case OpCode::MOD: {
-                int b = pop(), a = pop();
-                push(a % b);
-                break;
-            }
-            case OpCode::PRINT: {
-                int val = pop();
-                std::cout << val << std::endl;
-                break;
-            }
-            case OpCode::CMP_EQ: {
-                int b = pop(), a = pop();
-                push(a == b ? 1 : 0);
-                break;
-            }
-            case OpCode::CMP_NEQ: {
-                int b = pop(), a = pop();
-                push(a != b ? 1 : 0);
-                break;
-            }
-            case OpCode::CMP_LT: {
-                int b = pop(), a = pop();
-                push(a < b ? 1 : 0);
-                break;
-            }
-            case OpCode::CMP_LTE: {
-                int b = pop(), a = pop();
-                push(a <= b ? 1 : 0);
-                break;
-            }
-            case OpCode::CMP_GT: {
-                int b = pop(), a = pop();
-                push(a > b ? 1 : 0);
-                break;
-            }
-            case OpCode::CMP_GTE: {
-                int b = pop(), a = pop();
-                push(a >= b ? 1 : 0);
-                break;
-            }
-            case OpCode::LOGICAL_AND: {
-                int b = pop(), a = pop();
-                push((a && b) ? 1 : 0);
-                break;
-            }
-            case OpCode::LOGICAL_OR: {
-                int b = pop(), a = pop();
-                push((a || b) ? 1 : 0);
-                break;
-            }
-            case OpCode::LOGICAL_NOT: {
-                int a = pop();
-                push(!a ? 1 : 0);
-                break;
-            }
+void VM::stackUnderflow() {
+    throw std::runtime_error("Stack underflow");
+}
 
-            // Only these three are new:
-            case OpCode::JMP: {
-                pc = static_cast<size_t>(std::stoul(instr.arg));
-                continue;
-            }
-            case OpCode::JMP_IF_TRUE: {
-                int c = pop();
-                if (c) { pc = static_cast<size_t>(std::stoul(instr.arg)); continue; }
-                break;
-            }
-            case OpCode::JMP_IF_FALSE: {
-                int c = pop();
-                if (!c) { pc = static_cast<size_t>(std::stoul(instr.arg)); continue; }
-                break;
+void VM::callDepthExceeded() const {
+    throw std::runtime_error("Call depth limit exceeded (" + std::to_string(callDepthLimit) + " calls)");
+}
+
+void VM::growStack(size_t size) {
+    stack.resize(std::max(size, stack.size() * 2));
+}
+
+void VM::reset() {
+    stack.clear();
+    arrays.clear();
+    std::fill(variables.begin(), variables.end(), Value());
+    std::fill(defined.begin(), defined.end(), 0);
+}
+
+void VM::arrayCondition() {
+    throw std::runtime_error("Arrays cannot be used as conditions");
+}
+
+void VM::arrayCondition(ArrayOp op, Value a, Value b) {
+    arrayBinary(op, a, b);
+    arrayCondition();
+}
+
+void VM::collectArrays(Value a, Value b) {
+    // the whole stack: unchecked loops leave it sized to maxStack, and a
+    // stale slot only keeps an array alive a little longer
+    for (Value v : stack) arrays.mark(v);
+    for (Value v : variables) arrays.mark(v);
+    arrays.mark(a);
+    arrays.mark(b);
+    arrays.sweep();
+}
+
+Value VM::arrayBinary(ArrayOp op, Value a, Value b) {
+    if (arrays.collectionDue()) collectArrays(a, b);
+    return arrays.binary(op, a, b);
+}
+
+Value VM::newArray(const Value* elements, size_t n) {
+    if (arrays.collectionDue()) collectArrays(Value(), Value());   // the elements are still on the stack
+    return arrays.make(elements, n);
+}
+
+Value VM::arrayRange(Value n) {
+    if (arrays.collectionDue()) collectArrays(n, Value());
+    return arrays.range(n);
+}
+
+void VM::printArray(Value array) {
+    text.clear();
+    arrays.format(array, text);
+    output->print(std::string_view(text));
+}
+
+void VM::setVariable(size_t slot, Value value) {
+    if (variables.size() <= slot) {
+        variables.resize(slot + 1);
+        defined.resize(slot + 1, 0);
+    }
+    variables[slot] = value;
+    defined[slot] = 1;
+}
+
+bool VM::getVariable(size_t slot, Value& value) const {
+    if (slot >= variables.size() || !defined[slot]) return false;
+    value = variables[slot];
+    return true;
+}
+
+void VM::run(const ChunkView& source) {
+    if (variables.size() < source.slots) {
+        variables.resize(source.slots);
+        defined.resize(source.slots, 0);
+    }
+    if (source.size == 0) return;
+
+    // The loops below may rewrite the code they run, so they get the
+    // VM's own copy; the quickened state lasts for this run only, since
+    // reset() and setVariable() can change what it was based on
+    ChunkView chunk = source;
+    compiled = source.code;
+    quickActive = quickening && !profiler;
+    if (quickActive) {
+        quick.assign(source.code, source.code + source.size);
+        chunk.code = quick.data();
+    }
+
+    jitActive = jitEnabled && !profiler;
+    if (jitActive) {
+        jit.release();
+        loops.assign(chunk.size, LoopState{});
+    }
+
+    // Verified code gets a stack deep enough for any path, so its loops
+    // skip the bounds checks; each call makes sure of room for its frame
+    const bool checked = chunk.maxStack == unverifiedStack;
+    stack.clear();
+    stackFloor = 0;
+    if (!checked) stack.resize(chunk.maxStack + size_t(1));
+    if (chunk.numFunctions && frameCapacity != callDepthLimit) {
+        frames.reset(new Frame[callDepthLimit]);
+        frameCapacity = callDepthLimit;
+    }
+
+    try {
+        if (profiler) {
+            profiler->begin(chunk);
+            if (checked) runSwitch<Hook::Profile, true>(chunk);
+            else runSwitch<Hook::Profile, false>(chunk);
+            profiler->end();
+        }
+        else if (dispatch == Dispatch::Counting) {
+            if (checked) runSwitch<Hook::Count, true>(chunk);
+            else runSwitch<Hook::Count, false>(chunk);
+        }
+#if BYTECODE_COMPUTED_GOTO
+        else if (dispatch == Dispatch::Threaded) {
+            if (checked) runThreaded<true>(chunk);
+            else runThreaded<false>(chunk);
+        }
+#endif
+        else if (checked) runSwitch<Hook::None, true>(chunk);
+        else runSwitch<Hook::None, false>(chunk);
+    } catch (...) {
+        if (profiler) profiler->end();
+        stack.clear();
+        stackFloor = 0;
+        output->flush();
+        throw;
+    }
+    stack.clear();
+    output->flush();
+}
+
+// Native code prints through this, with the VM's sink as context
+static void jitPrint(void* sink, int value) {
+    static_cast<OutputSink*>(sink)->print(value);
+}
+
+// Handlers rewrite the instruction they are running. ip points into the
+// VM's quickened copy whenever a handler gets here: generic handlers
+// check quickActive first, and the quickened forms only exist in the copy.
+#define QUICKEN(name) (const_cast<Instruction*>(ip)->op = OpCode::name)
+// Back to the generic form for good; 'reserved' stops it quickening again
+#define DESPECIALIZE(name) (const_cast<Instruction*>(ip)->reserved = 1, QUICKEN(name))
+// a op b, element by element when either is an array; scalar otherwise
+#define ELEMENTWISE(op, a, b, scalar) (eitherArray(a, b) ? arrayBinary(ArrayOp::op, a, b) : Value(scalar))
+
+size_t VM::backEdge(const ChunkView& chunk, size_t pc) {
+    auto head = static_cast<size_t>(chunk.code[pc].arg);
+    LoopState& loop = loops[pc];
+    if (!loop.code) {
+        if (loop.failed || ++loop.count < jitThreshold) return head;
+        // the JIT translates the code as compiled, not its quickened copy
+        ChunkView original = chunk;
+        original.code = compiled;
+        loop.code = jit.compileLoop(original, head, pc, defined.data(), jitPrint);
+        if (!loop.code) {
+            loop.failed = true;
+            return head;
+        }
+    }
+    // on-stack replacement: the loop's state is all in variables, so
+    // native code can take over at the loop head
+    int64_t next = loop.code(variables.data(), output);
+    if (next < 0) throw SourceError("Division by zero", chunk.positions.at(static_cast<size_t>(-next - 1)));
+    // Only a failed int guard hands back the head (leaving the loop goes
+    // past it). A double in one of its variables tends to stay, so
+    // interpret the loop for the rest of the run rather than paying for
+    // an entry and a bail on every iteration.
+    if (static_cast<size_t>(next) == head) {
+        loop.code = nullptr;
+        loop.failed = true;
+    }
+    return static_cast<size_t>(next);
+}
+
+// Portable loop: one switch, one shared indirect branch.
+template <VM::Hook H, bool Checked>
+void VM::runSwitch(const ChunkView& chunk) {
+    const Instruction* code = chunk.code;
+    const Instruction* end = code + chunk.size;
+    const Instruction* ip = code;
+    Value* sp = stack.data();
+    size_t depth = 0;                  // calls in progress
+    size_t base = 0;                   // first local of the current call
+    Value* locals = sp;                // the same, for unchecked loops
+
+#define PUSH(v) (Checked ? push(v) : void(*sp++ = (v)))
+#define POP() (Checked ? pop() : *--sp)
+#define CASE(name) case OpCode::name:
+#define NEXT ++ip; continue
+#define JUMP(target) ip = code + (target); continue
+#define STOP return
+
+    try {
+        while (ip != end) {
+            if (H == Hook::Count) ++executed;
+            if (H == Hook::Profile) profiler->step(static_cast<size_t>(ip - code));
+            switch (ip->op) {
+#include "vm_ops.inc"
             }
         }
-        ++pc;
+    } catch (std::runtime_error&) {
+        rethrowAt(chunk.positions, ip - code);
     }
+
+#undef PUSH
+#undef POP
+#undef CASE
+#undef NEXT
+#undef JUMP
+#undef STOP
+}
+
+#if BYTECODE_COMPUTED_GOTO
+// Direct-threaded loop (GCC/Clang labels-as-values): every handler ends in
+// its own indirect jump to the next handler, which predicts much better.
+template <bool Checked>
+void VM::runThreaded(const ChunkView& chunk) {
+    static const void* const labels[OPCODE_COUNT] = {
+#define BYTECODE_LABEL_ENTRY(name) &&op_##name,
+        BYTECODE_OPCODES(BYTECODE_LABEL_ENTRY)
+#undef BYTECODE_LABEL_ENTRY
+    };
+
+    const Instruction* code = chunk.code;
+    const Instruction* end = code + chunk.size;
+    const Instruction* ip = code;
+    Value* sp = stack.data();
+    size_t depth = 0;                  // calls in progress
+    size_t base = 0;                   // first local of the current call
+    Value* locals = sp;                // the same, for unchecked loops
+
+#define PUSH(v) (Checked ? push(v) : void(*sp++ = (v)))
+#define POP() (Checked ? pop() : *--sp)
+#define DISPATCH() do { if (ip == end) return; goto *labels[static_cast<uint8_t>(ip->op)]; } while (0)
+#define CASE(name) op_##name:
+#define NEXT ++ip; DISPATCH()
+#define JUMP(target) ip = code + (target); DISPATCH()
+#define STOP return
+
+    try {
+        DISPATCH();
+#include "vm_ops.inc"
+    } catch (std::runtime_error&) {
+        rethrowAt(chunk.positions, ip - code);
+    }
+
+#undef DISPATCH
+#undef PUSH
+#undef POP
+#undef CASE
+#undef NEXT
+#undef JUMP
+#undef STOP
 }
+#endif
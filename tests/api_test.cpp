@@ -0,0 +1,164 @@
+// The embedding API and the compiled-program cache, checked against
+// known answers: libbytecode programs with bindings, inputs and errors,
+// batch evaluation against a run per row, and ProgramCache hits,
+// relinking, saving and loading. Exits 1 on any wrong answer.
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "cache.h"
+#include "compiler.h"
+#include "libbytecode.h"
+#include "vm.h"
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cout << "FAILED: " << what << "\n";
+    ++failures;
+}
+
+static void library() {
+    auto program = bytecode::compile("total = price * qty; print total;");
+    check(program.ok(), "compile");
+    check(program.inputs() == std::vector<std::string>{"price", "qty"}, "inputs in order of first read");
+    auto result = program.run({{"price", 12.5}, {"qty", 3}, {"unused", 1}});
+    check(result.ok && result.output == "37.5\n", "run with bindings");
+    const Value* total = result.find("total");
+    check(total && total->isDouble() && total->asDouble() == 37.5, "result variables");
+    check(!result.find("nothing"), "unassigned variable");
+
+    result = program.run({{"price", 2}});
+    check(!result.ok && result.error.message == "Undefined variable: qty" && result.error.line == 1 &&
+              result.error.column == 17, "missing binding fails where it is read");
+
+    auto divide = bytecode::compile("print 1;\nprint 10 / d;", {true});
+    result = divide.run({{"d", 0}});
+    check(!result.ok && result.output == "1\n" && result.error.message == "Division by zero" &&
+              result.error.line == 2 && result.error.column == 10, "runtime error keeps output and position");
+
+    auto broken = bytecode::compile("x = (1 + ;");
+    check(!broken.ok() && broken.error().line == 1, "compile error is kept");
+    check(!broken.run().ok && broken.run().error.message == broken.error().message, "run repeats the compile error");
+
+    // functions read inputs as globals
+    auto scaled = bytecode::compile("func scale(x) { return x * k; } print scale(price) + scale(1);");
+    check(scaled.inputs() == std::vector<std::string>{"price", "k"}, "inputs read inside functions");
+    result = scaled.run({{"price", 4}, {"k", 3}});
+    check(result.ok && result.output == "15\n", "functions with bound globals");
+}
+
+static void batch() {
+    const size_t rows = 3000;
+    std::vector<int32_t> qty(rows);
+    std::vector<double> price(rows);
+    for (size_t r = 0; r < rows; ++r) {
+        qty[r] = static_cast<int32_t>(r % 13) - 2;
+        price[r] = static_cast<double>(r % 101) * 0.25;
+    }
+    const char* expressions[] = {"price * qty > 10.0 && qty != 0", "qty * 3 - 1", "price / 2 + qty",
+                                 "!(qty < 3) || price == 0.0", "qty != 0 && 100 / qty > 20",
+                                 "-price", "-qty * 2 - -price"};
+    for (const char* source : expressions) {
+        auto expression = bytecode::compileExpression(source);
+        auto columns = expression.evaluate({{"price", price.data()}, {"qty", qty.data()}}, rows);
+        auto program = bytecode::compile(std::string("r = ") + source + ";");
+        bool same = columns.ok && columns.rows == rows;
+        for (size_t r = 0; same && r < rows; ++r) {
+            auto result = program.run({{"price", price[r]}, {"qty", qty[r]}});
+            same = result.ok && result.find("r")->raw() == columns.value(r).raw();
+        }
+        check(same, std::string("batch evaluation matches a run per row: ") + source);
+    }
+
+    // division by zero at the first row with qty == 0, as a run per row
+    auto failing = bytecode::compileExpression("price + 10 / qty").evaluate({{"price", price.data()}, {"qty", qty.data()}}, rows);
+    check(!failing.ok && failing.row == 2 && failing.error.message == "Division by zero", "batch error row");
+    auto missing = bytecode::compileExpression("price + other").evaluate({{"price", price.data()}}, rows);
+    check(!missing.ok, "missing column");
+}
+
+static std::string run(const Chunk& chunk, VM& vm) {
+    CaptureSink captured;
+    vm.setOutput(&captured);
+    vm.run(chunk);
+    vm.setOutput(nullptr);
+    return captured.str();
+}
+
+static void cache() {
+    const std::string path = "api_test.cache";
+    ProgramCache cache;
+    Compiler compiler;
+    VM vm;
+    run(cache.get("a = 4;", compiler, false), vm);
+    run(cache.get("b = a * 2;", compiler, false), vm);
+    check(cache.stats().misses == 2 && cache.stats().hits == 0, "misses");
+
+    // the same line again (trailing whitespace aside) hits and relinks
+    std::string out = run(cache.get("b = a * 2;  \n", compiler, false), vm);
+    run(cache.get("print b + a;", compiler, false), vm);
+    out = run(cache.get("print b + a;", compiler, false), vm);
+    check(cache.stats().hits == 2 && out == "12\n", "hits");
+
+    // a fresh compiler numbers variables differently; the cached code
+    // is linked into its slots
+    Compiler other;
+    VM otherVm;
+    run(cache.get("z = 1;", other, false), otherVm);
+    run(cache.get("a = 4;", other, false), otherVm);
+    run(cache.get("b = a * 2;", other, false), otherVm);
+    out = run(cache.get("print b + a;", other, false), otherVm);
+    check(out == "12\n" && other.symbols().lookup("a") == 1, "relinked into another symbol table");
+
+    // functions depend on the compiler, so they are never cached
+    size_t entries = cache.stats().entries;
+    run(cache.get("func f(x) { return x + a; }", compiler, false), vm);
+    out = run(cache.get("print f(1);", compiler, false), vm);
+    out += run(cache.get("print f(1);", compiler, false), vm);
+    check(out == "5\n5\n" && cache.stats().entries == entries, "functions bypass the cache");
+
+    cache.save(path);
+    ProgramCache loaded;
+    check(loaded.load(path) && loaded.stats().entries == entries, "load");
+    Compiler fresh;
+    VM freshVm;
+    run(loaded.get("a = 4;", fresh, true), freshVm);
+    check(loaded.stats().misses == 1, "an -O lookup does not hit a plain entry");
+    run(loaded.get("b = a * 2;", fresh, false), freshVm);
+    out = run(loaded.get("print b + a;", fresh, false), freshVm);
+    check(loaded.stats().hits == 2 && out == "12\n", "saved entries hit after loading");
+
+    // a damaged file is ignored and changes nothing
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto damaged = [&](const std::string& contents) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+        ProgramCache c;
+        return !c.load(path) && c.stats().entries == 0;
+    };
+    check(damaged(bytes.substr(0, bytes.size() - 3)), "truncated file");
+    std::string version = bytes;
+    version[sizeof(uint32_t)] ^= 0x40;
+    check(damaged(version), "file from another version");
+    check(damaged(bytes + "x"), "trailing bytes");
+    ProgramCache none;
+    check(!none.load("no-such-file.cache"), "missing file");
+    check(!none.load("."), "a directory");
+    std::remove(path.c_str());
+}
+
+int main() {
+    library();
+    batch();
+    cache();
+    if (failures) std::cout << failures << " check(s) failed\n";
+    else std::cout << "all API and cache checks passed\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+// Malformed code must be rejected, never run. Hand-built stack chunks
+// that verify() has to refuse, and images written from valid programs
+// and then damaged one field at a time, which Image has to refuse with
+// "Bad bytecode image". Every case must fail with the expected message;
+// the undamaged images must load and run. Exits 1 otherwise.
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "compiler.h"
+#include "image.h"
+#include "lexer.h"
+#include "parser.h"
+#include "regcompiler.h"
+#include "verifier.h"
+#include "vm.h"
+
+static int failures = 0;
+
+static void expectError(const std::string& name, const std::string& message, const std::function<void()>& f) {
+    try {
+        f();
+    } catch (std::runtime_error& e) {
+        if (std::string(e.what()).find(message) != std::string::npos) return;
+        std::cout << name << ": expected \"" << message << "\", got \"" << e.what() << "\"\n";
+        ++failures;
+        return;
+    }
+    std::cout << name << ": accepted, expected \"" << message << "\"\n";
+    ++failures;
+}
+
+// ---- bytecode ----
+
+struct BadChunk {
+    const char* name;
+    const char* message;
+    Chunk chunk;
+};
+
+static Chunk chunk(std::vector<Instruction> code, size_t slots = 1, std::vector<Function> functions = {}) {
+    Chunk c;
+    c.code = std::move(code);
+    c.names.assign(slots, "x");
+    c.functions = std::move(functions);
+    return c;
+}
+
+using I = Instruction;
+using O = OpCode;
+
+static std::vector<BadChunk> badChunks() {
+    return {
+        {"unknown opcode", "unknown opcode", chunk({I(static_cast<O>(250)), I(O::HALT)})},
+        {"variable slot", "variable out of range", chunk({I(O::LOAD_VAR, 3), I(O::POP), I(O::HALT)})},
+        {"superinstruction slot", "variable out of range", chunk({I(O::INC_VAR, 1, 5), I(O::HALT)})},
+        {"double constant", "constant out of range", chunk({I(O::LOAD_DOUBLE, 0), I(O::POP), I(O::HALT)})},
+        {"jump past the end", "jump target out of range", chunk({I(O::JMP, 7), I(O::HALT)})},
+        {"negative jump", "jump target out of range", chunk({I(O::JMP, -1), I(O::HALT)})},
+        {"underflow", "stack underflow", chunk({I(O::LOAD_CONST, 1), I(O::ADD), I(O::HALT)})},
+        {"pop empty", "stack underflow", chunk({I(O::POP), I(O::HALT)})},
+        {"merge depths", "stack depth differs",
+         chunk({I(O::LOAD_CONST, 1), I(O::JMP_IF_FALSE, 3), I(O::LOAD_CONST, 2), I(O::HALT)})},
+        {"array size", "array size out of range", chunk({I(O::NEW_ARRAY, -1), I(O::HALT)})},
+        {"quickened form", "unknown opcode", chunk({I(O::LOAD_CONST, 1), I(O::LOAD_CONST, 2), I(O::ADD_INT_INT), I(O::HALT)})},
+        {"runs off the end", "code runs past its end",
+         chunk({I(O::HALT), I(O::LOAD_CONST, 1), I(O::POP)}, 1, {{1, 3, 0, 0}})},
+        {"return in main", "local or return outside a function", chunk({I(O::LOAD_CONST, 1), I(O::RETURN)})},
+        {"local in main", "local or return outside a function", chunk({I(O::LOAD_LOCAL, 0), I(O::POP), I(O::HALT)})},
+        {"local index", "local out of range",
+         chunk({I(O::HALT), I(O::LOAD_LOCAL, 2), I(O::RETURN)}, 1, {{1, 3, 1, 1}})},
+        {"call index", "function out of range",
+         chunk({I(O::CALL, 1, 0), I(O::POP), I(O::HALT), I(O::LOAD_CONST, 0), I(O::RETURN)}, 1, {{3, 5, 0, 0}})},
+        {"argument count", "wrong number of arguments",
+         chunk({I(O::CALL, 0, 0), I(O::POP), I(O::HALT), I(O::LOAD_LOCAL, 0), I(O::RETURN)}, 1, {{3, 5, 1, 1}})},
+        {"jump out of a function", "jump target out of range",
+         chunk({I(O::HALT), I(O::JMP, 0), I(O::LOAD_CONST, 0), I(O::RETURN)}, 1, {{1, 4, 0, 0}})},
+        {"function table", "function table out of range",
+         chunk({I(O::HALT), I(O::LOAD_CONST, 0), I(O::RETURN)}, 1, {{1, 9, 0, 0}})},
+        {"fewer locals than params", "function table out of range",
+         chunk({I(O::HALT), I(O::LOAD_CONST, 0), I(O::RETURN)}, 1, {{1, 3, 2, 1}})},
+    };
+}
+
+// ---- images ----
+
+static Ast parse(const std::string& source) {
+    Lexer lexer(source);
+    Parser parser(lexer.tokenize());
+    return parser.parse();
+}
+
+static const char* const stackSource =
+    "func twice(x) { return x * 2; } i = 0; s = 0.5; while (i < 10) { s = s + twice(i); i = i + 1; } print s;";
+static const char* const registerSource = "i = 0; s = 0; while (i < 10) { s = s + i; i = i + 1; } print s;";
+
+static std::string stackImage() {
+    Compiler compiler;
+    Chunk c = compiler.compile(parse(stackSource));
+    std::ostringstream out;
+    writeImage(c, out);
+    return out.str();
+}
+
+static std::string registerImage() {
+    RegisterCompiler compiler;
+    RegChunk c = compiler.compile(parse(registerSource));
+    std::ostringstream out;
+    writeImage(c, out);
+    return out.str();
+}
+
+static const std::string imagePath = "reject_test.bvc";
+
+static void save(const std::string& bytes) {
+    std::ofstream out(imagePath, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+static std::string runImage(const std::string& bytes) {
+    save(bytes);
+    Image image(imagePath);
+    CaptureSink captured;
+    if (image.engine() == ImageEngine::Stack) {
+        VM vm;
+        vm.setOutput(&captured);
+        vm.run(image.chunk());
+    } else {
+        RegisterVM vm;
+        vm.setOutput(&captured);
+        vm.run(image.regChunk());
+    }
+    return captured.str();
+}
+
+static ImageHeader header(const std::string& bytes) {
+    ImageHeader h;
+    std::memcpy(&h, bytes.data(), sizeof h);
+    return h;
+}
+
+static std::string withHeader(std::string bytes, const std::function<void(ImageHeader&)>& edit) {
+    ImageHeader h = header(bytes);
+    edit(h);
+    std::memcpy(&bytes[0], &h, sizeof h);
+    return bytes;
+}
+
+// Overwrites instruction pc of a stack image
+static std::string withInstruction(std::string bytes, size_t pc, Instruction in) {
+    std::memcpy(&bytes[header(bytes).code.offset + pc * sizeof in], &in, sizeof in);
+    return bytes;
+}
+
+static void expectBadImage(const std::string& name, const std::string& message, const std::string& bytes) {
+    expectError(name, "Bad bytecode image: " + message, [&] {
+        save(bytes);
+        Image image(imagePath);
+    });
+}
+
+int main() {
+    for (auto& c : badChunks()) expectError(c.name, c.message, [&] { verify(c.chunk); });
+
+    const std::string stack = stackImage(), reg = registerImage();
+    if (runImage(stack) != "90.5\n" || runImage(reg) != "45\n") {
+        std::cout << "undamaged images: wrong output\n";
+        ++failures;
+    }
+    const ImageHeader sh = header(stack);
+
+    expectBadImage("empty file", "file too small", "");
+    expectBadImage("header cut short", "file too small", stack.substr(0, sizeof(ImageHeader) - 1));
+    expectBadImage("magic", "not a bytecode image", withHeader(stack, [](ImageHeader& h) { h.magic[0] = 'X'; }));
+    expectBadImage("byte order", "written on a machine with another byte order", withHeader(stack, [](ImageHeader& h) { h.byteOrder = 0x04030201; }));
+    expectBadImage("version", "version 2, expected", withHeader(stack, [](ImageHeader& h) { h.version = 2; }));
+    expectBadImage("engine", "unknown engine", withHeader(stack, [](ImageHeader& h) { h.engine = 7; }));
+    expectBadImage("truncated", "truncated or oversized", stack.substr(0, stack.size() - 8));
+    expectBadImage("oversized", "truncated or oversized", stack + std::string(8, '\0'));
+    expectBadImage("code count", "code section out of bounds",
+                   withHeader(stack, [](ImageHeader& h) { h.code.count += 1000; }));
+    expectBadImage("unaligned section", "constant section out of bounds",
+                   withHeader(stack, [](ImageHeader& h) { h.constants.offset += 4; }));
+    expectBadImage("section in header", "function section out of bounds",
+                   withHeader(stack, [](ImageHeader& h) { h.functions.offset = 0; }));
+    expectBadImage("name lengths", "name table out of bounds", withHeader(stack, [&](ImageHeader& h) {
+        h.nameBytes.count = 0;
+    }));
+    expectBadImage("opcode", "unknown opcode", withInstruction(stack, 0, I(static_cast<O>(250))));
+    expectBadImage("quickened opcode", "unknown opcode", withInstruction(stack, 0, I(O::LOAD_VAR_SLOT, 0, 0)));
+    expectBadImage("jump target", "jump target out of range", withInstruction(stack, 0, I(O::JMP, 100000)));
+    expectBadImage("variable slot", "variable out of range", withInstruction(stack, 0, I(O::LOAD_VAR, 999)));
+    expectBadImage("double constant", "constant out of range", withInstruction(stack, 0, I(O::LOAD_DOUBLE, 99)));
+
+    // the function table: point the function past the code
+    std::string table = stack;
+    Function f;
+    std::memcpy(&f, &table[sh.functions.offset], sizeof f);
+    f.end = static_cast<uint32_t>(sh.code.count) + 1;
+    std::memcpy(&table[sh.functions.offset], &f, sizeof f);
+    expectBadImage("function table", "function table out of range", table);
+
+    const ImageHeader rh = header(reg);
+    expectBadImage("register count", "register count out of range",
+                   withHeader(reg, [](ImageHeader& h) { h.numRegisters = 0; }));
+    expectBadImage("functions in a register image", "functions in a register image",
+                   withHeader(reg, [&](ImageHeader& h) { h.functions = {rh.code.offset, 1}; }));
+
+    std::remove(imagePath.c_str());
+    if (failures) std::cout << failures << " case(s) failed\n";
+    else std::cout << "all malformed bytecode and images rejected\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+# Runs one golden-output script and compares what it prints (stdout and
+# stderr together) with the expected file. Invoked by ctest as
+#   cmake -DBYTECODE=<Bytecode> -DSCRIPT=<x.bvm> -DEXPECTED=<x.out>
+#         -DMODE=<run|image> -DARGS=<-O;--engine=register> -DIMAGE=<tmp.bvc>
+#         -P run_golden.cmake
+# MODE run executes the source; image compiles it to IMAGE and runs that.
+# The script's path (and the image's) prints as "script", so one expected
+# file serves every mode. A crash, or any exit status but 0 or 1, fails.
+
+function(run_bytecode out)
+    execute_process(COMMAND ${BYTECODE} ${ARGN}
+                    OUTPUT_VARIABLE text ERROR_VARIABLE text RESULT_VARIABLE status)
+    if(NOT status STREQUAL "0" AND NOT status STREQUAL "1")
+        message(FATAL_ERROR "Bytecode ${ARGN}: ${status}\n${text}")
+    endif()
+    set(${out} "${text}" PARENT_SCOPE)
+    set(${out}_status "${status}" PARENT_SCOPE)
+endfunction()
+
+if(MODE STREQUAL "image")
+    file(REMOVE "${IMAGE}")
+    run_bytecode(output compile ${ARGS} "${SCRIPT}" -o "${IMAGE}")
+    if(output_status STREQUAL "0")
+        run_bytecode(ran run "${IMAGE}")
+        string(APPEND output "${ran}")
+        file(REMOVE "${IMAGE}")
+    endif()
+else()
+    run_bytecode(output run ${ARGS} "${SCRIPT}")
+endif()
+
+string(REPLACE "${SCRIPT}" "script" output "${output}")
+if(IMAGE)
+    string(REPLACE "${IMAGE}" "script" output "${output}")
+endif()
+file(READ "${EXPECTED}" expected)
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "output differs from ${EXPECTED}\n--- expected\n${expected}--- got\n${output}")
+endif()